@@ -0,0 +1,206 @@
+#include "Arena.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <new>
+
+#include <Windows.h>
+
+namespace
+{
+	std::mutex s_threadArenasMutex;
+	std::vector<Arena*> s_threadArenas;
+
+	// Registers itself so ResetThreadArenas can get at it, and unregisters when the thread exits
+	struct ThreadArena
+	{
+		Arena arena;
+
+		ThreadArena()
+		{
+			std::scoped_lock lock(s_threadArenasMutex);
+			s_threadArenas.push_back(&arena);
+		}
+
+		~ThreadArena()
+		{
+			std::scoped_lock lock(s_threadArenasMutex);
+			s_threadArenas.erase(std::find(s_threadArenas.begin(), s_threadArenas.end(), &arena));
+		}
+	};
+
+	bool EnableLockMemoryPrivilege()
+	{
+		HANDLE token;
+		if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token))
+			return false;
+
+		TOKEN_PRIVILEGES privileges = {};
+		privileges.PrivilegeCount = 1;
+		privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+		bool enabled = LookupPrivilegeValue(nullptr, SE_LOCK_MEMORY_NAME, &privileges.Privileges[0].Luid)
+			&& AdjustTokenPrivileges(token, FALSE, &privileges, 0, nullptr, nullptr)
+			&& GetLastError() == ERROR_SUCCESS;
+		CloseHandle(token);
+		return enabled;
+	}
+}
+
+Arena::Arena(size_t _blockSize) :
+	m_blockSize(_blockSize)
+{
+	// Blocks are only allocated when they're needed, but make room to keep track of them now so growing doesn't
+	// touch the heap
+	m_blocks.reserve(16);
+}
+
+Arena::~Arena()
+{
+	for (auto const& block : m_blocks)
+		FreeBlock(block);
+}
+
+void* Arena::Allocate(size_t _size, size_t _alignment)
+{
+	if (!m_blocks.empty())
+	{
+		Block const& block = m_blocks.back();
+		size_t offset = (m_used + _alignment - 1) & ~(_alignment - 1);
+		if (offset + _size <= block.size)
+		{
+			m_used = offset + _size;
+			return block.data + offset;
+		}
+	}
+
+	// Blocks are page aligned, so that's enough for any alignment we'll be asked for
+	Block block = AllocateBlock(std::max(_size, m_blockSize));
+	m_blocks.push_back(block);
+	m_used = _size;
+	return block.data;
+}
+
+void Arena::Reset()
+{
+	if (m_blocks.size() > 1)
+	{
+		const size_t total = GetCapacity();
+		for (auto const& block : m_blocks)
+			FreeBlock(block);
+		m_blocks.clear();
+		m_blockSize = std::max(m_blockSize, total);
+		m_blocks.push_back(AllocateBlock(m_blockSize));
+	}
+	m_used = 0;
+}
+
+size_t Arena::GetCapacity() const
+{
+	size_t total = 0;
+	for (auto const& block : m_blocks)
+		total += block.size;
+	return total;
+}
+
+Arena& Arena::GetThreadArena()
+{
+	thread_local ThreadArena threadArena;
+	return threadArena.arena;
+}
+
+void Arena::ResetThreadArenas()
+{
+	std::scoped_lock lock(s_threadArenasMutex);
+	for (Arena* arena : s_threadArenas)
+		arena->Reset();
+}
+
+size_t Arena::GetThreadArenasCapacity()
+{
+	std::scoped_lock lock(s_threadArenasMutex);
+	size_t total = 0;
+	for (Arena* arena : s_threadArenas)
+		total += arena->GetCapacity();
+	return total;
+}
+
+Arena::Block Arena::AllocateBlock(size_t _size)
+{
+	if (s_useLargePages)
+	{
+		static const bool privilegeEnabled = EnableLockMemoryPrivilege();
+		const size_t largePageSize = GetLargePageMinimum();
+		if (privilegeEnabled && largePageSize > 0)
+		{
+			const size_t size = (_size + largePageSize - 1) & ~(largePageSize - 1);
+			void* data = VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+			if (data)
+				return { static_cast<char*>(data), size };
+		}
+	}
+
+	void* data = VirtualAlloc(nullptr, _size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	if (!data)
+		throw std::bad_alloc();
+	return { static_cast<char*>(data), _size };
+}
+
+void Arena::FreeBlock(Block const& _block)
+{
+	VirtualFree(_block.data, 0, MEM_RELEASE);
+}
+
+#ifdef _DEBUG
+
+// Replacements for the global allocation functions, which count allocations on threads which have asked for it
+namespace
+{
+	std::atomic<size_t> s_allocationCount = 0;
+	thread_local bool t_countAllocations = false;
+
+	void* CountedAllocate(size_t _size)
+	{
+		if (t_countAllocations)
+			++s_allocationCount;
+		if (void* data = std::malloc(_size > 0 ? _size : 1))
+			return data;
+		throw std::bad_alloc();
+	}
+
+	void* CountedAllocateAligned(size_t _size, std::align_val_t _alignment)
+	{
+		if (t_countAllocations)
+			++s_allocationCount;
+		if (void* data = _aligned_malloc(_size > 0 ? _size : 1, static_cast<size_t>(_alignment)))
+			return data;
+		throw std::bad_alloc();
+	}
+}
+
+void* operator new(size_t _size) { return CountedAllocate(_size); }
+void* operator new[](size_t _size) { return CountedAllocate(_size); }
+void* operator new(size_t _size, std::nothrow_t const&) noexcept { try { return CountedAllocate(_size); } catch (...) { return nullptr; } }
+void* operator new[](size_t _size, std::nothrow_t const&) noexcept { try { return CountedAllocate(_size); } catch (...) { return nullptr; } }
+void operator delete(void* _data) noexcept { std::free(_data); }
+void operator delete[](void* _data) noexcept { std::free(_data); }
+void operator delete(void* _data, size_t) noexcept { std::free(_data); }
+void operator delete[](void* _data, size_t) noexcept { std::free(_data); }
+
+void* operator new(size_t _size, std::align_val_t _alignment) { return CountedAllocateAligned(_size, _alignment); }
+void* operator new[](size_t _size, std::align_val_t _alignment) { return CountedAllocateAligned(_size, _alignment); }
+void operator delete(void* _data, std::align_val_t) noexcept { _aligned_free(_data); }
+void operator delete[](void* _data, std::align_val_t) noexcept { _aligned_free(_data); }
+void operator delete(void* _data, size_t, std::align_val_t) noexcept { _aligned_free(_data); }
+void operator delete[](void* _data, size_t, std::align_val_t) noexcept { _aligned_free(_data); }
+
+void AllocationCounter::CountThisThread() { t_countAllocations = true; }
+size_t AllocationCounter::GetCount() { return s_allocationCount; }
+
+#else
+
+void AllocationCounter::CountThisThread() {}
+size_t AllocationCounter::GetCount() { return 0; }
+
+#endif
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+// Bump allocator for short lived scratch memory. Allocating is just moving a pointer along, nothing is freed
+// individually, and Reset frees everything at once. Blocks come straight from the OS rather than the heap, optionally
+// backed by large pages.
+//
+// Each thread has its own arena (GetThreadArena) so there's no locking. Containers using ArenaAllocator should only
+// be grown by the thread which created them, other threads can read and write the elements.
+class Arena
+{
+public:
+	explicit Arena(size_t _blockSize = 2 << 20);
+	~Arena();
+
+	Arena(Arena const&) = delete;
+	Arena& operator=(Arena const&) = delete;
+
+	void* Allocate(size_t _size, size_t _alignment);
+
+	// Frees everything allocated since the last reset. If it needed more than one block since then they're replaced
+	// by a single block big enough for all of it, so once it's seen the biggest step it never allocates again.
+	void Reset();
+
+	size_t GetCapacity() const;
+
+	// The calling thread's arena, created the first time it's asked for
+	static Arena& GetThreadArena();
+
+	// Resets every thread's arena, only call this when none of them are in use
+	static void ResetThreadArenas();
+
+	// Total capacity of all the thread arenas, for the HUD
+	static size_t GetThreadArenasCapacity();
+
+	// Large pages need the "Lock pages in memory" privilege, without it blocks fall back to normal pages. Only affects
+	// blocks allocated from now on.
+	static void SetUseLargePages(bool _useLargePages) { s_useLargePages = _useLargePages; }
+
+private:
+	struct Block
+	{
+		char* data;
+		size_t size;
+	};
+	static Block AllocateBlock(size_t _size);
+	static void FreeBlock(Block const& _block);
+
+	std::vector<Block> m_blocks;
+	size_t m_used = 0;		// in the last block
+	size_t m_blockSize;
+
+	static inline std::atomic<bool> s_useLargePages = false;
+};
+
+// Standard allocator on top of an arena. Deallocating does nothing, the memory is freed when the arena is reset, so
+// containers using it mustn't outlive the step (or whatever resets the arena).
+template<typename T>
+class ArenaAllocator
+{
+public:
+	using value_type = T;
+
+	ArenaAllocator(Arena& _arena) : m_arena(&_arena) {}
+
+	template<typename U>
+	ArenaAllocator(ArenaAllocator<U> const& _other) : m_arena(_other.m_arena) {}
+
+	T* allocate(size_t _count) { return static_cast<T*>(m_arena->Allocate(_count * sizeof(T), alignof(T))); }
+	void deallocate(T*, size_t) {}
+
+	template<typename U>
+	bool operator==(ArenaAllocator<U> const& _other) const { return m_arena == _other.m_arena; }
+	template<typename U>
+	bool operator!=(ArenaAllocator<U> const& _other) const { return m_arena != _other.m_arena; }
+
+private:
+	template<typename U>
+	friend class ArenaAllocator;
+
+	Arena* m_arena;
+};
+
+template<typename T>
+using ArenaVector = std::vector<T, ArenaAllocator<T>>;
+
+// Rehashing leaves the old buckets behind in the arena, so reserve if the size is known
+template<typename K, typename V, typename Hash = std::hash<K>>
+using ArenaUnorderedMap = std::unordered_map<K, V, Hash, std::equal_to<K>, ArenaAllocator<std::pair<K const, V>>>;
+
+// Debug builds count global heap allocations made by threads which have opted in, so the simulation can check it
+// isn't allocating in steady state. Release builds don't count anything and GetCount is always 0.
+class AllocationCounter
+{
+public:
+	static void CountThisThread();
+	static size_t GetCount();
+};
@@ -0,0 +1,136 @@
+#include "ColourPalette.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+ALLEGRO_COLOR ColourPalette::s_colours[maxColours] = { { 1.f, 1.f, 1.f, 1.f } };
+
+namespace
+{
+	std::mutex s_mutex;
+	std::unordered_map<uint32_t, uint16_t> s_indices = { { 0xffffffff, 0 } };	// RGBA8 to index, or to the nearest once full
+	size_t s_numColours = 1;
+
+	// The colours in the palette by their top four bits of each channel, for finding the nearest once it's full. Each
+	// bucket is a list through s_nextInBucket. There are as many buckets as there can be colours, and most of them are
+	// empty, so they're an array rather than going in another map.
+	const uint32_t endOfBucket = ~0u;
+	std::vector<uint32_t> s_firstInBucket = []
+		{
+			std::vector<uint32_t> first(ColourPalette::maxColours, endOfBucket);
+			first[0xffff] = 0;		// white
+			return first;
+		}();
+	std::vector<uint32_t> s_nextInBucket(ColourPalette::maxColours, endOfBucket);
+	std::vector<uint32_t> s_keys(ColourPalette::maxColours, 0xffffffff);	// RGBA8 of each colour in the palette
+
+	uint8_t ToByte(float _channel)
+	{
+		return static_cast<uint8_t>(std::clamp(_channel, 0.f, 1.f) * 255.f + 0.5f);
+	}
+
+	uint16_t GetBucket(int _r, int _g, int _b, int _a)
+	{
+		return static_cast<uint16_t>(_r << 12 | _g << 8 | _b << 4 | _a);
+	}
+}
+
+uint16_t ColourPalette::GetIndex(ALLEGRO_COLOR const& _colour)
+{
+	const uint8_t r = ToByte(_colour.r), g = ToByte(_colour.g), b = ToByte(_colour.b), a = ToByte(_colour.a);
+	const uint32_t key = (uint32_t)r << 24 | (uint32_t)g << 16 | (uint32_t)b << 8 | a;
+
+	std::scoped_lock lock(s_mutex);
+	auto it = s_indices.find(key);
+	if (it != s_indices.end())
+		return it->second;
+
+	if (s_numColours < maxColours)
+	{
+		// The colour goes in the table before anyone can have its index, so readers don't need the lock
+		const uint16_t index = static_cast<uint16_t>(s_numColours++);
+		s_colours[index] = al_map_rgba(r, g, b, a);
+		s_indices.emplace(key, index);
+		s_keys[index] = key;
+		uint32_t& first = s_firstInBucket[GetBucket(r >> 4, g >> 4, b >> 4, a >> 4)];
+		s_nextInBucket[index] = first;
+		first = index;
+		return index;
+	}
+
+	// Full, which would take a lot of blending of coarsened particles. Search the buckets in growing cubes around
+	// this colour's, until nothing outside the cube could be nearer than what's been found.
+	const int channels[4] = { r, g, b, a };
+	uint16_t nearest = 0;
+	int nearestDistSq = INT_MAX;
+	for (int radius = 0; radius < 16; ++radius)
+	{
+		int from[4], to[4];
+		for (int c = 0; c < 4; ++c)
+		{
+			from[c] = std::max(0, (channels[c] >> 4) - radius);
+			to[c] = std::min(15, (channels[c] >> 4) + radius);
+		}
+		auto checkBucket = [&](int _br, int _bg, int _bb, int _ba)
+		{
+			for (uint32_t i = s_firstInBucket[GetBucket(_br, _bg, _bb, _ba)]; i != endOfBucket; i = s_nextInBucket[i])
+			{
+				const uint32_t other = s_keys[i];
+				const int dr = (int)(other >> 24) - r, dg = (int)(other >> 16 & 0xff) - g, db = (int)(other >> 8 & 0xff) - b, da = (int)(other & 0xff) - a;
+				const int distSq = dr * dr + dg * dg + db * db + da * da;
+				if (distSq < nearestDistSq)
+				{
+					nearestDistSq = distSq;
+					nearest = static_cast<uint16_t>(i);
+				}
+			}
+		};
+
+		// Only the shell, the inside was done last time round. Unless one of the other channels is on the shell,
+		// that's just the two ends of the last one.
+		for (int br = from[0]; br <= to[0]; ++br)
+			for (int bg = from[1]; bg <= to[1]; ++bg)
+				for (int bb = from[2]; bb <= to[2]; ++bb)
+				{
+					const bool onShell = abs(br - (r >> 4)) == radius || abs(bg - (g >> 4)) == radius || abs(bb - (b >> 4)) == radius;
+					if (onShell)
+					{
+						for (int ba = from[3]; ba <= to[3]; ++ba)
+							checkBucket(br, bg, bb, ba);
+					}
+					else
+					{
+						if ((a >> 4) - radius >= 0)
+							checkBucket(br, bg, bb, (a >> 4) - radius);
+						if (radius > 0 && (a >> 4) + radius <= 15)
+							checkBucket(br, bg, bb, (a >> 4) + radius);
+					}
+				}
+
+		// Anything in a bucket outside the cube is at least this far away in at least one channel
+		int outside = INT_MAX;
+		for (int c = 0; c < 4; ++c)
+		{
+			if (from[c] > 0)
+				outside = std::min(outside, channels[c] - from[c] * 16 + 1);
+			if (to[c] < 15)
+				outside = std::min(outside, to[c] * 16 + 16 - channels[c]);
+		}
+		if (outside == INT_MAX || nearestDistSq <= outside * outside)
+			break;
+	}
+
+	// So the next time it's just the lookup above
+	s_indices.emplace(key, nearest);
+	return nearest;
+}
+
+size_t ColourPalette::GetNumColours()
+{
+	std::scoped_lock lock(s_mutex);
+	return s_numColours;
+}
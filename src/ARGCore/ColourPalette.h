@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <allegro5/allegro.h>
+
+// Shared table of colours, so things which have a colour can keep a 16 bit index rather than four floats. Colours are
+// rounded to 8 bits a channel when they're added, and the same colour always gets the same index. Looking an index
+// up is just an array read and is safe from any thread, adding a colour takes a lock.
+class ColourPalette
+{
+public:
+	static constexpr size_t maxColours = 65536;
+
+	// Index 0 is always white. Once the palette is full new colours get the nearest one already in it.
+	static uint16_t GetIndex(ALLEGRO_COLOR const& _colour);
+
+	static ALLEGRO_COLOR const& GetColour(uint16_t _index) { return s_colours[_index]; }
+
+	static size_t GetNumColours();
+
+private:
+	static ALLEGRO_COLOR s_colours[maxColours];
+};
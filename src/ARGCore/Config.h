@@ -57,6 +57,7 @@ class IConfigOptionWrapper
 public:
 	virtual void save() = 0;
 	virtual void resetToDefault() = 0;
+	virtual void preload() = 0;
 };
 
 template<typename T>
@@ -95,6 +96,12 @@ public:
 		value = defaultValue.value();
 	}
 
+	// Loads the value now rather than the first time it's read
+	virtual void preload()
+	{
+		get();
+	}
+
 	const char* getDisplayName() const { return displayName; }
 
 	operator T()
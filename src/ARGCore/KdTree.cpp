@@ -0,0 +1,142 @@
+#include "KdTree.h"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+void KdTree::Split(size_t _begin, size_t _end, int _depth)
+{
+	// The median goes in the middle, with nothing bigger before it and nothing smaller after
+	const int axis = _depth & 1;
+	nth_element(m_entries.begin() + _begin, m_entries.begin() + (_begin + _end) / 2, m_entries.begin() + _end,
+		[axis](Entry const& _a, Entry const& _b) { return _a.pos[axis] < _b.pos[axis]; });
+}
+
+void KdTree::BuildSubtree(size_t _begin, size_t _end, int _depth)
+{
+	if (_end - _begin <= leafSize)
+		return;
+	Split(_begin, _end, _depth);
+	const size_t mid = (_begin + _end) / 2;
+	BuildSubtree(_begin, mid, _depth + 1);
+	BuildSubtree(mid + 1, _end, _depth + 1);
+}
+
+uint32_t KdTree::FindNearest(Vector2Base<double> const& _pos, double _maxDistance) const
+{
+	const double pos[2] = { _pos.x, _pos.y };
+	double bestDistSq = _maxDistance < sqrt(numeric_limits<double>::max()) ? _maxDistance * _maxDistance : numeric_limits<double>::max();
+	uint32_t best = npos;
+	FindNearest(0, m_entries.size(), 0, pos, bestDistSq, best);
+	return best;
+}
+
+void KdTree::FindNearest(size_t _begin, size_t _end, int _depth, double const* _pos, double& _bestDistSq, uint32_t& _best) const
+{
+	auto consider = [&](Entry const& _entry)
+	{
+		const double dx = _entry.pos[0] - _pos[0], dy = _entry.pos[1] - _pos[1];
+		const double distSq = dx * dx + dy * dy;
+		if (distSq < _bestDistSq)
+		{
+			_bestDistSq = distSq;
+			_best = _entry.index;
+		}
+	};
+
+	if (_end - _begin <= leafSize)
+	{
+		for (size_t i = _begin; i < _end; ++i)
+			consider(m_entries[i]);
+		return;
+	}
+
+	// The side the point is on first, then the other side only if the splitting line is closer than the best so far
+	const int axis = _depth & 1;
+	const size_t mid = (_begin + _end) / 2;
+	consider(m_entries[mid]);
+	const double offset = _pos[axis] - m_entries[mid].pos[axis];
+	if (offset < 0.)
+	{
+		FindNearest(_begin, mid, _depth + 1, _pos, _bestDistSq, _best);
+		if (offset * offset < _bestDistSq)
+			FindNearest(mid + 1, _end, _depth + 1, _pos, _bestDistSq, _best);
+	}
+	else
+	{
+		FindNearest(mid + 1, _end, _depth + 1, _pos, _bestDistSq, _best);
+		if (offset * offset < _bestDistSq)
+			FindNearest(_begin, mid, _depth + 1, _pos, _bestDistSq, _best);
+	}
+}
+
+void KdTree::FindInRect(Vector2Base<double> const& _min, Vector2Base<double> const& _max, vector<uint32_t>& _indices, ThreadPool& _threadPool) const
+{
+	_indices.clear();
+	if (m_entries.empty())
+		return;
+
+	m_ranges.clear();
+	const Cell rect = { { _min.x, _min.y }, { _max.x, _max.y } };
+	FindInRect(0, m_entries.size(), 0, m_bounds, rect, m_ranges);
+
+	// Then the ranges' indices are copied out in parallel, each to its own place
+	m_rangeStarts.resize(m_ranges.size());
+	size_t total = 0;
+	for (size_t r = 0; r < m_ranges.size(); ++r)
+	{
+		m_rangeStarts[r] = total;
+		total += m_ranges[r].second - m_ranges[r].first;
+	}
+	_indices.resize(total);
+	_threadPool.ParallelFor(m_ranges.size(), [&](size_t begin, size_t end)
+		{
+			for (size_t r = begin; r < end; ++r)
+			{
+				uint32_t* dest = &_indices[m_rangeStarts[r]];
+				for (size_t i = m_ranges[r].first; i < m_ranges[r].second; ++i)
+					*dest++ = m_entries[i].index;
+			}
+		});
+}
+
+void KdTree::FindInRect(size_t _begin, size_t _end, int _depth, Cell const& _cell, Cell const& _rect, vector<pair<size_t, size_t>>& _ranges) const
+{
+	if (_begin == _end)
+		return;
+
+	auto inside = [&](double const* _pos)
+	{
+		return _pos[0] >= _rect.min[0] && _pos[0] <= _rect.max[0] && _pos[1] >= _rect.min[1] && _pos[1] <= _rect.max[1];
+	};
+
+	// All of it, or none of it
+	if (_cell.min[0] >= _rect.min[0] && _cell.max[0] <= _rect.max[0] && _cell.min[1] >= _rect.min[1] && _cell.max[1] <= _rect.max[1])
+	{
+		_ranges.emplace_back(_begin, _end);
+		return;
+	}
+	if (_cell.max[0] < _rect.min[0] || _cell.min[0] > _rect.max[0] || _cell.max[1] < _rect.min[1] || _cell.min[1] > _rect.max[1])
+		return;
+
+	if (_end - _begin <= leafSize)
+	{
+		for (size_t i = _begin; i < _end; ++i)
+			if (inside(m_entries[i].pos))
+				_ranges.emplace_back(i, i + 1);
+		return;
+	}
+
+	const int axis = _depth & 1;
+	const size_t mid = (_begin + _end) / 2;
+	const double split = m_entries[mid].pos[axis];
+	if (inside(m_entries[mid].pos))
+		_ranges.emplace_back(mid, mid + 1);
+
+	Cell lower = _cell, upper = _cell;
+	lower.max[axis] = split;
+	upper.min[axis] = split;
+	FindInRect(_begin, mid, _depth + 1, lower, _rect, _ranges);
+	FindInRect(mid + 1, _end, _depth + 1, upper, _rect, _ranges);
+}
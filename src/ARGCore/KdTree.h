@@ -0,0 +1,113 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <utility>
+#include <vector>
+
+#include "ThreadPool.h"
+#include "Vector2.h"
+
+// 2D k-d tree over a set of points, rebuilt from scratch whenever they move. It's implicit: the points are reordered
+// so each subtree is a contiguous range with its splitting point in the middle, x at even depths and y at odd ones,
+// so there's nothing to store beyond the points themselves.
+//
+// Queries take O(log N) to find where to look. Rectangle queries hand back whole subtrees which are inside the
+// rectangle as ranges rather than looking at each point, so they stay cheap when nearly everything is inside.
+class KdTree
+{
+public:
+	static constexpr uint32_t npos = ~0u;
+
+	// _getPos(i) for each i in [0, _count). The top few levels are split on the calling thread and the subtrees below
+	// them in parallel.
+	template<typename GetPos>
+	void Build(size_t _count, GetPos&& _getPos, ThreadPool& _threadPool) { Build(_count, _getPos, _threadPool, [](size_t, size_t) {}); }
+
+	// The same, also calling _visit(begin, end) for each chunk of points in the pass which reads their positions, for
+	// anything else the caller needs to go over them all for while they're in cache
+	template<typename GetPos, typename Visit>
+	void Build(size_t _count, GetPos&& _getPos, ThreadPool& _threadPool, Visit&& _visit);
+
+	size_t size() const { return m_entries.size(); }
+
+	// Index of the nearest point within _maxDistance, npos if there aren't any
+	uint32_t FindNearest(Vector2Base<double> const& _pos, double _maxDistance = std::numeric_limits<double>::max()) const;
+
+	// Indices of the points within the rectangle, in no particular order
+	void FindInRect(Vector2Base<double> const& _min, Vector2Base<double> const& _max, std::vector<uint32_t>& _indices, ThreadPool& _threadPool) const;
+
+private:
+	static constexpr size_t leafSize = 8;
+
+	struct Entry
+	{
+		double pos[2];
+		uint32_t index;
+	};
+
+	struct Cell
+	{
+		double min[2], max[2];
+	};
+
+	void Split(size_t _begin, size_t _end, int _depth);
+	void BuildSubtree(size_t _begin, size_t _end, int _depth);
+	void FindNearest(size_t _begin, size_t _end, int _depth, double const* _pos, double& _bestDistSq, uint32_t& _best) const;
+	void FindInRect(size_t _begin, size_t _end, int _depth, Cell const& _cell, Cell const& _rect, std::vector<std::pair<size_t, size_t>>& _ranges) const;
+
+	std::vector<Entry> m_entries;
+	Cell m_bounds;
+	std::vector<std::pair<size_t, size_t>> m_subtrees;				// built in parallel, see Build
+	mutable std::vector<std::pair<size_t, size_t>> m_ranges;		// scratch for FindInRect
+	mutable std::vector<size_t> m_rangeStarts;
+};
+
+template<typename GetPos, typename Visit>
+void KdTree::Build(size_t _count, GetPos&& _getPos, ThreadPool& _threadPool, Visit&& _visit)
+{
+	m_entries.resize(_count);
+	_threadPool.ParallelFor(_count, [&](size_t begin, size_t end)
+		{
+			for (size_t i = begin; i < end; ++i)
+			{
+				const Vector2Base<double> pos = _getPos(i);
+				m_entries[i] = { { pos.x, pos.y }, (uint32_t)i };
+			}
+			_visit(begin, end);
+		});
+
+	m_bounds = { { std::numeric_limits<double>::max(), std::numeric_limits<double>::max() }, { std::numeric_limits<double>::lowest(), std::numeric_limits<double>::lowest() } };
+	for (auto const& entry : m_entries)
+	{
+		for (int axis = 0; axis < 2; ++axis)
+		{
+			m_bounds.min[axis] = std::min(m_bounds.min[axis], entry.pos[axis]);
+			m_bounds.max[axis] = std::max(m_bounds.max[axis], entry.pos[axis]);
+		}
+	}
+
+	// Enough subtrees for every thread to get a few, each split serially
+	int parallelDepth = 0;
+	while ((size_t(1) << parallelDepth) < (_threadPool.GetNumWorkers() + 1) * 4 && (_count >> parallelDepth) > leafSize * 64)
+		++parallelDepth;
+	m_subtrees.clear();
+	m_subtrees.emplace_back(0, _count);
+	for (int depth = 0; depth < parallelDepth; ++depth)
+	{
+		const size_t numRanges = m_subtrees.size();
+		for (size_t r = 0; r < numRanges; ++r)
+		{
+			auto [begin, end] = m_subtrees[r];
+			Split(begin, end, depth);
+			const size_t mid = (begin + end) / 2;
+			m_subtrees[r] = { begin, mid };
+			m_subtrees.emplace_back(mid + 1, end);
+		}
+	}
+	_threadPool.ParallelFor(m_subtrees.size(), [&](size_t begin, size_t end)
+		{
+			for (size_t s = begin; s < end; ++s)
+				BuildSubtree(m_subtrees[s].first, m_subtrees[s].second, parallelDepth);
+		}, 1);
+}
@@ -0,0 +1,156 @@
+#include "Numa.h"
+
+#include <Windows.h>
+
+namespace
+{
+	struct Node
+	{
+		USHORT number;
+		std::vector<PROCESSOR_NUMBER> processors;
+	};
+
+	std::vector<Node> const& GetNodes()
+	{
+		static const std::vector<Node> nodes = []
+			{
+				std::vector<Node> nodes;
+				ULONG highest = 0;
+				if (GetNumaHighestNodeNumber(&highest))
+				{
+					for (ULONG number = 0; number <= highest; ++number)
+					{
+						// Just the processors in the node's primary group, which is all of them unless it has more than 64
+						GROUP_AFFINITY affinity = {};
+						if (!GetNumaNodeProcessorMaskEx(static_cast<USHORT>(number), &affinity) || affinity.Mask == 0)
+							continue;
+
+						Node node = { static_cast<USHORT>(number) };
+						for (BYTE bit = 0; bit < sizeof(KAFFINITY) * 8; ++bit)
+							if (affinity.Mask & (KAFFINITY(1) << bit))
+								node.processors.push_back({ affinity.Group, bit, 0 });
+						nodes.push_back(std::move(node));
+					}
+				}
+				if (nodes.empty())
+					nodes.push_back({ 0 });
+				return nodes;
+			}();
+		return nodes;
+	}
+
+	size_t GetPageSize()
+	{
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		return info.dwPageSize;
+	}
+}
+
+unsigned Numa::GetNumNodes()
+{
+	return static_cast<unsigned>(GetNodes().size());
+}
+
+unsigned Numa::GetNumProcessors(unsigned _node)
+{
+	// A node we couldn't get the processors for still gets a share of everything
+	return std::max(1u, static_cast<unsigned>(GetNodes()[_node].processors.size()));
+}
+
+unsigned Numa::GetCurrentNode()
+{
+	auto const& nodes = GetNodes();
+	if (nodes.size() == 1)
+		return 0;
+
+	PROCESSOR_NUMBER processor;
+	GetCurrentProcessorNumberEx(&processor);
+	USHORT number;
+	if (GetNumaProcessorNodeEx(&processor, &number))
+		for (size_t node = 0; node < nodes.size(); ++node)
+			if (nodes[node].number == number)
+				return static_cast<unsigned>(node);
+	return 0;
+}
+
+void Numa::PinCurrentThread(unsigned _node, unsigned _index)
+{
+	auto const& processors = GetNodes()[_node].processors;
+	if (processors.empty())
+		return;
+
+	PROCESSOR_NUMBER const& processor = processors[_index % processors.size()];
+	GROUP_AFFINITY affinity = {};
+	affinity.Group = processor.Group;
+	affinity.Mask = KAFFINITY(1) << processor.Number;
+	SetThreadGroupAffinity(GetCurrentThread(), &affinity, nullptr);
+}
+
+void Numa::GetNodeRange(size_t _count, unsigned _node, size_t& _begin, size_t& _end)
+{
+	size_t before = 0, total = 0;
+	for (unsigned node = 0; node < GetNumNodes(); ++node)
+	{
+		if (node < _node)
+			before += GetNumProcessors(node);
+		total += GetNumProcessors(node);
+	}
+	_begin = _count * before / total;
+	_end = _count * (before + GetNumProcessors(_node)) / total;
+}
+
+void* Numa::AllocatePartitioned(size_t _bytes)
+{
+	auto const& nodes = GetNodes();
+	if (nodes.size() == 1)
+		return ::operator new(_bytes);
+
+	// Reserve the whole thing in one go so it's contiguous, then commit each node's part preferring that node. Pages
+	// aren't actually placed until they're touched, but they're placed on the preferred node whichever thread does it.
+	char* data = static_cast<char*>(VirtualAlloc(nullptr, _bytes, MEM_RESERVE, PAGE_READWRITE));
+	if (!data)
+		throw std::bad_alloc();
+
+	static const size_t pageSize = GetPageSize();
+	size_t committed = 0;
+	for (unsigned node = 0; node < nodes.size(); ++node)
+	{
+		size_t begin, end;
+		GetNodeRange(_bytes, node, begin, end);
+		end = node + 1 == nodes.size() ? _bytes : end & ~(pageSize - 1);
+		if (end > committed)
+		{
+			if (!VirtualAllocExNuma(GetCurrentProcess(), data + committed, end - committed, MEM_COMMIT, PAGE_READWRITE, nodes[node].number))
+			{
+				VirtualFree(data, 0, MEM_RELEASE);
+				throw std::bad_alloc();
+			}
+			committed = end;
+		}
+	}
+	return data;
+}
+
+void Numa::FreePartitioned(void* _data)
+{
+	if (!_data)
+		return;
+	if (GetNumNodes() == 1)
+		::operator delete(_data);
+	else
+		VirtualFree(_data, 0, MEM_RELEASE);
+}
+
+void* Numa::AllocateOnNode(size_t _bytes, unsigned _node)
+{
+	void* data = VirtualAllocExNuma(GetCurrentProcess(), nullptr, _bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, GetNodes()[_node].number);
+	if (!data)
+		throw std::bad_alloc();
+	return data;
+}
+
+void Numa::FreeOnNode(void* _data)
+{
+	VirtualFree(_data, 0, MEM_RELEASE);
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <vector>
+
+// Which logical processors belong to which NUMA node, and memory placed on particular nodes. Nodes here are numbered
+// 0 to GetNumNodes() - 1, skipping any the OS has without processors. On a machine with one node (most of them)
+// everything degenerates to that node, and memory comes from the normal heap.
+class Numa
+{
+public:
+	static unsigned GetNumNodes();
+	static unsigned GetNumProcessors(unsigned _node);
+
+	// The node the calling thread is running on right now
+	static unsigned GetCurrentNode();
+
+	// Restricts the calling thread to the _index'th processor of _node (wrapping round)
+	static void PinCurrentThread(unsigned _node, unsigned _index);
+
+	// Splits [0, _count) into one contiguous range per node, sized by each node's share of the processors. Memory from
+	// AllocatePartitioned is split the same way, so the node which owns an element of a partitioned array is
+	// GetNodeRange(capacity) for the element's index.
+	static void GetNodeRange(size_t _count, unsigned _node, size_t& _begin, size_t& _end);
+
+	// Each node's range of the bytes (see GetNodeRange, rounded to pages) is committed on that node, so wherever it's
+	// first touched from it ends up local to whichever node will work on it
+	static void* AllocatePartitioned(size_t _bytes);
+	static void FreePartitioned(void* _data);
+
+	// Single node buffer for measuring bandwidth
+	static void* AllocateOnNode(size_t _bytes, unsigned _node);
+	static void FreeOnNode(void* _data);
+};
+
+// Standard allocator for arrays which are worked on in node ranges, see ThreadPool::ParallelFor
+template<typename T>
+class NumaAllocator
+{
+public:
+	using value_type = T;
+
+	NumaAllocator() = default;
+	template<typename U>
+	NumaAllocator(NumaAllocator<U> const&) {}
+
+	T* allocate(size_t _count) { return static_cast<T*>(Numa::AllocatePartitioned(_count * sizeof(T))); }
+	void deallocate(T* _data, size_t) { Numa::FreePartitioned(_data); }
+
+	template<typename U>
+	bool operator==(NumaAllocator<U> const&) const { return true; }
+	template<typename U>
+	bool operator!=(NumaAllocator<U> const&) const { return false; }
+};
+
+template<typename T>
+using NumaVector = std::vector<T, NumaAllocator<T>>;
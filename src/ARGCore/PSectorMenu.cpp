@@ -143,7 +143,7 @@ std::shared_ptr<CmdButtonAction> PSectorMenu::addAction(int x, DialogTextSource
 
 std::shared_ptr<CmdButtonAction> PSectorMenu::addAction(int x, DialogTextSource txt, std::function<void(CmdButtonAction&)> action, std::function<void(CmdButtonAction&)> deleteAction, RGB* col)
 {
-	auto button = cmdMenu.addAction(x, nextY, 344, nextY + buttonHeight, txt, action, deleteAction);
+	auto button = cmdMenu.addAction(x, nextY, 344, nextY + buttonHeight, txt, [this, action](CmdButtonAction& button) { layoutOptions.applyChange([&] { action(button); }); }, deleteAction);
 	cmdMenu.buttons.back()->setCol(col);
 	nextY += yInc;
 	return button;
@@ -30,6 +30,9 @@ struct PSectorMenuLayoutOptions
 	int scale = 1;
 	std::optional<int> leftRightKeyDelayOverride;
 	bool inGame = false;
+
+	// Every change the menu makes goes through this, so whoever owns the menu can choose when it's safe to make it
+	std::function<void(std::function<void()> const&)> applyChange = [](std::function<void()> const& change) { change(); };
 };
 
 class PSectorMenu
@@ -92,8 +95,25 @@ public:
 				ss << option.get();
 				return ss.str();
 			};
-		auto leftAction = [&, min, max, step] { option = option.get() - step; if (option < min) option = min; };
-		auto rightAction = [&, min, max, step] { option = option.get() + step; if (option > max) option = max; };
+		auto leftAction = [&, min, max, step] { layoutOptions.applyChange([&] { option = option.get() - step; if (option < min) option = min; }); };
+		auto rightAction = [&, min, max, step] { layoutOptions.applyChange([&] { option = option.get() + step; if (option > max) option = max; }); };
+		cmdMenu.add(make_shared<CmdButtonDynamic>(x, nextY, 344, nextY + buttonHeight, nameText, valueText, [] {}, leftAction, rightAction));
+		nextY += yInc;
+	}
+
+	// Steps through powers of 2 between min and max, for options which only work with them. A value from an old
+	// config file which isn't one is shown along with the power of 2 it's rounded up to.
+	void addPowerOf2(int x, ConfigOptionWrapper<int>& option, int min, int max)
+	{
+		auto roundUp = [](int value) { int p = 1; while (p < value) p *= 2; return p; };
+		DialogTextFunc nameText = [&] { return option.getDisplayName(); };
+		DialogTextFunc valueText = [&, roundUp]
+			{
+				const int effective = roundUp(option.get());
+				return effective == option.get() ? to_string(effective) : to_string(option.get()) + " (uses " + to_string(effective) + ")";
+			};
+		auto leftAction = [&, min, roundUp] { layoutOptions.applyChange([&] { option = std::max(min, roundUp(option.get()) / 2); }); };
+		auto rightAction = [&, max, roundUp] { layoutOptions.applyChange([&] { option = std::min(max, roundUp(option.get()) * 2); }); };
 		cmdMenu.add(make_shared<CmdButtonDynamic>(x, nextY, 344, nextY + buttonHeight, nameText, valueText, [] {}, leftAction, rightAction));
 		nextY += yInc;
 	}
@@ -0,0 +1,213 @@
+#include "PngWriter.h"
+
+#include <algorithm>
+#include <fstream>
+
+using namespace std;
+
+namespace
+{
+	uint32_t Crc32(uint8_t const* _data, size_t _size, uint32_t _crc = 0)
+	{
+		static const auto table = []
+			{
+				vector<uint32_t> table(256);
+				for (uint32_t n = 0; n < 256; ++n)
+				{
+					uint32_t c = n;
+					for (int k = 0; k < 8; ++k)
+						c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+					table[n] = c;
+				}
+				return table;
+			}();
+		_crc = ~_crc;
+		for (size_t i = 0; i < _size; ++i)
+			_crc = table[(_crc ^ _data[i]) & 0xff] ^ (_crc >> 8);
+		return ~_crc;
+	}
+
+	uint32_t Adler32(uint8_t const* _data, size_t _size)
+	{
+		uint32_t a = 1, b = 0;
+		while (_size > 0)
+		{
+			// As many as can be summed before b could overflow
+			const size_t count = min<size_t>(_size, 5552);
+			for (size_t i = 0; i < count; ++i)
+			{
+				a += _data[i];
+				b += a;
+			}
+			a %= 65521;
+			b %= 65521;
+			_data += count;
+			_size -= count;
+		}
+		return (b << 16) | a;
+	}
+
+	void PutBigEndian(vector<uint8_t>& _dest, uint32_t _value)
+	{
+		_dest.insert(_dest.end(), { (uint8_t)(_value >> 24), (uint8_t)(_value >> 16), (uint8_t)(_value >> 8), (uint8_t)_value });
+	}
+
+	void PutChunk(ofstream& _file, char const* _type, vector<uint8_t> const& _data)
+	{
+		vector<uint8_t> header;
+		PutBigEndian(header, (uint32_t)_data.size());
+		header.insert(header.end(), _type, _type + 4);
+		vector<uint8_t> crc;
+		PutBigEndian(crc, Crc32(_data.data(), _data.size(), Crc32(header.data() + 4, 4)));
+		_file.write(reinterpret_cast<char const*>(header.data()), header.size());
+		_file.write(reinterpret_cast<char const*>(_data.data()), _data.size());
+		_file.write(reinterpret_cast<char const*>(crc.data()), crc.size());
+	}
+
+	// Deflate's length codes, from 257: the shortest length for each and how many extra bits follow it
+	const uint16_t lengthBases[] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+	const uint8_t lengthExtraBits[] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+
+	// The fixed Huffman code for each literal/length symbol, bit reversed ready to go straight into the stream
+	struct FixedCode
+	{
+		uint16_t bits;
+		uint8_t length;
+	};
+
+	FixedCode const* GetFixedCodes()
+	{
+		static const auto codes = []
+			{
+				vector<FixedCode> codes(288);
+				for (uint32_t symbol = 0; symbol < 288; ++symbol)
+				{
+					uint32_t code;
+					int length;
+					if (symbol < 144) { code = 0x30 + symbol; length = 8; }
+					else if (symbol < 256) { code = 0x190 + symbol - 144; length = 9; }
+					else if (symbol < 280) { code = symbol - 256; length = 7; }
+					else { code = 0xc0 + symbol - 280; length = 8; }
+
+					uint32_t reversed = 0;
+					for (int i = 0; i < length; ++i)
+						reversed |= ((code >> i) & 1) << (length - 1 - i);
+					codes[symbol] = { (uint16_t)reversed, (uint8_t)length };
+				}
+				return codes;
+			}();
+		return codes.data();
+	}
+
+	const size_t minMatch = 3;
+	const size_t maxMatch = 258;
+	const size_t matchDistance = 3;		// one RGB pixel back
+	const uint32_t matchDistanceCode = 0x08;	// distance code 2, as distances 1 to 4 are codes 0 to 3 with no extra bits, reversed
+}
+
+bool PngWriter::Write(string const& _filename, uint32_t const* _argb, int _w, int _h)
+{
+	// PNG has no empty images
+	if (_w <= 0 || _h <= 0)
+		return false;
+
+	const size_t rowBytes = 1 + (size_t)_w * 3;
+	m_raw.resize(rowBytes * _h);
+	for (int y = 0; y < _h; ++y)
+	{
+		uint8_t* row = &m_raw[rowBytes * y];
+		*row++ = 0;		// no filter
+		uint32_t const* source = _argb + (size_t)y * _w;
+		for (int x = 0; x < _w; ++x)
+		{
+			*row++ = (uint8_t)(source[x] >> 16);
+			*row++ = (uint8_t)(source[x] >> 8);
+			*row++ = (uint8_t)source[x];
+		}
+	}
+	Deflate();
+
+	ofstream file(_filename, ios::binary);
+	if (!file.is_open())
+		return false;
+	static const uint8_t signature[] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+	file.write(reinterpret_cast<char const*>(signature), sizeof(signature));
+
+	vector<uint8_t> header;
+	PutBigEndian(header, _w);
+	PutBigEndian(header, _h);
+	header.insert(header.end(), { 8, 2, 0, 0, 0 });	// 8 bits, RGB, deflate, adaptive filtering, not interlaced
+	PutChunk(file, "IHDR", header);
+	PutChunk(file, "IDAT", m_compressed);
+	PutChunk(file, "IEND", {});
+	return file.good();
+}
+
+void PngWriter::Deflate()
+{
+	m_compressed.clear();
+	m_compressed.reserve(m_raw.size() / 8);
+	m_compressed.insert(m_compressed.end(), { 0x78, 0x01 });	// zlib header, 32K window, no dictionary
+	m_bitBuffer = 0;
+	m_numBits = 0;
+
+	// One block with the fixed codes
+	PutBits(1, 1);		// last block
+	PutBits(1, 2);		// fixed Huffman codes
+
+	const size_t size = m_raw.size();
+	size_t i = 0;
+	while (i < size)
+	{
+		size_t length = 0;
+		if (i >= matchDistance)
+		{
+			const size_t limit = min(maxMatch, size - i);
+			while (length < limit && m_raw[i + length] == m_raw[i + length - matchDistance])
+				++length;
+		}
+
+		if (length >= minMatch)
+		{
+			PutLength(length);
+			PutBits(matchDistanceCode, 5);
+			i += length;
+		}
+		else
+		{
+			PutSymbol(m_raw[i++]);
+		}
+	}
+	PutSymbol(256);		// end of block
+
+	if (m_numBits > 0)
+		PutBits(0, 8 - m_numBits);
+	PutBigEndian(m_compressed, Adler32(m_raw.data(), m_raw.size()));
+}
+
+void PngWriter::PutBits(uint32_t _bits, int _count)
+{
+	m_bitBuffer |= (uint64_t)_bits << m_numBits;
+	m_numBits += _count;
+	while (m_numBits >= 8)
+	{
+		m_compressed.push_back((uint8_t)m_bitBuffer);
+		m_bitBuffer >>= 8;
+		m_numBits -= 8;
+	}
+}
+
+void PngWriter::PutSymbol(uint32_t _symbol)
+{
+	FixedCode const& code = GetFixedCodes()[_symbol];
+	PutBits(code.bits, code.length);
+}
+
+void PngWriter::PutLength(size_t _length)
+{
+	int code = 28;
+	while (lengthBases[code] > _length)
+		--code;
+	PutSymbol(257 + code);
+	PutBits((uint32_t)(_length - lengthBases[code]), lengthExtraBits[code]);
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Writes 8 bit RGB PNGs without needing zlib or an image addon, so frames can be saved from any thread. The deflate
+// stream uses the fixed Huffman codes and only looks for repeats of the pixel before, which is quick and still
+// shrinks mostly black frames a long way.
+class PngWriter
+{
+public:
+	// _argb is _w * _h pixels, alpha is ignored. Returns false if the file couldn't be written or the size isn't
+	// at least 1 x 1.
+	bool Write(std::string const& _filename, uint32_t const* _argb, int _w, int _h);
+
+private:
+	void Deflate();
+	void PutBits(uint32_t _bits, int _count);
+	void PutSymbol(uint32_t _symbol);		// literal byte, 256 for the end of the block, or a length code from 257
+	void PutLength(size_t _length);
+
+	std::vector<uint8_t> m_raw;			// filter byte and RGB for each row
+	std::vector<uint8_t> m_compressed;
+	uint64_t m_bitBuffer = 0;
+	int m_numBits = 0;
+};
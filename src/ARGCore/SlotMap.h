@@ -0,0 +1,111 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+// 64 bit handles which stay valid however the things they refer to are moved around, with a 32 bit value per handle
+// for saying where the thing is now. The owner keeps the values up to date as it moves things. A handle is the slot
+// index in the bottom 32 bits and the slot's generation in the top 32. The generation goes up when a slot is used and
+// again when it's freed, so it's odd while the slot is in use, and a handle to a freed slot never matches again even
+// once the slot is reused. Freed slots are reused oldest first, so one slot being freed and reused over and over
+// doesn't run through its generations any faster than the rest. Inserting, erasing and looking up are all O(1). 0 is
+// never a valid handle.
+class SlotMap
+{
+public:
+	using Handle = uint64_t;
+	static constexpr uint32_t none = 0xffffffff;
+
+	Handle Insert(uint32_t _value = none)
+	{
+		uint32_t slot;
+		if (!m_freeSlots.empty())
+		{
+			slot = m_freeSlots.front();
+			m_freeSlots.pop_front();
+		}
+		else
+		{
+			slot = static_cast<uint32_t>(m_slots.size());
+			m_slots.push_back({});
+		}
+		Slot& s = m_slots[slot];
+		++s.generation;
+		s.value = _value;
+		return MakeHandle(slot, s.generation);
+	}
+
+	// Does nothing if the handle has already been erased
+	void Erase(Handle _handle)
+	{
+		if (!Contains(_handle))
+			return;
+		const uint32_t slot = GetSlot(_handle);
+		++m_slots[slot].generation;
+		m_slots[slot].value = none;
+		m_freeSlots.push_back(slot);
+	}
+
+	bool Contains(Handle _handle) const
+	{
+		const uint32_t slot = GetSlot(_handle);
+		return slot < m_slots.size() && m_slots[slot].generation == GetGeneration(_handle) && (GetGeneration(_handle) & 1);
+	}
+
+	// none if the handle has been erased
+	uint32_t Get(Handle _handle) const { return Contains(_handle) ? m_slots[GetSlot(_handle)].value : none; }
+
+	// Only for handles which are still in use. Different handles can be set at the same time from different threads.
+	void Set(Handle _handle, uint32_t _value)
+	{
+		assert(Contains(_handle));
+		m_slots[GetSlot(_handle)].value = _value;
+	}
+
+	// For handles which came from somewhere else, like a file, rather than from Insert. Call RebuildFreeSlots after
+	// restoring them all, handles given out by Insert in between could clash.
+	void Restore(Handle _handle, uint32_t _value)
+	{
+		const uint32_t slot = GetSlot(_handle);
+		if (slot >= m_slots.size())
+			m_slots.resize(slot + 1);
+		m_slots[slot] = { GetGeneration(_handle), _value };
+	}
+
+	void RebuildFreeSlots()
+	{
+		m_freeSlots.clear();
+		for (uint32_t slot = 0; slot < m_slots.size(); ++slot)
+		{
+			if ((m_slots[slot].generation & 1) == 0)
+				m_freeSlots.push_back(slot);
+		}
+	}
+
+	void clear()
+	{
+		m_slots.clear();
+		m_freeSlots.clear();
+	}
+
+	// Handles in use
+	size_t size() const { return m_slots.size() - m_freeSlots.size(); }
+
+	// Slots are reused, but no two handles in use at once share one, so they can index a plain array
+	static uint32_t GetSlot(Handle _handle) { return static_cast<uint32_t>(_handle); }
+
+private:
+	struct Slot
+	{
+		uint32_t generation = 0;
+		uint32_t value = none;
+	};
+
+	static Handle MakeHandle(uint32_t _slot, uint32_t _generation) { return (static_cast<Handle>(_generation) << 32) | _slot; }
+	static uint32_t GetGeneration(Handle _handle) { return static_cast<uint32_t>(_handle >> 32); }
+
+	std::vector<Slot> m_slots;
+	std::deque<uint32_t> m_freeSlots;		// oldest at the front
+};
@@ -0,0 +1,62 @@
+#include "TaskGraph.h"
+#include "ThreadPool.h"
+#include "TimingManager.h"
+
+#include <cassert>
+
+TaskGraph::TaskId TaskGraph::Add(const char* _name, std::function<void()> _fn, std::initializer_list<TaskId> _dependencies)
+{
+	const TaskId id = static_cast<TaskId>(m_tasks.size());
+	m_tasks.push_back({ _name, std::move(_fn) });
+	for (TaskId dependency : _dependencies)
+	{
+		assert(dependency >= 0 && dependency < id);
+		m_tasks[dependency].dependents.push_back(id);
+		++m_tasks[id].numDependencies;
+	}
+	return id;
+}
+
+void TaskGraph::Clear()
+{
+	m_tasks.clear();
+}
+
+void TaskGraph::Run(ThreadPool& _pool)
+{
+	const size_t count = m_tasks.size();
+	if (m_remainingDependenciesSize < count)
+	{
+		m_remainingDependencies = std::make_unique<std::atomic<int>[]>(count);
+		m_remainingDependenciesSize = count;
+	}
+	for (size_t i = 0; i < count; ++i)
+		m_remainingDependencies[i] = m_tasks[i].numDependencies;
+	m_remainingTasks = count;
+	m_pool = &_pool;
+
+	for (size_t i = 0; i < count; ++i)
+		if (m_tasks[i].numDependencies == 0)
+			Start(static_cast<TaskId>(i));
+
+	while (m_remainingTasks > 0)
+		if (!_pool.RunPendingJob())
+			std::this_thread::yield();
+}
+
+void TaskGraph::Start(TaskId _task)
+{
+	m_pool->Submit([](void* _graph, size_t _index)
+		{
+			auto& graph = *static_cast<TaskGraph*>(_graph);
+			Task& task = graph.m_tasks[_index];
+			const double start = TimingManager::GetTime();
+			task.fn();
+			task.ms = (TimingManager::GetTime() - start) * 1000.;
+
+			for (TaskId dependent : task.dependents)
+				if (--graph.m_remainingDependencies[dependent] == 0)
+					graph.Start(dependent);
+			--graph.m_remainingTasks;
+		}, this, static_cast<size_t>(_task));
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <vector>
+
+class ThreadPool;
+
+// Set of tasks with dependencies between them, run on a ThreadPool. Each task starts as soon as everything it depends
+// on has finished, so independent tasks overlap. The graph can be kept and run again, and times each task.
+class TaskGraph
+{
+public:
+	using TaskId = int;
+
+	// Dependencies have to have been added already, so there can't be any cycles
+	TaskId Add(const char* _name, std::function<void()> _fn, std::initializer_list<TaskId> _dependencies = {});
+	void Clear();
+
+	// Runs every task and waits for them all, the calling thread runs tasks too while it waits
+	void Run(ThreadPool& _pool);
+
+	// From the last Run
+	size_t GetNumTasks() const { return m_tasks.size(); }
+	const char* GetName(TaskId _task) const { return m_tasks[_task].name; }
+	double GetMs(TaskId _task) const { return m_tasks[_task].ms; }
+
+private:
+	void Start(TaskId _task);
+
+	struct Task
+	{
+		const char* name;
+		std::function<void()> fn;
+		std::vector<TaskId> dependents;
+		int numDependencies = 0;
+		double ms = 0.;
+	};
+	std::vector<Task> m_tasks;
+
+	// Only used while running
+	ThreadPool* m_pool = nullptr;
+	std::unique_ptr<std::atomic<int>[]> m_remainingDependencies;
+	size_t m_remainingDependenciesSize = 0;
+	std::atomic<size_t> m_remainingTasks = 0;
+};
@@ -0,0 +1,202 @@
+#include "ThreadPool.h"
+#include "TimingManager.h"
+
+namespace
+{
+	// Which node each worker belongs to, so they don't have to ask the OS
+	thread_local unsigned t_workerNode = ThreadPool::anyNode;
+}
+
+ThreadPool::ThreadPool(unsigned _numWorkers, void (*_onWorkerStart)())
+{
+	if (_numWorkers == 0)
+		_numWorkers = std::max(1u, std::thread::hardware_concurrency()) - 1;
+
+	const unsigned numNodes = std::min(Numa::GetNumNodes(), maxNodes);
+	m_queues.resize(numNodes);
+	for (auto& queue : m_queues)
+		queue.jobs.resize(64);
+
+	// Workers are shared out between the nodes the same way as the work is (see ParallelFor). With only one node
+	// there's nothing to gain from pinning, so leave them to the OS.
+	for (unsigned node = 0; node < numNodes; ++node)
+	{
+		size_t begin, end;
+		Numa::GetNodeRange(_numWorkers, node, begin, end);
+		for (size_t i = begin; i < end; ++i)
+		{
+			m_workerNodes.push_back(node);
+			m_workers.emplace_back(&ThreadPool::WorkerMain, this, node, static_cast<unsigned>(i - begin), _onWorkerStart);
+		}
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::scoped_lock lock(m_mutex);
+		m_quit = true;
+	}
+	m_condition.notify_all();
+	for (auto& worker : m_workers)
+		worker.join();
+}
+
+unsigned ThreadPool::GetCurrentNode()
+{
+	return t_workerNode != anyNode ? t_workerNode : Numa::GetCurrentNode();
+}
+
+void ThreadPool::Submit(JobFunction _function, void* _context, size_t _index, unsigned _node)
+{
+	if (_node == anyNode)
+		_node = GetCurrentNode();
+	{
+		std::scoped_lock lock(m_mutex);
+		Queue& queue = m_queues[_node % m_queues.size()];
+		if (queue.count == queue.jobs.size())
+		{
+			// Full, unwrap into a buffer twice the size
+			std::vector<Job> jobs(queue.jobs.size() * 2);
+			for (size_t i = 0; i < queue.count; ++i)
+				jobs[i] = queue.jobs[(queue.first + i) % queue.jobs.size()];
+			queue.jobs.swap(jobs);
+			queue.first = 0;
+		}
+		queue.jobs[(queue.first + queue.count) % queue.jobs.size()] = { _function, _context, _index };
+		++queue.count;
+		++m_numJobs;
+	}
+	m_condition.notify_one();
+}
+
+bool ThreadPool::PopJob(unsigned _node, Job& _job)
+{
+	if (m_numJobs == 0)
+		return false;
+
+	// Own node first, then steal from the others
+	for (size_t i = 0; i < m_queues.size(); ++i)
+	{
+		const size_t node = (_node + i) % m_queues.size();
+		Queue& queue = m_queues[node];
+		if (queue.count > 0 && (i == 0 || node != m_localOnlyNode))
+		{
+			_job = queue.jobs[queue.first];
+			queue.first = (queue.first + 1) % queue.jobs.size();
+			--queue.count;
+			--m_numJobs;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool ThreadPool::RunPendingJob()
+{
+	const unsigned node = GetCurrentNode();
+	Job job;
+	{
+		std::scoped_lock lock(m_mutex);
+		if (!PopJob(node, job))
+			return false;
+	}
+	job.function(job.context, job.index);
+	return true;
+}
+
+std::vector<double> ThreadPool::MeasureNodeBandwidth(size_t _bytesPerNode)
+{
+	// One node at a time, each streaming through a buffer on its own node with only its own workers. Other nodes'
+	// workers aren't allowed to steal the jobs and the calling thread doesn't help, so each node's time is just its
+	// workers and its memory.
+	const size_t grain = 1 << 14;
+	const size_t count = std::max(grain, _bytesPerNode / sizeof(double) / grain * grain);
+	const int passes = 4;		// read and write every element a few times
+
+	struct Context
+	{
+		double* data;
+		size_t count;
+		size_t grain;
+		size_t total;
+		std::atomic<size_t> next;
+		std::atomic<unsigned> remaining;
+	};
+
+	std::vector<double> gbPerSecond(GetNumNodes(), 0.);
+	for (unsigned node = 0; node < GetNumNodes(); ++node)
+	{
+		// With fewer workers than nodes some nodes have none, and there's nothing to measure
+		const unsigned numWorkers = static_cast<unsigned>(std::count(m_workerNodes.begin(), m_workerNodes.end(), node));
+		if (numWorkers == 0)
+			continue;
+
+		double* data = static_cast<double*>(Numa::AllocateOnNode(count * sizeof(double), node));
+		std::fill(data, data + count, 1.);
+
+		Context context;
+		context.data = data;
+		context.count = count;
+		context.grain = grain;
+		context.total = count * passes;
+		context.next = 0;
+		context.remaining = numWorkers;
+
+		{
+			std::scoped_lock lock(m_mutex);
+			m_localOnlyNode = node;
+		}
+		const double start = TimingManager::GetTime();
+		for (unsigned i = 0; i < numWorkers; ++i)
+		{
+			Submit([](void* _context, size_t)
+				{
+					auto& context = *static_cast<Context*>(_context);
+					for (size_t begin = context.next.fetch_add(context.grain); begin < context.total; begin = context.next.fetch_add(context.grain))
+					{
+						double* data = context.data + begin % context.count;
+						for (size_t j = 0; j < context.grain; ++j)
+							data[j] = data[j] * 0.5 + 1.;
+					}
+					--context.remaining;
+				}, &context, 0, node);
+		}
+		// Submit only wakes one worker each time, which might be on another node
+		m_condition.notify_all();
+		while (context.remaining > 0)
+			std::this_thread::yield();
+		const double elapsed = TimingManager::GetTime() - start;
+		{
+			std::scoped_lock lock(m_mutex);
+			m_localOnlyNode = anyNode;
+		}
+
+		gbPerSecond[node] = elapsed > 0. ? (double)(context.total * sizeof(double) * 2) / elapsed / 1e9 : 0.;
+		Numa::FreeOnNode(data);
+	}
+	return gbPerSecond;
+}
+
+void ThreadPool::WorkerMain(unsigned _node, unsigned _processor, void (*_onWorkerStart)())
+{
+	if (m_queues.size() > 1)
+		Numa::PinCurrentThread(_node, _processor);
+	t_workerNode = _node;
+
+	if (_onWorkerStart)
+		_onWorkerStart();
+
+	for (;;)
+	{
+		Job job;
+		{
+			// Not just waiting for m_numJobs, as the only jobs might be ones this worker isn't allowed to steal
+			std::unique_lock lock(m_mutex);
+			m_condition.wait(lock, [&] { return m_quit || PopJob(_node, job); });
+			if (m_quit)
+				return;
+		}
+		job.function(job.context, job.index);
+	}
+}
@@ -0,0 +1,153 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "Numa.h"
+
+// Fixed set of worker threads with a shared queue. Anything which waits for jobs (ParallelFor, TaskGraph::Run) runs
+// queued jobs itself while it waits, so jobs can wait on other jobs without running out of workers.
+//
+// Jobs are a function pointer and a context rather than std::function, and the queue is a ring buffer which keeps
+// its memory, so once it's warmed up submitting a job doesn't allocate.
+//
+// On machines with more than one NUMA node the workers are spread across the nodes and pinned to a processor each,
+// and each node has its own queue. Workers take jobs from their own node's queue first and only take other nodes'
+// jobs when theirs is empty.
+class ThreadPool
+{
+public:
+	using JobFunction = void (*)(void* _context, size_t _index);
+
+	static constexpr unsigned anyNode = ~0u;
+	static constexpr unsigned maxNodes = 64;
+
+	// 0 = one worker per hardware thread, less one for the thread which submits the work. _onWorkerStart is called
+	// on each worker before it starts taking jobs.
+	explicit ThreadPool(unsigned _numWorkers = 0, void (*_onWorkerStart)() = nullptr);
+	~ThreadPool();
+
+	ThreadPool(ThreadPool const&) = delete;
+	ThreadPool& operator=(ThreadPool const&) = delete;
+
+	unsigned GetNumWorkers() const { return static_cast<unsigned>(m_workers.size()); }
+	unsigned GetNumNodes() const { return static_cast<unsigned>(m_queues.size()); }
+
+	// The node the calling thread is on, which is fixed for workers
+	static unsigned GetCurrentNode();
+
+	// Puts the job on _node's queue, anyNode being the submitting thread's node
+	void Submit(JobFunction _function, void* _context, size_t _index = 0, unsigned _node = anyNode);
+
+	// Runs one queued job on the calling thread, returns false if there weren't any
+	bool RunPendingJob();
+
+	// Runs _fn(begin, end) over [0, _count) in chunks of _grain, on the workers and the calling thread, and waits for
+	// them all. Threads take the next chunk when they finish one, so uneven chunks balance out. The default grain is
+	// about four chunks per thread.
+	//
+	// The range is split between the nodes the same way as Numa::GetNodeRange splits _partitionSize (0 meaning
+	// _count), and threads work through their own node's part before helping with other nodes'. Looping over an array
+	// from a NumaAllocator with its capacity as _partitionSize keeps nearly all the memory traffic node local.
+	template<typename Fn>
+	void ParallelFor(size_t _count, Fn&& _fn, size_t _grain = 0, size_t _partitionSize = 0)
+	{
+		if (_count == 0)
+			return;
+
+		const size_t numThreads = m_workers.size() + 1;
+		if (_grain == 0)
+			_grain = std::max<size_t>(1, _count / (numThreads * 4));
+
+		struct Context
+		{
+			struct Range
+			{
+				std::atomic<size_t> next;
+				size_t end;
+			};
+
+			std::remove_reference_t<Fn>* fn;
+			size_t grain;
+			unsigned numNodes;
+			Range ranges[maxNodes];
+			std::atomic<size_t> helpers = 0;
+
+			void Run(unsigned _node)
+			{
+				for (unsigned i = 0; i < numNodes; ++i)
+				{
+					Range& range = ranges[(_node + i) % numNodes];
+					for (size_t begin = range.next.fetch_add(grain); begin < range.end; begin = range.next.fetch_add(grain))
+						(*fn)(begin, std::min(begin + grain, range.end));
+				}
+			}
+		} context;
+		context.fn = &_fn;
+		context.grain = _grain;
+		context.numNodes = GetNumNodes();
+		for (unsigned node = 0; node < context.numNodes; ++node)
+		{
+			size_t begin, end;
+			Numa::GetNodeRange(_partitionSize > 0 ? _partitionSize : _count, node, begin, end);
+			context.ranges[node].next = std::min(begin, _count);
+			context.ranges[node].end = std::min(end, _count);
+		}
+		context.ranges[context.numNodes - 1].end = _count;
+
+		// Helpers go to the same nodes as the workers they'd be run by if nothing else was going on
+		const size_t numHelpers = std::min<size_t>(m_workers.size(), (_count - 1) / _grain);
+		context.helpers = numHelpers;
+		for (size_t i = 0; i < numHelpers; ++i)
+		{
+			Submit([](void* _context, size_t)
+				{
+					auto& context = *static_cast<Context*>(_context);
+					context.Run(GetCurrentNode());
+					--context.helpers;
+				}, &context, 0, m_workerNodes[i]);
+		}
+
+		context.Run(GetCurrentNode());
+		while (context.helpers > 0)
+			if (!RunPendingJob())
+				std::this_thread::yield();
+	}
+
+	// Streams through a buffer on each node with only that node's workers, one node at a time, and returns each
+	// node's throughput in GB/s (0 for nodes without workers). Takes a while, and nothing else should be submitting
+	// work meanwhile.
+	std::vector<double> MeasureNodeBandwidth(size_t _bytesPerNode = 64 << 20);
+
+private:
+	struct Job
+	{
+		JobFunction function;
+		void* context;
+		size_t index;
+	};
+
+	struct Queue
+	{
+		std::vector<Job> jobs;	// ring buffer
+		size_t first = 0;
+		size_t count = 0;
+	};
+
+	void WorkerMain(unsigned _node, unsigned _processor, void (*_onWorkerStart)());
+	bool PopJob(unsigned _node, Job& _job);	// call with m_mutex locked
+
+	std::vector<std::thread> m_workers;
+	std::vector<unsigned> m_workerNodes;
+	std::vector<Queue> m_queues;	// one per node
+	size_t m_numJobs = 0;			// across all the queues
+	unsigned m_localOnlyNode = anyNode;	// other nodes' workers don't steal from this node's queue
+	std::mutex m_mutex;
+	std::condition_variable m_condition;
+	bool m_quit = false;
+};
@@ -111,6 +111,22 @@ double TimingManager::EndProfileSection(std::string const& name)
 	return result;
 }
 
+//static
+double TimingManager::GetTime()
+{
+	// Not g_freq, which isn't set until there's a TimingManager
+	static const __int64 frequency = []
+		{
+			__int64 f;
+			QueryPerformanceFrequency((LARGE_INTEGER *)&f);
+			return f;
+		}();
+
+	__int64 value;
+	QueryPerformanceCounter((LARGE_INTEGER *)&value);
+	return (double)value / (double)frequency;
+}
+
 //static
 void TimingManager::BeginAccumulatedProfileSection(std::string const& name)
 {
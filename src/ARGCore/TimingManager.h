@@ -33,6 +33,10 @@ public:
 
 	static std::map<std::string, AccumulatedData>& GetAccumulatedTimes() { return s_instance->m_accumulatedTimes; }
 
+	// Current time in seconds from an arbitrary starting point. Unlike the profile sections this doesn't touch any
+	// shared state, so it's safe to call from any thread.
+	static double GetTime();
+
 private:
 	__int64 m_lastTimerReading;
 
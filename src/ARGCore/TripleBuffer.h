@@ -0,0 +1,45 @@
+#pragma once
+
+#include <atomic>
+
+// Lock free triple buffer for one writer thread and one reader thread. The writer fills in GetWriteBuffer() and calls
+// Publish(), the reader calls Acquire() to pick up the most recently published buffer and then reads GetReadBuffer().
+// Neither side ever waits for the other. If the writer publishes more than once between acquires the reader only sees
+// the latest, and if it hasn't published since the last acquire the reader keeps the buffer it already has.
+template<typename T>
+class TripleBuffer
+{
+public:
+	// Writer side. The write buffer still holds whatever was in it last time it was used, so reuse it rather than
+	// reallocating if that helps.
+	T& GetWriteBuffer() { return m_buffers[m_writeIndex]; }
+
+	void Publish()
+	{
+		m_writeIndex = m_middle.exchange(m_writeIndex | newDataBit, std::memory_order_acq_rel) & indexMask;
+	}
+
+	// Reader side. HasNewData is only a hint, since more could be published at any time, but if it's true then Acquire
+	// will return true.
+	bool HasNewData() const { return (m_middle.load(std::memory_order_relaxed) & newDataBit) != 0; }
+
+	// Returns true if there was a new buffer
+	bool Acquire()
+	{
+		if ((m_middle.load(std::memory_order_relaxed) & newDataBit) == 0)
+			return false;
+		m_readIndex = m_middle.exchange(m_readIndex, std::memory_order_acq_rel) & indexMask;
+		return true;
+	}
+
+	T const& GetReadBuffer() const { return m_buffers[m_readIndex]; }
+
+private:
+	static constexpr int indexMask = 3;
+	static constexpr int newDataBit = 4;
+
+	T m_buffers[3];
+	int m_writeIndex = 0;
+	int m_readIndex = 1;
+	std::atomic<int> m_middle = 2;	// index of the buffer not owned by either side, plus newDataBit if it's unread
+};
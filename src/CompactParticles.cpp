@@ -0,0 +1,177 @@
+#include "CompactParticles.h"
+
+#include <algorithm>
+#include <limits>
+
+using namespace std;
+
+namespace
+{
+	// Bins are a grid over the particles' bounding box, in Morton order so neighbouring bins are mostly next to each
+	// other too. Finer than the blocks, since the particles bunch up and most of the bins are empty, but not so fine
+	// that the counts for each chunk get big.
+	const int gridBits = 7;
+	const int gridSize = 1 << gridBits;
+	const size_t numBins = (size_t)gridSize * gridSize;
+
+	// Spreads the bits of a cell coordinate out to every other bit
+	uint32_t Spread(uint32_t _x)
+	{
+		_x = (_x | (_x << 4)) & 0x0f0f;
+		_x = (_x | (_x << 2)) & 0x3333;
+		_x = (_x | (_x << 1)) & 0x5555;
+		return _x;
+	}
+
+	uint32_t Interleave(uint32_t _x, uint32_t _y)
+	{
+		return Spread(_x) | Spread(_y) << 1;
+	}
+}
+
+uint32_t CompactParticles::Scratch::GetCompactIndex(uint32_t _index) const
+{
+	return static_cast<uint32_t>(find(order.begin(), order.end(), _index) - order.begin());
+}
+
+void CompactParticles::Assign(Particle const* _particles, size_t _count, ThreadPool& _threadPool, Scratch& _scratch)
+{
+	m_hot.resize(_count);
+	m_ids.resize(_count);
+	m_blocks.resize((_count + blockSize - 1) / blockSize);
+	_scratch.order.resize(_count);
+	if (_count == 0)
+		return;
+
+	// A chunk of particles for each thread, which each count how many of theirs go in each bin
+	const size_t numChunks = min<size_t>(_threadPool.GetNumWorkers() + 1, (_count + blockSize - 1) / blockSize);
+	const size_t chunkSize = (_count + numChunks - 1) / numChunks;
+	auto forEachChunk = [&](auto&& _fn)
+	{
+		_threadPool.ParallelFor(numChunks, [&](size_t begin, size_t end)
+			{
+				for (size_t chunk = begin; chunk < end; ++chunk)
+					_fn(chunk, chunk * chunkSize, min((chunk + 1) * chunkSize, _count));
+			}, 1);
+	};
+
+	vector<VectorType> chunkMin(numChunks), chunkMax(numChunks);
+	forEachChunk([&](size_t _chunk, size_t _begin, size_t _end)
+		{
+			VectorType minPos(numeric_limits<double>::infinity(), numeric_limits<double>::infinity()), maxPos = -minPos;
+			for (size_t i = _begin; i < _end; ++i)
+			{
+				VectorType const& pos = _particles[i].m_pos;
+				minPos = VectorType(min(minPos.x, pos.x), min(minPos.y, pos.y));
+				maxPos = VectorType(max(maxPos.x, pos.x), max(maxPos.y, pos.y));
+			}
+			chunkMin[_chunk] = minPos;
+			chunkMax[_chunk] = maxPos;
+		});
+	VectorType minPos = chunkMin[0], maxPos = chunkMax[0];
+	for (size_t chunk = 1; chunk < numChunks; ++chunk)
+	{
+		minPos = VectorType(min(minPos.x, chunkMin[chunk].x), min(minPos.y, chunkMin[chunk].y));
+		maxPos = VectorType(max(maxPos.x, chunkMax[chunk].x), max(maxPos.y, chunkMax[chunk].y));
+	}
+
+	const double extent = max(maxPos.x - minPos.x, maxPos.y - minPos.y);
+	const double scale = extent > 0. ? gridSize / extent : 0.;
+	auto toCell = [](double _x) { return _x > 0. ? (_x < gridSize ? (uint32_t)_x : gridSize - 1) : 0u; };
+
+	_scratch.bins.resize(_count);
+	_scratch.offsets.assign(numChunks * numBins, 0);
+	forEachChunk([&](size_t _chunk, size_t _begin, size_t _end)
+		{
+			uint32_t* counts = &_scratch.offsets[_chunk * numBins];
+			for (size_t i = _begin; i < _end; ++i)
+			{
+				VectorType const& pos = _particles[i].m_pos;
+				const uint32_t bin = Interleave(toCell((pos.x - minPos.x) * scale), toCell((pos.y - minPos.y) * scale));
+				_scratch.bins[i] = bin;
+				++counts[bin];
+			}
+		});
+
+	// Counts to offsets, bin by bin and then chunk by chunk within each bin, the same as SoftwareRenderer's tiles
+	uint32_t total = 0;
+	for (size_t bin = 0; bin < numBins; ++bin)
+	{
+		for (size_t chunk = 0; chunk < numChunks; ++chunk)
+		{
+			const uint32_t count = _scratch.offsets[chunk * numBins + bin];
+			_scratch.offsets[chunk * numBins + bin] = total;
+			total += count;
+		}
+	}
+
+	forEachChunk([&](size_t _chunk, size_t _begin, size_t _end)
+		{
+			uint32_t* offsets = &_scratch.offsets[_chunk * numBins];
+			for (size_t i = _begin; i < _end; ++i)
+				_scratch.order[offsets[_scratch.bins[i]]++] = static_cast<uint32_t>(i);
+		});
+
+	_threadPool.ParallelFor(m_blocks.size(), [&](size_t begin, size_t end)
+		{
+			for (size_t block = begin; block < end; ++block)
+				AssignBlock(block, _particles, _scratch.order.data());
+		});
+}
+
+void CompactParticles::AssignBlock(size_t _block, Particle const* _particles, uint32_t const* _order)
+{
+	const size_t begin = _block * blockSize, end = min(begin + blockSize, m_hot.size());
+
+	// The middle of the block's bounding box in both position and velocity, so the floats are as small as they can be
+	VectorType minPos(numeric_limits<double>::infinity(), numeric_limits<double>::infinity()), maxPos = -minPos;
+	VectorType minVel = minPos, maxVel = maxPos;
+	for (size_t i = begin; i < end; ++i)
+	{
+		VectorType const& pos = _particles[_order[i]].m_pos;
+		VectorType const& vel = _particles[_order[i]].m_vel;
+		minPos = VectorType(min(minPos.x, pos.x), min(minPos.y, pos.y));
+		maxPos = VectorType(max(maxPos.x, pos.x), max(maxPos.y, pos.y));
+		minVel = VectorType(min(minVel.x, vel.x), min(minVel.y, vel.y));
+		maxVel = VectorType(max(maxVel.x, vel.x), max(maxVel.y, vel.y));
+	}
+	Block& block = m_blocks[_block];
+	block.pos = (minPos + maxPos) * 0.5;
+	block.vel = (minVel + maxVel) * 0.5;
+
+	for (size_t i = begin; i < end; ++i)
+	{
+		Particle const& p = _particles[_order[i]];
+		Hot& hot = m_hot[i];
+		hot.pos[0] = static_cast<float>(p.m_pos.x - block.pos.x);
+		hot.pos[1] = static_cast<float>(p.m_pos.y - block.pos.y);
+		hot.vel[0] = static_cast<float>(p.m_vel.x - block.vel.x);
+		hot.vel[1] = static_cast<float>(p.m_vel.y - block.vel.y);
+		hot.mass = p.m_mass;
+		hot.colour = p.m_colour;
+		hot.unused = 0;
+		m_ids[i] = p.m_id;
+	}
+}
+
+Particle CompactParticles::Get(size_t _index) const
+{
+	Hot const& hot = m_hot[_index];
+	Block const& block = m_blocks[_index / blockSize];
+	return Particle(block.pos + VectorType(hot.pos[0], hot.pos[1]), block.vel + VectorType(hot.vel[0], hot.vel[1]),
+		hot.mass, hot.colour, m_ids[_index]);
+}
+
+void CompactParticles::clear()
+{
+	m_hot.clear();
+	m_ids.clear();
+	m_blocks.clear();
+}
+
+double CompactParticles::GetBytesPerParticle() const
+{
+	if (m_hot.empty())
+		return 0.;
+	return (double)(m_hot.size() * (sizeof(Hot) + sizeof(ParticleId)) + m_blocks.size() * sizeof(Block)) / (double)m_hot.size();
+}
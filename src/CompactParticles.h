@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "ARGCore/ThreadPool.h"
+
+#include "Particle.h"
+
+// Particles packed into 24 bytes each plus their 8 byte ID, for the copies of the universe which only need to be
+// good enough to draw: the snapshots going to the main thread and the one before that kept for interpolation. With
+// ten million particles those copies were most of the memory. The main thread reads them where they are, through
+// ParticleList, rather than unpacking them again. The simulation itself still works on full Particles.
+//
+// Each block of particles has a position and velocity origin as doubles, and the particles store floats relative to
+// that, so the precision depends on how spread out a block is rather than how far it is from the middle of the
+// universe. The particles are binned by where they are before they're split into blocks, so each block is a patch of
+// space rather than whatever happened to be next to each other in the array, which means they don't come out in the
+// order they went in. The colour is a palette index (see ColourPalette). Everything drawing needs is in the 24 bytes,
+// the IDs are kept apart since they're only used for matching particles up between snapshots. Macro flags and kick
+// intervals aren't kept.
+class CompactParticles
+{
+public:
+	static constexpr size_t blockSize = 256;
+	static constexpr size_t hotBytes = 24;		// per particle, everything drawing needs
+
+	// Working memory for Assign, kept by whoever's assigning rather than in every copy
+	struct Scratch
+	{
+		std::vector<uint32_t> bins;		// for each particle
+		std::vector<uint32_t> offsets;	// for each chunk and bin, see Assign
+		std::vector<uint32_t> order;	// the particle each compact one came from
+
+		// Where the particle at _index went, which is a search, so only for the odd particle
+		uint32_t GetCompactIndex(uint32_t _index) const;
+	};
+
+	// Afterwards _scratch.order says which of _particles each compact particle is
+	template<typename Particles>
+	void Assign(Particles const& _particles, ThreadPool& _threadPool, Scratch& _scratch)
+	{
+		Assign(_particles.data(), _particles.size(), _threadPool, _scratch);
+	}
+	void Assign(Particle const* _particles, size_t _count, ThreadPool& _threadPool, Scratch& _scratch);
+
+	Particle Get(size_t _index) const;
+	VectorType GetPos(size_t _index) const { return m_blocks[_index / blockSize].pos + VectorType(m_hot[_index].pos[0], m_hot[_index].pos[1]); }
+	VectorType GetVel(size_t _index) const { return m_blocks[_index / blockSize].vel + VectorType(m_hot[_index].vel[0], m_hot[_index].vel[1]); }
+	float GetMass(size_t _index) const { return m_hot[_index].mass; }
+	uint16_t GetColourIndex(size_t _index) const { return m_hot[_index].colour; }
+	ParticleId GetId(size_t _index) const { return m_ids[_index]; }
+
+	size_t size() const { return m_hot.size(); }
+	bool empty() const { return m_hot.empty(); }
+	void clear();
+
+	// Per particle, including the block origins
+	double GetBytesPerParticle() const;
+
+private:
+	struct Hot
+	{
+		float pos[2];
+		float vel[2];
+		float mass;
+		uint16_t colour;
+		uint16_t unused;
+	};
+	static_assert(sizeof(Hot) == hotBytes, "Hot has grown");
+
+	struct Block
+	{
+		VectorType pos;
+		VectorType vel;
+	};
+
+	void AssignBlock(size_t _block, Particle const* _particles, uint32_t const* _order);
+
+	std::vector<Hot> m_hot;
+	std::vector<ParticleId> m_ids;
+	std::vector<Block> m_blocks;
+};
@@ -0,0 +1,153 @@
+#include "DensityMap.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include <allegro5/allegro.h>
+
+using namespace std;
+
+namespace
+{
+	// Black through red and yellow to white, premultiplied and opaque. Anything at all is at least a dim red, so a
+	// lone particle doesn't vanish next to a galaxy's core.
+	uint32_t const* GetColourRamp()
+	{
+		static const auto ramp = []
+			{
+				vector<uint32_t> ramp(256);
+				for (int i = 1; i < 256; ++i)
+				{
+					const float t = 0.15f + 0.85f * i / 255.f;
+					const uint32_t r = (uint32_t)(min(1.f, t * 3.f) * 255.f);
+					const uint32_t g = (uint32_t)(clamp(t * 3.f - 1.f, 0.f, 1.f) * 255.f);
+					const uint32_t b = (uint32_t)(clamp(t * 3.f - 2.f, 0.f, 1.f) * 255.f);
+					ramp[i] = 0xff000000 | (r << 16) | (g << 8) | b;
+				}
+				return ramp;
+			}();
+		return ramp.data();
+	}
+}
+
+void DensityMap::Build(ParticleList const& _particles, ParticleList const& _ballisticParticles, VectorType const& _scale, VectorType const& _offset, int _w, int _h, ThreadPool& _threadPool)
+{
+	const size_t numPixels = (size_t)_w * _h;
+	const size_t numHistograms = _threadPool.GetNumWorkers() + 1;
+	if (_w != m_w || _h != m_h || m_histograms.size() != numHistograms)
+	{
+		m_w = _w;
+		m_h = _h;
+		m_histograms.assign(numHistograms, vector<float>(numPixels, 0.f));
+		m_bitmap = make_unique<BitmapWrapper>(m_w, m_h, false);
+	}
+	m_counts.assign(numHistograms, 0);
+	m_masses.assign(numHistograms, 0.);
+
+	// A histogram for each share of the particles rather than each thread as such, but there are as many shares as
+	// threads so they all get one
+	_threadPool.ParallelFor(numHistograms, [&](size_t begin, size_t end)
+		{
+			for (size_t h = begin; h < end; ++h)
+			{
+				float* histogram = m_histograms[h].data();
+				size_t count = 0;
+				double mass = 0.;
+				for (auto const* particles : { &_particles, &_ballisticParticles })
+				{
+					const size_t first = particles->size() * h / numHistograms;
+					const size_t last = particles->size() * (h + 1) / numHistograms;
+					for (size_t i = first; i < last; ++i)
+					{
+						const VectorType pos = particles->GetPos(i);
+						const float particleMass = particles->GetMass(i);
+						mass += particleMass;
+						const double x = pos.x * _scale.x + _offset.x;
+						const double y = pos.y * _scale.y + _offset.y;
+						// Written this way round so NaN positions are skipped too
+						if (!(x >= 0. && y >= 0. && x < m_w && y < m_h))
+							continue;
+						histogram[(size_t)y * m_w + (size_t)x] += particleMass;
+						++count;
+					}
+				}
+				m_counts[h] = count;
+				m_masses[h] = mass;
+			}
+		}, 1);
+
+	m_numBinned = 0;
+	double totalMass = 0.;
+	for (size_t h = 0; h < numHistograms; ++h)
+	{
+		m_numBinned += m_counts[h];
+		totalMass += m_masses[h];
+	}
+
+	// Sum into the first histogram, clearing the others ready for next time
+	m_rowMax.assign(m_h, 0.f);
+	m_rowOccupied.assign(m_h, 0);
+	_threadPool.ParallelFor(m_h, [&](size_t begin, size_t end)
+		{
+			for (size_t y = begin; y < end; ++y)
+			{
+				float* total = &m_histograms[0][y * m_w];
+				for (size_t h = 1; h < numHistograms; ++h)
+				{
+					float* row = &m_histograms[h][y * m_w];
+					for (int x = 0; x < m_w; ++x)
+						total[x] += row[x];
+					fill(row, row + m_w, 0.f);
+				}
+				float rowMax = 0.f;
+				uint32_t occupied = 0;
+				for (int x = 0; x < m_w; ++x)
+				{
+					rowMax = max(rowMax, total[x]);
+					occupied += total[x] > 0.f;
+				}
+				m_rowMax[y] = rowMax;
+				m_rowOccupied[y] = occupied;
+			}
+		});
+
+	float maxDensity = 0.f;
+	m_numOccupied = 0;
+	for (int y = 0; y < m_h; ++y)
+	{
+		maxDensity = max(maxDensity, m_rowMax[y]);
+		m_numOccupied += m_rowOccupied[y];
+	}
+
+	ALLEGRO_LOCKED_REGION* region = al_lock_bitmap(m_bitmap->get(), ALLEGRO_PIXEL_FORMAT_ARGB_8888, ALLEGRO_LOCK_WRITEONLY);
+	if (!region)
+	{
+		fill(m_histograms[0].begin(), m_histograms[0].end(), 0.f);
+		return;
+	}
+
+	// One average particle on a pixel is where asinh goes from linear to logarithmic
+	const float softness = totalMass > 0. ? (float)(totalMass / (_particles.size() + _ballisticParticles.size())) : 1.f;
+	const float toneScale = maxDensity > 0.f ? 255.f / asinh(maxDensity / softness) : 0.f;
+	uint32_t const* ramp = GetColourRamp();
+	_threadPool.ParallelFor(m_h, [&](size_t begin, size_t end)
+		{
+			for (size_t y = begin; y < end; ++y)
+			{
+				float* total = &m_histograms[0][y * m_w];
+				uint32_t* dest = reinterpret_cast<uint32_t*>(static_cast<char*>(region->data) + (ptrdiff_t)y * region->pitch);
+				for (int x = 0; x < m_w; ++x)
+				{
+					dest[x] = total[x] > 0.f ? ramp[max(1, min(255, (int)(asinh(total[x] / softness) * toneScale)))] : 0;
+					total[x] = 0.f;
+				}
+			}
+		});
+	al_unlock_bitmap(m_bitmap->get());
+}
+
+void DensityMap::Draw()
+{
+	if (m_bitmap)
+		al_draw_bitmap(m_bitmap->get(), 0, 0, 0);
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "ARGCore/Sprites.h"
+#include "ARGCore/ThreadPool.h"
+
+#include "ParticleList.h"
+
+// The particles' mass binned into screen pixels and tone mapped into a bitmap, for when there are so many particles
+// on each pixel that drawing them one at a time is wasted work and only shows whichever was drawn last. It's O(N) to
+// bin them plus O(pixels) to tone map, then one blit.
+//
+// Each thread bins its share of the particles into its own histogram so nothing needs to be atomic, and the
+// histograms are summed (and zeroed for next time) a row at a time in parallel. The density goes through asinh,
+// which is linear for a few particles and logarithmic for lots, so a galaxy's core and its outskirts both show.
+class DensityMap
+{
+public:
+	// Screen position is world position * _scale + _offset for each axis
+	void Build(ParticleList const& _particles, ParticleList const& _ballisticParticles, VectorType const& _scale, VectorType const& _offset, int _w, int _h, ThreadPool& _threadPool);
+
+	// Onto the current target, at the top left. Empty pixels are transparent.
+	void Draw();
+
+	// Of the last Build, for deciding when it's worth using
+	size_t GetNumBinned() const { return m_numBinned; }
+	size_t GetNumOccupiedPixels() const { return m_numOccupied; }
+	float GetParticlesPerPixel() const { return m_numOccupied > 0 ? (float)m_numBinned / m_numOccupied : 0.f; }
+
+	size_t GetBytes() const { return (m_histograms.size() * sizeof(float) + sizeof(uint32_t)) * m_w * m_h; }
+
+private:
+	int m_w = 0, m_h = 0;
+	std::vector<std::vector<float>> m_histograms;	// one for each thread, mass in each pixel
+	std::vector<size_t> m_counts;					// particles binned by each thread
+	std::vector<double> m_masses;					// of each thread's share, binned or not
+	std::vector<float> m_rowMax;
+	std::vector<uint32_t> m_rowOccupied;
+	size_t m_numBinned = 0;
+	size_t m_numOccupied = 0;
+	std::unique_ptr<BitmapWrapper> m_bitmap;
+};
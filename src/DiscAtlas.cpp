@@ -0,0 +1,50 @@
+#include "DiscAtlas.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include <allegro5/allegro_primitives.h>
+
+using namespace std;
+
+namespace
+{
+	const int atlasWidth = 1024;
+	const int cellPadding = 1;		// so the edge of a quad never picks up a neighbour
+}
+
+void DiscAtlas::Create(float _edgeThickness)
+{
+	if (m_bitmap && _edgeThickness == m_edgeThickness)
+		return;
+	m_edgeThickness = _edgeThickness;
+
+	// Packed in rows, smallest first, so each row is about as tall as the cells in it
+	const int numCells = (int)((maxRadius - minRadius) * stepsPerPixel) + 1;
+	m_cells.resize(numCells);
+	int x = 0, y = 0, rowHeight = 0;
+	for (int i = 0; i < numCells; ++i)
+	{
+		const float radius = minRadius + (float)i / stepsPerPixel;
+		const int size = (int)ceil(2.f * radius + _edgeThickness) + 2 * cellPadding;
+		if (x + size > atlasWidth)
+		{
+			x = 0;
+			y += rowHeight;
+			rowHeight = 0;
+		}
+		m_cells[i] = { x + size * 0.5f, y + size * 0.5f, size * 0.5f };
+		x += size;
+		rowHeight = max(rowHeight, size);
+	}
+
+	m_bitmap = make_unique<BitmapWrapper>(atlasWidth, y + rowHeight, true);
+	ALLEGRO_BITMAP* previousTarget = al_get_target_bitmap();
+	m_bitmap->clear(al_map_rgba(0, 0, 0, 0));
+	for (int i = 0; i < numCells; ++i)
+	{
+		const float radius = minRadius + (float)i / stepsPerPixel;
+		al_draw_circle(m_cells[i].u, m_cells[i].v, radius, al_map_rgb(255, 255, 255), _edgeThickness);
+	}
+	Sprites::setTargetBitmap(previousTarget);
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include "ARGCore/Sprites.h"
+
+// Circle outlines drawn once into a bitmap at radii a quarter of a pixel apart, so particles can be drawn as quads
+// cut out of it rather than as a new ring of triangles each. The outlines are white and get tinted by the vertex
+// colour, so one set does for every colour in the palette.
+class DiscAtlas
+{
+public:
+	static constexpr float minRadius = 0.5f;
+	static constexpr float maxRadius = 32.f;		// bigger circles are rare enough to draw as rings
+	static constexpr int stepsPerPixel = 4;
+
+	struct Cell
+	{
+		float u, v;			// centre of the outline, in texels
+		float halfSize;		// of the square around it
+	};
+
+	// Draws the outlines, needs the display. Does nothing if they're already there with this thickness.
+	void Create(float _edgeThickness);
+
+	bool IsCreated() const { return m_bitmap != nullptr; }
+	ALLEGRO_BITMAP* GetBitmap() const { return m_bitmap->get(); }
+
+	// The outline nearest _radius, which must be within [minRadius, maxRadius]
+	Cell const& GetCell(float _radius) const
+	{
+		return m_cells[(size_t)((_radius - minRadius) * stepsPerPixel + 0.5f)];
+	}
+
+private:
+	std::unique_ptr<BitmapWrapper> m_bitmap;
+	std::vector<Cell> m_cells;
+	float m_edgeThickness = 0.f;
+};
@@ -0,0 +1,67 @@
+#include "FrameWriter.h"
+
+#include "ARGCore/ARGUtils.h"
+
+using namespace std;
+
+FrameWriter::FrameWriter(unsigned _numWorkers, size_t _maxFramesInFlight) :
+	m_threadPool(_numWorkers)
+{
+	for (size_t i = 0; i < max<size_t>(_maxFramesInFlight, 1); ++i)
+	{
+		m_slots.push_back(make_unique<Slot>());
+		m_slots.back()->owner = this;
+	}
+}
+
+FrameWriter::~FrameWriter()
+{
+	Wait();
+}
+
+SoftwareRenderer::Frame* FrameWriter::BeginFrame(bool _wait)
+{
+	for (;;)
+	{
+		for (auto& slot : m_slots)
+			if (!slot->busy)
+				return &slot->frame;
+		if (!_wait)
+			return nullptr;
+		if (!m_threadPool.RunPendingJob())
+			this_thread::yield();
+	}
+}
+
+void FrameWriter::Submit(SoftwareRenderer::Frame* _frame, string const& _filename)
+{
+	auto slot = find_if(m_slots.begin(), m_slots.end(), [_frame](auto const& _slot) { return &_slot->frame == _frame; });
+	if (slot == m_slots.end())
+		return;
+
+	(*slot)->filename = _filename;
+	(*slot)->busy = true;
+	m_threadPool.Submit([](void* _slot, size_t)
+		{
+			auto& slot = *static_cast<Slot*>(_slot);
+			slot.renderer.Render(slot.frame, slot.image, &slot.owner->m_threadPool);
+			if (slot.pngWriter.Write(slot.filename, slot.image.data(), slot.frame.w, slot.frame.h))
+			{
+				++slot.owner->m_numWritten;
+			}
+			else
+			{
+				argDebugf("Couldn't write %s", slot.filename.c_str());
+				++slot.owner->m_numFailed;
+			}
+			slot.busy = false;
+		}, slot->get());
+}
+
+void FrameWriter::Wait()
+{
+	for (auto& slot : m_slots)
+		while (slot->busy)
+			if (!m_threadPool.RunPendingJob())
+				this_thread::yield();
+}
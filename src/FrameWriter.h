@@ -0,0 +1,54 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "ARGCore/PngWriter.h"
+#include "ARGCore/ThreadPool.h"
+
+#include "SoftwareRenderer.h"
+
+// Renders frames with SoftwareRenderer and writes them out as PNGs on a thread pool of its own, so whoever captured
+// them can get on with the next simulation steps in the meantime. It has its own pool rather than sharing one, as
+// anything waiting on a pool runs its queued jobs, and nobody wants to run a whole frame in the middle of a step.
+//
+// There are a few frames to fill in, each with everything it needs to render and write itself. Once they're all in
+// use, the next one can either be dropped or waited for. Only one thread should capture frames.
+class FrameWriter
+{
+public:
+	explicit FrameWriter(unsigned _numWorkers = 0, size_t _maxFramesInFlight = 3);
+	~FrameWriter();
+
+	// A frame to fill in and pass to Submit, or null if they're all still being written and _wait is false. Waiting
+	// helps with the writing.
+	SoftwareRenderer::Frame* BeginFrame(bool _wait);
+	void Submit(SoftwareRenderer::Frame* _frame, std::string const& _filename);
+
+	// Until everything submitted has been written
+	void Wait();
+
+	size_t GetNumWritten() const { return m_numWritten; }
+	size_t GetNumFailed() const { return m_numFailed; }
+
+	ThreadPool& GetThreadPool() { return m_threadPool; }
+
+private:
+	struct Slot
+	{
+		SoftwareRenderer::Frame frame;
+		SoftwareRenderer renderer;
+		std::vector<uint32_t> image;
+		PngWriter pngWriter;
+		std::string filename;
+		FrameWriter* owner = nullptr;
+		std::atomic<bool> busy = false;
+	};
+
+	ThreadPool m_threadPool;
+	std::vector<std::unique_ptr<Slot>> m_slots;
+	std::atomic<size_t> m_numWritten = 0;
+	std::atomic<size_t> m_numFailed = 0;
+};
@@ -1,19 +1,117 @@
 #pragma warning(disable: 4786)
 
 #include <cstdio>
+#include <climits>
 #include <cmath>
 #include <ctime>
 
 #include <sys\stat.h>
 
+#include <cstdlib>
+#include <string>
+
 #include "ParticleUniverseGame.h"
+#include "RecordingRenderer.h"
+
+#include <allegro5/allegro.h>
+#include <allegro5/allegro_primitives.h>
+#include <allegro5/allegro_font.h>
+#include <allegro5/allegro_ttf.h>
 
 
-int main(void)
+namespace
+{
+	void PrintUsage()
+	{
+		printf("Usage:\n"
+			"  ParticleUniverse\n"
+			"  ParticleUniverse --headless <updates> <directory>\n"
+			"  ParticleUniverse --render-recording <recording> <directory> <width> <height> <x> <y> <viewport width> [<end x> <end y> <end viewport width>]\n");
+	}
+
+	// The whole of _text has to be a number, so "abc" or "12x" are errors rather than 0 or 12
+	bool ParseInt(char const* _text, int& _value)
+	{
+		char* end;
+		const long value = strtol(_text, &end, 10);
+		if (end == _text || *end != '\0' || value < INT_MIN || value > INT_MAX)
+			return false;
+		_value = (int)value;
+		return true;
+	}
+
+	bool ParseDouble(char const* _text, double& _value)
+	{
+		char* end;
+		_value = strtod(_text, &end);
+		return end != _text && *end == '\0' && std::isfinite(_value);
+	}
+}
+
+int main(int argc, char* argv[])
 {
 	/* Seed the random number generator with current time. */
 	srand((unsigned)time(NULL));
 
+	// --headless <updates> <directory> runs the simulation without a display and writes a PNG after each update
+	if (argc > 1 && std::string(argv[1]) == "--headless")
+	{
+		int numUpdates;
+		if (argc != 4 || !ParseInt(argv[2], numUpdates) || numUpdates <= 0)
+		{
+			PrintUsage();
+			exit(1);
+		}
+
+		al_init();
+		al_init_primitives_addon();
+		al_init_font_addon();
+		al_init_ttf_addon();
+
+		Universe universe;
+		universe.RunHeadless(numUpdates, argv[3]);
+		exit(0);
+	}
+
+	// --render-recording <recording> <directory> <width> <height> <x> <y> <viewport width> [<end x> <end y> <end viewport
+	// width>] renders a recording to PNGs on every core, with the camera moving from the first view to the second
+	if (argc > 1 && std::string(argv[1]) == "--render-recording")
+	{
+		RecordingRenderer::Options options;
+		double x = 0., y = 0., endX = 0., endY = 0.;
+		bool valid = (argc == 9 || argc == 12)
+			&& ParseInt(argv[4], options.w) && ParseInt(argv[5], options.h)
+			&& ParseDouble(argv[6], x) && ParseDouble(argv[7], y) && ParseDouble(argv[8], options.viewportWidthStart);
+		if (argc == 12)
+		{
+			valid = valid && ParseDouble(argv[9], endX) && ParseDouble(argv[10], endY) && ParseDouble(argv[11], options.viewportWidthEnd);
+		}
+		else
+		{
+			endX = x;
+			endY = y;
+			options.viewportWidthEnd = options.viewportWidthStart;
+		}
+
+		// The zoom is interpolated geometrically, so both widths have to be above 0 as well as the image
+		if (!valid || options.w <= 0 || options.h <= 0 || options.viewportWidthStart <= 0. || options.viewportWidthEnd <= 0.)
+		{
+			PrintUsage();
+			exit(1);
+		}
+		options.cameraStart = VectorType(x, y);
+		options.cameraEnd = VectorType(endX, endY);
+
+		RecordingRenderer recordingRenderer;
+		exit(recordingRenderer.Render(argv[2], argv[3], options) > 0 ? 0 : 1);
+	}
+
+	if (argc > 1)
+	{
+		PrintUsage();
+		exit(1);
+	}
+
 	ParticleUniverseGame* g = new ParticleUniverseGame();
 
 	g->MainLoop();
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+
+#include "ARGCore/ColourPalette.h"
+#include "ARGCore/SlotMap.h"
+#include "ARGCore/Vector2.h"
+
+#include <allegro5/allegro.h>
+
+using VectorType = Vector2Base<double>;
+using ParticleId = SlotMap::Handle;
+
+// 48 bytes. The colour is an index into ColourPalette rather than an ALLEGRO_COLOR, which saved 14 bytes, the kick
+// interval fits in 8 bits and macro particles' records are found by their ID, so there's room for a 64 bit ID. The
+// position and velocity are doubles since this is what's simulated, see CompactParticles for the copies which don't
+// need to be exact.
+struct Particle
+{
+	VectorType m_pos;
+	VectorType m_vel;
+
+	float m_mass;
+
+	uint16_t m_colour;		// see ColourPalette
+
+	// Number of steps between gravity kicks, more than 1 when far from the view in view fidelity mode
+	uint8_t m_kickInterval = 1;
+
+	// An aggregate of several others, with its record in Universe::m_macroParticles under its ID
+	bool m_isMacro = false;
+
+	// Handle in Universe::m_particleSlots, given out when the particle is added to the universe and kept by copies, so
+	// the same particle can be found in different snapshots and recordings. 0 for particles outside the universe, like
+	// trails.
+	ParticleId m_id = 0;
+
+	Particle():
+		m_pos({ 0,0 }),
+		m_mass(1),
+		m_colour(0)
+	{
+	}
+
+	Particle(VectorType _pos, VectorType _vel, float _mass, ALLEGRO_COLOR _col):
+			m_pos(_pos),
+			m_vel(_vel),
+			m_mass(_mass),
+			m_colour(ColourPalette::GetIndex(_col))
+	{
+	}
+
+	Particle(VectorType _pos, VectorType _vel, float _mass, uint16_t _colour):
+			m_pos(_pos),
+			m_vel(_vel),
+			m_mass(_mass),
+			m_colour(_colour)
+	{
+	}
+
+	// An existing particle, keeping its ID
+	Particle(VectorType _pos, VectorType _vel, float _mass, uint16_t _colour, ParticleId _id):
+			m_pos(_pos),
+			m_vel(_vel),
+			m_mass(_mass),
+			m_colour(_colour),
+			m_id(_id)
+	{
+	}
+
+	Particle(const Particle& other) = default;
+
+	Particle(Particle&&) noexcept = default;
+	Particle& operator=(Particle&&) noexcept = default;
+
+	__forceinline VectorType GetPos() const { return m_pos; }
+	__forceinline VectorType GetVel() const { return m_vel; }
+	__forceinline void SetPos(VectorType _pos) { m_pos = _pos; }
+	__forceinline void SetVel(VectorType _vel) { m_vel = _vel; }
+	__forceinline void AddToVel(VectorType _vel) { m_vel += _vel; }
+
+	__forceinline bool IsMacro() const { return m_isMacro; }
+
+	__forceinline float GetMass() const { return m_mass; }
+	__forceinline void SetMass(float _mass) { m_mass = _mass; }
+
+	__forceinline ALLEGRO_COLOR const& GetColour() const { return ColourPalette::GetColour(m_colour); }
+
+	//__forceinline float GetSize(float logBase) const { return log(m_mass) * 2.5f; }
+	__forceinline float GetSize(float logBase) const { return (log(m_mass) / log(logBase)) * 2.5f; }
+
+	void operator = (Particle const& _param)
+	{
+		m_pos = _param.GetPos();
+		m_vel = _param.GetVel();
+		m_mass = _param.GetMass();
+		m_colour = _param.m_colour;
+		m_isMacro = _param.m_isMacro;
+		m_kickInterval = _param.m_kickInterval;
+		m_id = _param.m_id;
+	}
+
+	void Merge(Particle const& _other)
+	{
+		float ratio = m_mass / (m_mass + _other.m_mass);
+		float otherRatio = 1.f - ratio;
+		m_pos = m_pos * ratio + _other.m_pos * otherRatio;
+		m_vel = m_vel * ratio + _other.m_vel * otherRatio;
+		m_mass += _other.m_mass;
+	}
+};
+
+static_assert(sizeof(Particle) == 48, "Particle has grown, see the comment above it");
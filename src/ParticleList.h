@@ -0,0 +1,52 @@
+#pragma once
+
+#include <vector>
+
+#include "CompactParticles.h"
+#include "Particle.h"
+
+// One tier of a snapshot's particles as the main thread sees them, whether the snapshot was compact or not, so compact
+// snapshots are read where they are rather than decoded back into Particles. The positions can come from a separate
+// array instead, which is how Render shows the interpolated positions without copying the particles.
+//
+// Cheap to copy, it only points at the particles, so it mustn't outlive them.
+class ParticleList
+{
+public:
+	template<typename Allocator>
+	ParticleList(std::vector<Particle, Allocator> const& _particles, VectorType const* _positions = nullptr) : m_particles(_particles.data()), m_size(_particles.size()), m_positions(_positions) {}
+	ParticleList(CompactParticles const& _particles, VectorType const* _positions = nullptr) : m_compact(&_particles), m_size(_particles.size()), m_positions(_positions) {}
+
+	size_t size() const { return m_size; }
+	bool empty() const { return size() == 0; }
+
+	VectorType GetPos(size_t _index) const
+	{
+		if (m_positions)
+			return m_positions[_index];
+		return m_particles ? m_particles[_index].GetPos() : m_compact->GetPos(_index);
+	}
+	VectorType GetVel(size_t _index) const { return m_particles ? m_particles[_index].GetVel() : m_compact->GetVel(_index); }
+	float GetMass(size_t _index) const { return m_particles ? m_particles[_index].GetMass() : m_compact->GetMass(_index); }
+	uint16_t GetColourIndex(size_t _index) const { return m_particles ? m_particles[_index].m_colour : m_compact->GetColourIndex(_index); }
+	ALLEGRO_COLOR const& GetColour(size_t _index) const { return ColourPalette::GetColour(GetColourIndex(_index)); }
+	ParticleId GetId(size_t _index) const { return m_particles ? m_particles[_index].m_id : m_compact->GetId(_index); }
+
+	// The same particles at _positions instead
+	ParticleList WithPositions(VectorType const* _positions) const { ParticleList list = *this; list.m_positions = _positions; return list; }
+
+	// A copy of the whole particle, for the odd one like the one under the mouse
+	Particle operator[](size_t _index) const
+	{
+		Particle p = m_particles ? m_particles[_index] : m_compact->Get(_index);
+		if (m_positions)
+			p.SetPos(m_positions[_index]);
+		return p;
+	}
+
+private:
+	Particle const* m_particles = nullptr;
+	CompactParticles const* m_compact = nullptr;
+	size_t m_size = 0;
+	VectorType const* m_positions = nullptr;
+};
@@ -0,0 +1,175 @@
+#include "ParticleMesh.h"
+
+using namespace std;
+
+void ParticleMesh::SetResolution(int _rowsCols, double _splitCells)
+{
+	// Radix 2 FFT, and at least enough cells for the two cell margin in Deposit to leave something in the middle
+	int size = 8;
+	while (size < _rowsCols)
+		size *= 2;
+	m_size = size;
+	m_splitCells = max(_splitCells, 0.1);
+}
+
+void ParticleMesh::UpdateKernel()
+{
+	if (m_kernelSize == m_size && m_kernelSplitCells == m_splitCells)
+		return;
+
+	// Long range Green's function in units of cells, -erf(d / 2rs) / d, which tends to -1 / (rs sqrt(pi)) at d = 0.
+	// Distances wrap around the padded mesh so that the transform is of an even function.
+	const size_t padded = m_size * 2;
+	const double alpha = m_splitCells;
+	m_work.assign(padded * padded, 0.);
+	for (size_t y = 0; y < padded; ++y)
+	{
+		const double dy = (double)min(y, padded - y);
+		for (size_t x = 0; x < padded; ++x)
+		{
+			const double dx = (double)min(x, padded - x);
+			const double d = sqrt(dx * dx + dy * dy);
+			m_work[y * padded + x] = d == 0. ? -1. / (alpha * sqrt(3.14159265358979323846)) : -erf(d / (2. * alpha)) / d;
+		}
+	}
+
+	FFT2D(false, padded);
+
+	m_kernelFourier.resize(padded * padded);
+	for (size_t i = 0; i < m_work.size(); ++i)
+		m_kernelFourier[i] = m_work[i].real();
+
+	m_kernelSize = m_size;
+	m_kernelSplitCells = m_splitCells;
+}
+
+void ParticleMesh::Solve()
+{
+	UpdateKernel();
+
+	const size_t size = m_size;
+	const size_t padded = size * 2;
+
+	m_work.assign(padded * padded, 0.);
+	for (size_t y = 0; y < size; ++y)
+		for (size_t x = 0; x < size; ++x)
+			m_work[y * padded + x] = m_density[y * size + x];
+
+	// Only the first half of the rows have any mass in them, the rest transform to zero
+	FFT2D(false, size);
+
+	// Convolution is multiplication in Fourier space, and this is where the inverse transform gets normalised
+	const double scale = 1. / (double)(padded * padded);
+	m_threadPool.ParallelFor(m_work.size(), [&](size_t begin, size_t end)
+		{
+			for (size_t i = begin; i < end; ++i)
+				m_work[i] *= m_kernelFourier[i] * scale;
+		});
+
+	// And only the first half of the rows of the result are needed
+	FFT2D(true, size);
+
+	// Potential is G * m_work / cellSize, acceleration is minus its gradient. Central differences inside the mesh,
+	// one sided at the edges, where there aren't any particles anyway.
+	const double accelScale = -1. / (m_cellSize * m_cellSize);
+	m_accel.resize(size * size);
+	m_threadPool.ParallelFor(size, [&](size_t begin, size_t end)
+		{
+			for (size_t y = begin; y < end; ++y)
+			{
+				const size_t y0 = y > 0 ? y - 1 : y, y1 = min(y + 1, size - 1);
+				for (size_t x = 0; x < size; ++x)
+				{
+					const size_t x0 = x > 0 ? x - 1 : x, x1 = min(x + 1, size - 1);
+					const double gx = (m_work[y * padded + x1].real() - m_work[y * padded + x0].real()) / (double)(x1 - x0);
+					const double gy = (m_work[y1 * padded + x].real() - m_work[y0 * padded + x].real()) / (double)(y1 - y0);
+					m_accel[y * size + x] = Vector(gx, gy) * accelScale;
+				}
+			}
+		});
+}
+
+ParticleMesh::Vector ParticleMesh::Interpolate(Vector const& _pos) const
+{
+	int x, y;
+	double tx, ty;
+	GetCell(_pos, x, y, tx, ty);
+	const Vector* cell = &m_accel[y * m_size + x];
+	return cell[0] * ((1. - tx) * (1. - ty)) + cell[1] * (tx * (1. - ty))
+		+ cell[m_size] * ((1. - tx) * ty) + cell[m_size + 1] * (tx * ty);
+}
+
+void ParticleMesh::FFT(complex<double>* _data, size_t _n, bool _inverse)
+{
+	// Iterative radix 2 Cooley-Tukey, unnormalised in both directions
+	for (size_t i = 1, j = 0; i < _n; ++i)
+	{
+		size_t bit = _n >> 1;
+		for (; j & bit; bit >>= 1)
+			j ^= bit;
+		j ^= bit;
+		if (i < j)
+			swap(_data[i], _data[j]);
+	}
+
+	for (size_t length = 2; length <= _n; length <<= 1)
+	{
+		const double angle = 2. * 3.14159265358979323846 / (double)length * (_inverse ? 1. : -1.);
+		const complex<double> step = polar(1., angle);
+		for (size_t i = 0; i < _n; i += length)
+		{
+			complex<double> w = 1.;
+			for (size_t k = 0; k < length / 2; ++k)
+			{
+				complex<double> even = _data[i + k];
+				complex<double> odd = _data[i + k + length / 2] * w;
+				_data[i + k] = even + odd;
+				_data[i + k + length / 2] = even - odd;
+				w *= step;
+			}
+		}
+	}
+}
+
+void ParticleMesh::FFT2D(bool _inverse, size_t _rows)
+{
+	// Going forward, rows from _rows onwards are assumed to be zero so transform to zero and can be skipped. Going
+	// back, only rows up to _rows are transformed so the rest of the result is left incomplete.
+	const size_t padded = m_size * 2;
+
+	auto transformRows = [&]
+	{
+		m_threadPool.ParallelFor(_rows, [&](size_t begin, size_t end)
+			{
+				for (size_t y = begin; y < end; ++y)
+					FFT(&m_work[y * padded], padded, _inverse);
+			});
+	};
+
+	auto transformColumns = [&]
+	{
+		m_threadPool.ParallelFor(padded, [&](size_t begin, size_t end)
+			{
+				ArenaVector<complex<double>> column(padded, Arena::GetThreadArena());
+				for (size_t x = begin; x < end; ++x)
+				{
+					for (size_t y = 0; y < padded; ++y)
+						column[y] = m_work[y * padded + x];
+					FFT(column.data(), padded, _inverse);
+					for (size_t y = 0; y < padded; ++y)
+						m_work[y * padded + x] = column[y];
+				}
+			});
+	};
+
+	if (!_inverse)
+	{
+		transformRows();
+		transformColumns();
+	}
+	else
+	{
+		transformColumns();
+		transformRows();
+	}
+}
@@ -0,0 +1,206 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <limits>
+#include <thread>
+#include <vector>
+
+#include "ARGCore/Vector2.h"
+#include "ARGCore/ThreadPool.h"
+#include "ARGCore/Arena.h"
+
+// Particle-mesh gravity. Mass is deposited onto a square mesh covering all the particles with cloud-in-cell
+// assignment, the potential is found by convolving it with a Green's function using FFTs, and accelerations are
+// interpolated back to the particles with the same cloud-in-cell weights.
+//
+// The simulation uses 1/r^2 gravity in the plane rather than the 1/r gravity you'd get from solving the 2D Poisson
+// equation, so instead of solving it in k-space the mesh uses the 1/r potential as the Green's function. The mesh is
+// zero padded to twice its size so the convolution doesn't wrap around (isolated rather than periodic boundaries).
+//
+// Only the long range part of gravity is done on the mesh, using the potential -erf(r / 2rs) / r which is smooth on
+// the scale of a few cells. The caller has to add the short range remainder for pairs closer than about 4.5 rs with
+// ShortRangeForceFactor, see Universe::AdvanceGravityParticleMeshMode.
+class ParticleMesh
+{
+public:
+	using Vector = Vector2Base<double>;
+
+	explicit ParticleMesh(ThreadPool& _threadPool) : m_threadPool(_threadPool) {}
+
+	// _rowsCols is rounded up to a power of 2, _splitCells is rs in units of mesh cells
+	void SetResolution(int _rowsCols, double _splitCells);
+
+	int GetRowsCols() const { return m_size; }
+	double GetCellSize() const { return m_cellSize; }
+	double GetSplitRadius() const { return m_splitCells * m_cellSize; }
+	Vector GetOrigin() const { return { m_originX, m_originY }; }
+
+	// Fits the mesh to the particles and deposits their mass onto it, in parallel. If _deterministic is set each cell's
+	// mass is added up in the same order whatever the number of threads, which is slightly slower.
+	template<typename Particles>
+	void Deposit(Particles const& _particles, bool _deterministic);
+
+	// Convolves the deposited mass with the long range Green's function and differentiates the potential to get an
+	// acceleration mesh
+	void Solve();
+
+	// Long range acceleration per unit G at a position within the mesh
+	Vector Interpolate(Vector const& _pos) const;
+
+	// Multiply G m1 m2 / r^2 by this to get the short range part of the force between two particles
+	static double ShortRangeForceFactor(double _r, double _splitRadius)
+	{
+		const double x = _r / (2. * _splitRadius);
+		return std::erfc(x) + (2. * x / std::sqrt(3.14159265358979323846)) * std::exp(-x * x);
+	}
+
+private:
+	void UpdateKernel();
+
+	// Cloud-in-cell weights, particles are always at least a cell away from the edge of the mesh
+	void GetCell(Vector const& _pos, int& _x, int& _y, double& _tx, double& _ty) const
+	{
+		const double fx = (_pos.x - m_originX) / m_cellSize - 0.5;
+		const double fy = (_pos.y - m_originY) / m_cellSize - 0.5;
+		_x = std::clamp(static_cast<int>(std::floor(fx)), 0, m_size - 2);
+		_y = std::clamp(static_cast<int>(std::floor(fy)), 0, m_size - 2);
+		_tx = std::clamp(fx - _x, 0., 1.);
+		_ty = std::clamp(fy - _y, 0., 1.);
+	}
+
+	static void FFT(std::complex<double>* _data, size_t _n, bool _inverse);
+	void FFT2D(bool _inverse, size_t _rows);
+
+	ThreadPool& m_threadPool;
+
+	int m_size = 0;				// mesh cells per side, the padded mesh is twice this
+	double m_splitCells = 1.25;
+
+	double m_originX = 0.;
+	double m_originY = 0.;
+	double m_cellSize = 1.;
+
+	std::vector<double> m_density;						// mass per cell
+	std::vector<std::vector<double>> m_threadDensity;	// one mesh per deposit thread, summed into m_density
+	std::vector<size_t> m_rowStart;						// deterministic deposit, particles sorted by stencil row
+	std::vector<size_t> m_rowParticles;
+	std::vector<std::complex<double>> m_work;			// padded mesh
+	std::vector<double> m_kernelFourier;				// transform of the Green's function, real since it's even
+	std::vector<Vector> m_accel;
+
+	int m_kernelSize = 0;
+	double m_kernelSplitCells = 0.;
+};
+
+template<typename Particles>
+void ParticleMesh::Deposit(Particles const& _particles, bool _deterministic)
+{
+	// Square mesh around the particles with a margin of two cells, so the cloud-in-cell stencil and the potential
+	// differences at the edges don't have to be special cased
+	double minX = std::numeric_limits<double>::infinity(), minY = minX;
+	double maxX = -minX, maxY = -minX;
+	for (auto const& p : _particles)
+	{
+		minX = std::min(minX, p.GetPos().x);
+		minY = std::min(minY, p.GetPos().y);
+		maxX = std::max(maxX, p.GetPos().x);
+		maxY = std::max(maxY, p.GetPos().y);
+	}
+	if (_particles.empty())
+		minX = minY = maxX = maxY = 0.;
+
+	const double extent = std::max({ maxX - minX, maxY - minY, 1. });
+	m_cellSize = extent / (m_size - 4);
+	m_originX = (minX + maxX) * 0.5 - m_cellSize * m_size * 0.5;
+	m_originY = (minY + maxY) * 0.5 - m_cellSize * m_size * 0.5;
+
+	if (_deterministic)
+	{
+		// Sort the particles by the bottom row of their stencil (counting sort, so in index order within a row), then
+		// each thread fills a block of rows from the particles whose stencils touch it. A cell always gets the
+		// particles from the row below first and then its own row, however the rows are split up.
+		const size_t count = _particles.size();
+		m_rowStart.assign(m_size + 1, 0);
+		ArenaVector<int> rows(count, Arena::GetThreadArena());
+		for (size_t i = 0; i < count; ++i)
+		{
+			int x;
+			double tx, ty;
+			GetCell(_particles[i].GetPos(), x, rows[i], tx, ty);
+			++m_rowStart[rows[i] + 1];
+		}
+		for (int row = 0; row < m_size; ++row)
+			m_rowStart[row + 1] += m_rowStart[row];
+		m_rowParticles.resize(count);
+		{
+			ArenaVector<size_t> next(m_rowStart.begin(), m_rowStart.end() - 1, Arena::GetThreadArena());
+			for (size_t i = 0; i < count; ++i)
+				m_rowParticles[next[rows[i]]++] = i;
+		}
+
+		m_density.assign(m_size * m_size, 0.);
+		m_threadPool.ParallelFor(m_size, [&](size_t begin, size_t end)
+			{
+				for (size_t n = m_rowStart[begin > 0 ? begin - 1 : 0]; n < m_rowStart[end]; ++n)
+				{
+					const size_t i = m_rowParticles[n];
+					int x, y;
+					double tx, ty;
+					GetCell(_particles[i].GetPos(), x, y, tx, ty);
+					const double mass = _particles[i].GetMass();
+					double* cell = &m_density[y * m_size + x];
+					if (static_cast<size_t>(y) >= begin)
+					{
+						cell[0] += mass * (1. - tx) * (1. - ty);
+						cell[1] += mass * tx * (1. - ty);
+					}
+					if (static_cast<size_t>(y + 1) < end)
+					{
+						cell[m_size] += mass * (1. - tx) * ty;
+						cell[m_size + 1] += mass * tx * ty;
+					}
+				}
+			});
+		return;
+	}
+
+	// Each thread deposits into its own mesh, then the meshes are summed a block of rows at a time
+	const size_t numThreads = m_threadPool.GetNumWorkers() + 1;
+	m_threadDensity.resize(numThreads);
+	m_threadPool.ParallelFor(numThreads, [&](size_t first, size_t last)
+		{
+			for (size_t t = first; t < last; ++t)
+			{
+				auto& density = m_threadDensity[t];
+				density.assign(m_size * m_size, 0.);
+				const size_t begin = _particles.size() * t / numThreads;
+				const size_t end = _particles.size() * (t + 1) / numThreads;
+				for (size_t i = begin; i < end; ++i)
+				{
+					int x, y;
+					double tx, ty;
+					GetCell(_particles[i].GetPos(), x, y, tx, ty);
+					const double mass = _particles[i].GetMass();
+					double* cell = &density[y * m_size + x];
+					cell[0] += mass * (1. - tx) * (1. - ty);
+					cell[1] += mass * tx * (1. - ty);
+					cell[m_size] += mass * (1. - tx) * ty;
+					cell[m_size + 1] += mass * tx * ty;
+				}
+			}
+		}, 1);
+
+	m_density.resize(m_size * m_size);
+	m_threadPool.ParallelFor(m_size, [&](size_t begin, size_t end)
+		{
+			for (size_t i = begin * m_size; i < end * m_size; ++i)
+			{
+				double total = 0.;
+				for (auto const& density : m_threadDensity)
+					total += density[i];
+				m_density[i] = total;
+			}
+		});
+}
@@ -0,0 +1,279 @@
+#include "ParticleRenderer.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include <emmintrin.h>
+
+#include "ARGCore/ARGMath.h"
+
+using namespace std;
+
+namespace
+{
+	// Unit circle points for each number of segments, so rings don't need a sin and cos per vertex
+	struct UnitCircles
+	{
+		vector<float> cosines[33];
+		vector<float> sines[33];
+
+		UnitCircles()
+		{
+			for (int n = 1; n <= 32; ++n)
+			{
+				for (int i = 0; i < n; ++i)
+				{
+					const double angle = ARGMath::twoPI * i / n;
+					cosines[n].push_back((float)cos(angle));
+					sines[n].push_back((float)sin(angle));
+				}
+			}
+		}
+	};
+
+	UnitCircles const& GetUnitCircles()
+	{
+		static const UnitCircles unitCircles;
+		return unitCircles;
+	}
+
+	const float markerRadius = 10.f;
+}
+
+void ParticleRenderer::Begin(VectorType const& _scale, VectorType const& _offset, int _w, int _h, float _sizeLogBase, float _edgeThickness, DiscAtlas const* _discAtlas, bool _lockPixels)
+{
+	m_scale = _scale;
+	m_offset = _offset;
+	m_w = _w;
+	m_h = _h;
+	m_sizeScale = 2.5f / log(_sizeLogBase) * (float)_scale.x;	// Particle::GetSize in pixels
+	m_edgeThickness = _edgeThickness;
+	m_discAtlas = _discAtlas;
+	m_lockPixels = _lockPixels;
+	m_numBatches = 0;
+	m_addStarts.clear();
+}
+
+void ParticleRenderer::AddToBatch(Batch& _batch, Item const& _item) const
+{
+	const float size = log(_item.mass) * m_sizeScale;
+	const float x = (float)(_item.pos.x * m_scale.x + m_offset.x);
+	const float y = (float)(_item.pos.y * m_scale.y + m_offset.y);
+
+	// Same classes as al_draw_circle/al_draw_pixel used to be picked by, culled by what actually gets drawn
+	const float radius = size > m_w / 2 ? markerRadius : size > 0.5f ? size : 0.5f;
+	const float extent = radius + m_edgeThickness * 0.5f;
+	if (x + extent < 0.f || x - extent > m_w || y + extent < 0.f || y - extent > m_h)
+		return;
+
+	if (size > m_w / 2)
+	{
+		_batch.markers.push_back({ x, y, _item.colour });
+	}
+	else if (size > 0.5f && m_discAtlas && size <= DiscAtlas::maxRadius)
+	{
+		DiscAtlas::Cell const& cell = m_discAtlas->GetCell(size);
+		const float h = cell.halfSize;
+		const ALLEGRO_VERTEX corners[4] =
+		{
+			{ x - h, y - h, 0.f, cell.u - h, cell.v - h, _item.colour },
+			{ x + h, y - h, 0.f, cell.u + h, cell.v - h, _item.colour },
+			{ x + h, y + h, 0.f, cell.u + h, cell.v + h, _item.colour },
+			{ x - h, y + h, 0.f, cell.u - h, cell.v + h, _item.colour }
+		};
+		_batch.sprites.insert(_batch.sprites.end(), { corners[0], corners[1], corners[2], corners[0], corners[2], corners[3] });
+	}
+	else if (size > 0.5f)
+	{
+		// Roughly as many segments as Allegro would use
+		const int numSegments = clamp((int)(10.f * sqrt(size)), minSegments, maxSegments);
+		const float inner = size - m_edgeThickness * 0.5f, outer = size + m_edgeThickness * 0.5f;
+		auto const& circles = GetUnitCircles();
+		float const* cosines = circles.cosines[numSegments].data();
+		float const* sines = circles.sines[numSegments].data();
+
+		const int base = (int)_batch.rings.size();
+		for (int i = 0; i < numSegments; ++i)
+		{
+			_batch.rings.push_back({ x + cosines[i] * inner, y + sines[i] * inner, 0.f, 0.f, 0.f, _item.colour });
+			_batch.rings.push_back({ x + cosines[i] * outer, y + sines[i] * outer, 0.f, 0.f, 0.f, _item.colour });
+		}
+		for (int i = 0; i < numSegments; ++i)
+		{
+			const int i0 = base + i * 2, i1 = base + ((i + 1) % numSegments) * 2;
+			_batch.ringIndices.insert(_batch.ringIndices.end(), { i0, i0 + 1, i1 + 1, i0, i1 + 1, i1 });
+		}
+		++_batch.numRings;
+	}
+	else if (m_lockPixels)
+	{
+		const float px = floor(x), py = floor(y);
+		if (px < 0.f || py < 0.f || px >= m_w || py >= m_h)
+			return;
+		ALLEGRO_COLOR const& c = _item.colour;
+		const uint32_t argb = ((uint32_t)(c.a * 255.f + 0.5f) << 24) | ((uint32_t)(c.r * 255.f + 0.5f) << 16) | ((uint32_t)(c.g * 255.f + 0.5f) << 8) | (uint32_t)(c.b * 255.f + 0.5f);
+		_batch.pixels.push_back({ (uint16_t)px, (uint16_t)py, argb });
+	}
+	else
+	{
+		// Centre of the pixel al_draw_pixel((int)x, (int)y) would have filled
+		_batch.points.push_back({ floor(x) + 0.5f, floor(y) + 0.5f, 0.f, 0.f, 0.f, _item.colour });
+	}
+}
+
+void ParticleRenderer::Draw(ThreadPool& _threadPool)
+{
+	Combine(_threadPool);
+
+	m_numVisible = 0;
+	m_numDrawCalls = 0;
+	for (size_t a = 0; a < m_addStarts.size(); ++a)
+	{
+		const size_t firstBatch = m_addStarts[a];
+		const size_t endBatch = a + 1 < m_addStarts.size() ? m_addStarts[a + 1] : m_numBatches;
+		Offsets const& begin = m_offsets[firstBatch];
+		Offsets const& end = m_offsets[endBatch];
+		if (end.sprites > begin.sprites)
+		{
+			al_draw_prim(m_sprites.data(), nullptr, m_discAtlas->GetBitmap(), (int)begin.sprites, (int)end.sprites, ALLEGRO_PRIM_TRIANGLE_LIST);
+			++m_numDrawCalls;
+		}
+		if (end.ringIndices > begin.ringIndices)
+		{
+			al_draw_indexed_prim(m_rings.data(), nullptr, nullptr, m_ringIndices.data() + begin.ringIndices, (int)(end.ringIndices - begin.ringIndices), ALLEGRO_PRIM_TRIANGLE_LIST);
+			++m_numDrawCalls;
+		}
+		if (end.points > begin.points)
+		{
+			al_draw_prim(m_points.data(), nullptr, nullptr, (int)begin.points, (int)end.points, ALLEGRO_PRIM_POINT_LIST);
+			++m_numDrawCalls;
+		}
+
+		for (size_t b = firstBatch; b < endBatch; ++b)
+		{
+			Batch const& batch = m_batches[b];
+			m_numVisible += batch.points.size() + batch.numRings + batch.sprites.size() / 6 + batch.pixels.size() + batch.markers.size();
+
+			// There are only ever a few of these
+			for (auto const& marker : batch.markers)
+			{
+				const float x = marker.x, y = marker.y;
+				al_draw_circle(x, y, markerRadius, marker.colour, m_edgeThickness);
+				al_draw_line((int)(x - 10), (int)y, (int)(x + 10), y, marker.colour, 1.f);
+				al_draw_line(x, (int)(y - 7.5f), x, (int)(y + 7.5f), marker.colour, 1.f);
+				m_numDrawCalls += 3;
+			}
+		}
+	}
+	if (m_lockPixels)
+		DrawPixels(_threadPool);
+}
+
+void ParticleRenderer::Combine(ThreadPool& _threadPool)
+{
+	// Batches are in the order they were added, so each Add's vertices come out as one run in each array
+	m_offsets.resize(m_numBatches + 1);
+	Offsets total;
+	for (size_t b = 0; b < m_numBatches; ++b)
+	{
+		m_offsets[b] = total;
+		Batch const& batch = m_batches[b];
+		total.sprites += batch.sprites.size();
+		total.rings += batch.rings.size();
+		total.ringIndices += batch.ringIndices.size();
+		total.points += batch.points.size();
+	}
+	m_offsets[m_numBatches] = total;
+
+	m_sprites.resize(total.sprites);
+	m_rings.resize(total.rings);
+	m_ringIndices.resize(total.ringIndices);
+	m_points.resize(total.points);
+	_threadPool.ParallelFor(m_numBatches, [&](size_t begin, size_t end)
+		{
+			for (size_t b = begin; b < end; ++b)
+			{
+				Batch const& batch = m_batches[b];
+				Offsets const& offsets = m_offsets[b];
+				copy(batch.sprites.begin(), batch.sprites.end(), m_sprites.begin() + offsets.sprites);
+				copy(batch.rings.begin(), batch.rings.end(), m_rings.begin() + offsets.rings);
+				copy(batch.points.begin(), batch.points.end(), m_points.begin() + offsets.points);
+				const int base = (int)offsets.rings;
+				int* indices = m_ringIndices.data() + offsets.ringIndices;
+				for (size_t i = 0; i < batch.ringIndices.size(); ++i)
+					indices[i] = batch.ringIndices[i] + base;
+			}
+		}, 1);
+}
+
+void ParticleRenderer::DrawPixels(ThreadPool& _threadPool)
+{
+	// A counting sort by strip. Each batch counts its pixels in each strip, then the counts become offsets, strip by
+	// strip and then batch by batch within each strip, so the batches can copy their pixels into place in parallel.
+	const size_t numStrips = (m_h + stripHeight - 1) / stripHeight;
+	m_stripOffsets.assign(m_numBatches * numStrips, 0);
+	_threadPool.ParallelFor(m_numBatches, [&](size_t begin, size_t end)
+		{
+			for (size_t b = begin; b < end; ++b)
+			{
+				size_t* counts = &m_stripOffsets[b * numStrips];
+				for (auto const& pixel : m_batches[b].pixels)
+					++counts[pixel.y / stripHeight];
+			}
+		}, 1);
+
+	m_stripStarts.resize(numStrips + 1);
+	size_t total = 0;
+	for (size_t s = 0; s < numStrips; ++s)
+	{
+		m_stripStarts[s] = total;
+		for (size_t b = 0; b < m_numBatches; ++b)
+		{
+			const size_t count = m_stripOffsets[b * numStrips + s];
+			m_stripOffsets[b * numStrips + s] = total;
+			total += count;
+		}
+	}
+	m_stripStarts[numStrips] = total;
+	if (total == 0)
+		return;
+
+	m_stripPixels.resize(total);
+	_threadPool.ParallelFor(m_numBatches, [&](size_t begin, size_t end)
+		{
+			for (size_t b = begin; b < end; ++b)
+			{
+				size_t* offsets = &m_stripOffsets[b * numStrips];
+				for (auto const& pixel : m_batches[b].pixels)
+					m_stripPixels[offsets[pixel.y / stripHeight]++] = pixel;
+			}
+		}, 1);
+
+	// Only the rows with something in them are locked
+	size_t firstStrip = 0, lastStrip = numStrips - 1;
+	while (m_stripStarts[firstStrip + 1] == 0)
+		++firstStrip;
+	while (m_stripStarts[lastStrip] == total)
+		--lastStrip;
+	const int top = (int)firstStrip * stripHeight;
+	const int bottom = min(m_h, (int)(lastStrip + 1) * stripHeight);
+
+	ALLEGRO_BITMAP* target = al_get_target_bitmap();
+	ALLEGRO_LOCKED_REGION* region = al_lock_bitmap_region(target, 0, top, m_w, bottom - top, ALLEGRO_PIXEL_FORMAT_ARGB_8888, ALLEGRO_LOCK_READWRITE);
+	if (!region)
+		return;
+	_threadPool.ParallelFor(lastStrip + 1 - firstStrip, [&](size_t begin, size_t end)
+		{
+			for (size_t s = firstStrip + begin; s < firstStrip + end; ++s)
+			{
+				for (size_t i = m_stripStarts[s]; i < m_stripStarts[s + 1]; ++i)
+				{
+					Pixel const& pixel = m_stripPixels[i];
+					uint32_t* dest = reinterpret_cast<uint32_t*>(static_cast<char*>(region->data) + (ptrdiff_t)(pixel.y - top) * region->pitch) + pixel.x;
+					*dest = (uint32_t)_mm_cvtsi128_si32(_mm_adds_epu8(_mm_cvtsi32_si128((int)*dest), _mm_cvtsi32_si128((int)pixel.argb)));
+				}
+			}
+		}, 1);
+	al_unlock_bitmap(target);
+	++m_numDrawCalls;
+}
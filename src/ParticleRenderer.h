@@ -0,0 +1,148 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "ARGCore/ThreadPool.h"
+
+#include "DiscAtlas.h"
+#include "Particle.h"
+
+#include <allegro5/allegro.h>
+#include <allegro5/allegro_primitives.h>
+
+// Draws lots of particles with a few al_draw_prim calls rather than one call each. The particles are split into
+// batches which are culled, sorted into size classes and turned into vertices in parallel. The batches' vertices are
+// then copied end to end into one array for each size class, again in parallel, with the offsets from a prefix sum
+// over the batches, so each Add is drawn with one call per size class however many particles it had.
+//
+// Circles are quads cut out of a DiscAtlas if there is one and they're small enough, otherwise rings of triangles the
+// same as al_draw_circle with a thickness.
+//
+// Single pixels are either a point list in each batch or, with locked pixels, added straight into the target after
+// everything else. Zoomed out that's nearly every particle, so it's worth locking the screen once for them all. They
+// are sorted into strips of rows first, and then the strips are done in parallel, so no two threads ever write to the
+// same pixel. They're added with saturation, so crowded areas glow rather than the last particle drawn winning.
+class ParticleRenderer
+{
+public:
+	struct Item
+	{
+		VectorType pos;
+		float mass;
+		ALLEGRO_COLOR colour;
+	};
+
+	// Screen position is world position * _scale + _offset for each axis, sizes use _scale.x. _discAtlas can be null,
+	// and has to stay as it is until after Draw. _w and _h are the size of the target.
+	void Begin(VectorType const& _scale, VectorType const& _offset, int _w, int _h, float _sizeLogBase, float _edgeThickness, DiscAtlas const* _discAtlas, bool _lockPixels);
+
+	// _get(i) returns the Item for each i in [0, _count). It's called from several threads at once.
+	template<typename GetItem>
+	void Add(size_t _count, GetItem&& _get, ThreadPool& _threadPool);
+
+	// Everything added since Begin. Each Add is drawn after the one before, and within each Add it's sprites, then
+	// rings, then points, then markers. Locked pixels go on top of everything.
+	void Draw(ThreadPool& _threadPool);
+
+	size_t GetNumVisible() const { return m_numVisible; }
+	size_t GetNumDrawCalls() const { return m_numDrawCalls; }
+
+private:
+	static constexpr size_t batchSize = 1024;
+	static constexpr int minSegments = 8;
+	static constexpr int maxSegments = 32;
+	static constexpr int stripHeight = 32;
+
+	struct Marker
+	{
+		float x, y;
+		ALLEGRO_COLOR colour;
+	};
+
+	struct Pixel
+	{
+		uint16_t x, y;
+		uint32_t argb;
+	};
+
+	struct Batch
+	{
+		std::vector<ALLEGRO_VERTEX> points;
+		std::vector<ALLEGRO_VERTEX> rings;		// inner and outer vertex for each segment
+		std::vector<int> ringIndices;
+		size_t numRings = 0;
+		std::vector<ALLEGRO_VERTEX> sprites;	// two triangles for each circle from the atlas
+		std::vector<Pixel> pixels;				// instead of points, with locked pixels
+		std::vector<Marker> markers;			// bigger than half the screen, drawn as a cross hair
+	};
+
+	// Where each batch's vertices start in the combined arrays
+	struct Offsets
+	{
+		size_t sprites = 0;
+		size_t rings = 0;
+		size_t ringIndices = 0;
+		size_t points = 0;
+	};
+
+	void AddToBatch(Batch& _batch, Item const& _item) const;
+	void Combine(ThreadPool& _threadPool);
+	void DrawPixels(ThreadPool& _threadPool);
+
+	VectorType m_scale;
+	VectorType m_offset;
+	int m_w = 0, m_h = 0;
+	float m_sizeScale = 0.f;		// multiplies ln(mass) to give the size in pixels
+	float m_edgeThickness = 1.f;
+	DiscAtlas const* m_discAtlas = nullptr;
+	bool m_lockPixels = false;
+
+	std::vector<Batch> m_batches;	// kept between frames so their memory is reused
+	size_t m_numBatches = 0;
+	std::vector<size_t> m_addStarts;	// first batch of each Add
+
+	// All the batches' vertices, one after another, and the indices adjusted to match
+	std::vector<Offsets> m_offsets;		// for each batch, then the totals
+	std::vector<ALLEGRO_VERTEX> m_sprites;
+	std::vector<ALLEGRO_VERTEX> m_rings;
+	std::vector<int> m_ringIndices;
+	std::vector<ALLEGRO_VERTEX> m_points;
+
+	// For sorting locked pixels into strips: where each batch's pixels go in each strip, where each strip starts, and
+	// all the pixels strip by strip
+	std::vector<size_t> m_stripOffsets;
+	std::vector<size_t> m_stripStarts;
+	std::vector<Pixel> m_stripPixels;
+	size_t m_numVisible = 0;
+	size_t m_numDrawCalls = 0;
+};
+
+template<typename GetItem>
+void ParticleRenderer::Add(size_t _count, GetItem&& _get, ThreadPool& _threadPool)
+{
+	const size_t first = m_numBatches;
+	m_addStarts.push_back(first);
+	m_numBatches += (_count + batchSize - 1) / batchSize;
+	if (m_batches.size() < m_numBatches)
+		m_batches.resize(m_numBatches);
+
+	_threadPool.ParallelFor(m_numBatches - first, [&](size_t begin, size_t end)
+		{
+			for (size_t b = begin; b < end; ++b)
+			{
+				Batch& batch = m_batches[first + b];
+				batch.points.clear();
+				batch.rings.clear();
+				batch.ringIndices.clear();
+				batch.markers.clear();
+				batch.numRings = 0;
+				batch.sprites.clear();
+				batch.pixels.clear();
+				const size_t itemsEnd = std::min((b + 1) * batchSize, _count);
+				for (size_t i = b * batchSize; i < itemsEnd; ++i)
+					AddToBatch(batch, _get(i));
+			}
+		}, 1);
+}
@@ -0,0 +1,23 @@
+#include "RecordingFormat.h"
+
+#include <cstring>
+
+namespace
+{
+	const char magic[8] = { 'P', 'U', 'R', 'E', 'C', 'O', 'R', 'D' };
+}
+
+void RecordingFormat::WriteHeader(std::ostream& _file)
+{
+	_file.write(magic, sizeof(magic));
+	_file.write(reinterpret_cast<char const*>(&version), sizeof(version));
+}
+
+bool RecordingFormat::ReadHeader(std::istream& _file)
+{
+	char fileMagic[sizeof(magic)];
+	uint32_t fileVersion;
+	if (!_file.read(fileMagic, sizeof(fileMagic)) || !_file.read(reinterpret_cast<char*>(&fileVersion), sizeof(fileVersion)))
+		return false;
+	return memcmp(fileMagic, magic, sizeof(magic)) == 0 && fileVersion == version;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <ostream>
+
+#include "Particle.h"
+
+// The layout of a recording, written by Universe::WriteRecording and read back by Universe's playback and by
+// RecordingRenderer. The file starts with a header, so a recording from a build with a different layout is turned
+// away rather than read as garbage. Then for each frame there's a particle count, then for each particle its mass,
+// position, velocity, colour and ID.
+class RecordingFormat
+{
+public:
+	// Goes up whenever what's written changes
+	static constexpr uint32_t version = 2;
+
+	static constexpr size_t headerBytes = 8 + sizeof(uint32_t);
+	static constexpr size_t particleBytes = sizeof(float) + 4 * sizeof(double) + 3 * sizeof(float) + sizeof(ParticleId);
+
+	static void WriteHeader(std::ostream& _file);
+
+	// False if the file doesn't start with this version's header, in which case nothing after it should be read
+	static bool ReadHeader(std::istream& _file);
+};
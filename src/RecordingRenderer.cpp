@@ -0,0 +1,146 @@
+#include "RecordingRenderer.h"
+
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+
+#include "ARGCore/ARGUtils.h"
+#include "ARGCore/ThreadPool.h"
+#include "ARGCore/TimingManager.h"
+
+#include "RecordingFormat.h"
+
+using namespace std;
+
+namespace
+{
+	const size_t particleBytes = RecordingFormat::particleBytes;
+}
+
+size_t RecordingRenderer::Render(string const& _recordingFilename, string const& _directory, Options const& _options)
+{
+	if (_options.w <= 0 || _options.h <= 0 || !(_options.viewportWidthStart > 0.) || !(_options.viewportWidthEnd > 0.))
+	{
+		argDebugf("Can't render %d x %d frames with viewport widths %g to %g", _options.w, _options.h, _options.viewportWidthStart, _options.viewportWidthEnd);
+		return 0;
+	}
+	if (!Index(_recordingFilename))
+	{
+		argDebugf("Couldn't read %s", _recordingFilename.c_str());
+		return 0;
+	}
+	filesystem::create_directories(_directory);
+
+	// A worker for each hardware thread but this one, which helps
+	ThreadPool threadPool;
+	m_threadStates.resize(threadPool.GetNumWorkers() + 1);
+	for (auto& state : m_threadStates)
+	{
+		if (!state)
+			state = make_unique<ThreadState>();
+		state->file.close();
+		state->file.clear();
+		state->file.open(_recordingFilename, ios::binary);
+	}
+
+	const double start = TimingManager::GetTime();
+	atomic<size_t> numWritten = 0;
+	threadPool.ParallelFor(m_frameOffsets.size(), [&](size_t begin, size_t end)
+		{
+			// There's never more than one run going on each thread, so there's always a free state
+			ThreadState* state = nullptr;
+			for (auto& candidate : m_threadStates)
+			{
+				if (!candidate->inUse.exchange(true))
+				{
+					state = candidate.get();
+					break;
+				}
+			}
+
+			for (size_t f = begin; f < end; ++f)
+				if (RenderFrame(*state, f, _directory, _options))
+					++numWritten;
+			state->inUse = false;
+		}, framesPerRun);
+
+	const double seconds = TimingManager::GetTime() - start;
+	argDebugf("Rendered %d of %d frames to %s in %.1f s (%.1f frames/s)", (int)numWritten.load(), (int)m_frameOffsets.size(), _directory.c_str(), seconds, numWritten / max(seconds, 1e-6));
+	return numWritten;
+}
+
+bool RecordingRenderer::Index(string const& _recordingFilename)
+{
+	m_frameOffsets.clear();
+	ifstream file(_recordingFilename, ios::binary);
+	if (!file.is_open())
+		return false;
+	if (!RecordingFormat::ReadHeader(file))
+	{
+		argDebugf("%s isn't a version %d recording", _recordingFilename.c_str(), (int)RecordingFormat::version);
+		return false;
+	}
+
+	// Only the counts are read, skipping over the particles. A frame cut short at the end, from a recording which
+	// didn't finish, is left out.
+	file.seekg(0, ios::end);
+	const streamoff size = file.tellg();
+	streamoff offset = RecordingFormat::headerBytes;
+	while (offset + (streamoff)sizeof(size_t) <= size)
+	{
+		size_t count;
+		file.seekg(offset);
+		if (!file.read(reinterpret_cast<char*>(&count), sizeof(count)))
+			break;
+		const streamoff next = offset + (streamoff)(sizeof(size_t) + count * particleBytes);
+		if (next > size)
+			break;
+		m_frameOffsets.push_back(offset);
+		offset = next;
+	}
+	return !m_frameOffsets.empty();
+}
+
+bool RecordingRenderer::RenderFrame(ThreadState& _state, size_t _frame, string const& _directory, Options const& _options)
+{
+	size_t count;
+	_state.file.seekg(m_frameOffsets[_frame]);
+	if (!_state.file.read(reinterpret_cast<char*>(&count), sizeof(count)))
+		return false;
+	_state.buffer.resize(count * particleBytes);
+	if (!_state.file.read(_state.buffer.data(), _state.buffer.size()))
+		return false;
+
+	// Same transform as Universe::WorldToScreen with the frame's camera
+	const double t = m_frameOffsets.size() > 1 ? (double)_frame / (m_frameOffsets.size() - 1) : 0.;
+	const VectorType camera = _options.cameraStart + (_options.cameraEnd - _options.cameraStart) * t;
+	const double viewportWidth = _options.viewportWidthStart * pow(_options.viewportWidthEnd / _options.viewportWidthStart, t);
+	const double scale = _options.w / viewportWidth;
+
+	SoftwareRenderer::Frame& frame = _state.frame;
+	frame.w = _options.w;
+	frame.h = _options.h;
+	frame.scale = VectorType(scale, scale);
+	frame.offset = VectorType(_options.w / 2. - camera.x * scale, _options.h / 2. - camera.y * scale);
+	frame.sizeLogBase = _options.sizeLogBase;
+	frame.edgeThickness = _options.edgeThickness;
+
+	// Colours straight from the file, without going through ColourPalette, which belongs to the simulation
+	frame.items.resize(count);
+	for (size_t i = 0; i < count; ++i)
+	{
+		char const* data = &_state.buffer[i * particleBytes];
+		float mass, colour[3];
+		double pos[2];
+		memcpy(&mass, data, sizeof(mass));
+		memcpy(pos, data + sizeof(float), sizeof(pos));
+		memcpy(colour, data + sizeof(float) + 4 * sizeof(double), sizeof(colour));
+		uint32_t argb = 0xff000000;
+		for (int c = 0; c < 3; ++c)
+			argb |= (uint32_t)(clamp(colour[c], 0.f, 1.f) * 255.f + 0.5f) << (16 - c * 8);
+		frame.items[i] = { VectorType(pos[0], pos[1]), mass, argb };
+	}
+
+	_state.renderer.Render(frame, _state.image, nullptr);
+	return _state.pngWriter.Write(stringFormat("%s/frame_%06d.png", _directory.c_str(), (int)_frame), _state.image.data(), frame.w, frame.h);
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <atomic>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "ARGCore/PngWriter.h"
+
+#include "Particle.h"
+#include "SoftwareRenderer.h"
+
+// Renders a recording (see Universe::WriteRecording) straight to numbered PNGs, as fast as the machine can go rather
+// than playing it back in real time and capturing the screen. The file is indexed first so any frame can be found
+// without reading the ones before it, then the frames are handed out to the threads a run at a time. Each thread
+// reads its frames through its own handle on the file and draws and writes them one after another, with no sharing
+// between threads at all, so it scales with the number of cores until decoding or the disk can't keep up.
+//
+// There are no trails, as those would need every frame before.
+class RecordingRenderer
+{
+public:
+	struct Options
+	{
+		int w = 1920, h = 1080;
+
+		// The camera moves in a straight line from start to end over the recording, zooming at a steady rate
+		VectorType cameraStart = VectorType(400., 300.);
+		VectorType cameraEnd = VectorType(400., 300.);
+		double viewportWidthStart = 800.;
+		double viewportWidthEnd = 800.;
+
+		float sizeLogBase = 2.7f;
+		float edgeThickness = 1.5f;
+	};
+
+	// Returns the number of frames written, 0 if the recording couldn't be read
+	size_t Render(std::string const& _recordingFilename, std::string const& _directory, Options const& _options);
+
+private:
+	static constexpr size_t framesPerRun = 8;
+
+	// Everything one thread needs for a frame, kept for its next one
+	struct ThreadState
+	{
+		std::ifstream file;
+		std::vector<char> buffer;
+		SoftwareRenderer::Frame frame;
+		SoftwareRenderer renderer;
+		std::vector<uint32_t> image;
+		PngWriter pngWriter;
+		std::atomic<bool> inUse = false;
+	};
+
+	bool Index(std::string const& _recordingFilename);
+	bool RenderFrame(ThreadState& _state, size_t _frame, std::string const& _directory, Options const& _options);
+
+	std::vector<std::streamoff> m_frameOffsets;
+	std::vector<std::unique_ptr<ThreadState>> m_threadStates;
+};
@@ -0,0 +1,246 @@
+#include "SoftwareRenderer.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include <emmintrin.h>
+
+using namespace std;
+
+namespace
+{
+	const float markerRadius = 10.f;
+	const uint32_t black = 0xff000000;
+
+	// _a of the way from _dest to _src
+	inline uint32_t Blend(uint32_t _dest, uint32_t _src, float _a)
+	{
+		const int a = (int)(_a * 256.f);
+		uint32_t result = black;
+		for (int shift = 0; shift < 24; shift += 8)
+		{
+			const int d = (_dest >> shift) & 0xff, s = (_src >> shift) & 0xff;
+			result |= (uint32_t)(d + (((s - d) * a) >> 8)) << shift;
+		}
+		return result;
+	}
+}
+
+void SoftwareRenderer::Render(Frame const& _frame, vector<uint32_t>& _image, ThreadPool* _threadPool)
+{
+	auto parallelFor = [_threadPool](size_t _count, auto&& _fn)
+	{
+		if (_threadPool)
+			_threadPool->ParallelFor(_count, _fn, 1);
+		else
+			_fn(size_t(0), _count);
+	};
+
+	if (_frame.w <= 0 || _frame.h <= 0)
+	{
+		_image.clear();
+		return;
+	}
+	m_w = _frame.w;
+	m_h = _frame.h;
+	m_tilesX = (m_w + tileSize - 1) / tileSize;
+	m_tilesY = (m_h + tileSize - 1) / tileSize;
+	m_edgeThickness = _frame.edgeThickness;
+	_image.resize((size_t)m_w * m_h);
+
+	// Shapes for each chunk of items, counting how many go in each tile as we go
+	const size_t numTiles = (size_t)m_tilesX * m_tilesY;
+	m_numChunks = (_frame.items.size() + chunkSize - 1) / chunkSize;
+	if (m_chunks.size() < m_numChunks)
+		m_chunks.resize(m_numChunks);
+	m_tileOffsets.assign(m_numChunks * numTiles, 0);
+	const float sizeScale = 2.5f / log(_frame.sizeLogBase) * (float)_frame.scale.x;	// Particle::GetSize in pixels
+	parallelFor(m_numChunks, [&](size_t begin, size_t end)
+		{
+			for (size_t c = begin; c < end; ++c)
+			{
+				auto& shapes = m_chunks[c].shapes;
+				shapes.clear();
+				size_t* counts = &m_tileOffsets[c * numTiles];
+				const size_t itemsEnd = min((c + 1) * chunkSize, _frame.items.size());
+				for (size_t i = c * chunkSize; i < itemsEnd; ++i)
+				{
+					Item const& item = _frame.items[i];
+					const float size = log(item.mass) * sizeScale;
+					const float x = (float)(item.pos.x * _frame.scale.x + _frame.offset.x);
+					const float y = (float)(item.pos.y * _frame.scale.y + _frame.offset.y);
+
+					// Same classes and culling as ParticleRenderer::AddToBatch
+					const float radius = size > m_w / 2 ? markerRadius : size > 0.5f ? size : 0.5f;
+					const float extent = radius + m_edgeThickness * 0.5f;
+					if (x + extent < 0.f || x - extent > m_w || y + extent < 0.f || y - extent > m_h)
+						continue;
+
+					Shape shape = { x, y, radius, item.argb, size > m_w / 2 ? ShapeType::Marker : size > 0.5f ? ShapeType::Ring : ShapeType::Pixel };
+					if (shape.type == ShapeType::Pixel && (floor(x) < 0.f || floor(y) < 0.f || floor(x) >= m_w || floor(y) >= m_h))
+						continue;
+					shapes.push_back(shape);
+
+					int tx0, ty0, tx1, ty1;
+					GetTileRange(shape, tx0, ty0, tx1, ty1);
+					for (int ty = ty0; ty <= ty1; ++ty)
+						for (int tx = tx0; tx <= tx1; ++tx)
+							++counts[ty * m_tilesX + tx];
+				}
+			}
+		});
+
+	// Counts to offsets, tile by tile and then chunk by chunk within each tile, so each tile's list is in the order
+	// the items were added
+	m_tileStarts.resize(numTiles + 1);
+	size_t total = 0;
+	for (size_t t = 0; t < numTiles; ++t)
+	{
+		m_tileStarts[t] = total;
+		for (size_t c = 0; c < m_numChunks; ++c)
+		{
+			const size_t count = m_tileOffsets[c * numTiles + t];
+			m_tileOffsets[c * numTiles + t] = total;
+			total += count;
+		}
+	}
+	m_tileStarts[numTiles] = total;
+
+	m_tileShapes.resize(total);
+	parallelFor(m_numChunks, [&](size_t begin, size_t end)
+		{
+			for (size_t c = begin; c < end; ++c)
+			{
+				size_t* offsets = &m_tileOffsets[c * numTiles];
+				for (auto const& shape : m_chunks[c].shapes)
+				{
+					int tx0, ty0, tx1, ty1;
+					GetTileRange(shape, tx0, ty0, tx1, ty1);
+					for (int ty = ty0; ty <= ty1; ++ty)
+						for (int tx = tx0; tx <= tx1; ++tx)
+							m_tileShapes[offsets[ty * m_tilesX + tx]++] = &shape;
+				}
+			}
+		});
+
+	parallelFor(numTiles, [&](size_t begin, size_t end)
+		{
+			for (size_t t = begin; t < end; ++t)
+				DrawTile(_frame, (int)t, _image.data());
+		});
+}
+
+void SoftwareRenderer::GetTileRange(Shape const& _shape, int& _tx0, int& _ty0, int& _tx1, int& _ty1) const
+{
+	if (_shape.type == ShapeType::Pixel)
+	{
+		_tx0 = _tx1 = (int)_shape.x / tileSize;
+		_ty0 = _ty1 = (int)_shape.y / tileSize;
+		return;
+	}
+
+	// Another pixel all round for the anti-aliased edge
+	const float extent = _shape.radius + m_edgeThickness * 0.5f + 1.f;
+	_tx0 = clamp((int)floor((_shape.x - extent) / tileSize), 0, m_tilesX - 1);
+	_ty0 = clamp((int)floor((_shape.y - extent) / tileSize), 0, m_tilesY - 1);
+	_tx1 = clamp((int)floor((_shape.x + extent) / tileSize), 0, m_tilesX - 1);
+	_ty1 = clamp((int)floor((_shape.y + extent) / tileSize), 0, m_tilesY - 1);
+}
+
+void SoftwareRenderer::DrawTile(Frame const& _frame, int _tile, uint32_t* _image) const
+{
+	const int x0 = (_tile % m_tilesX) * tileSize, y0 = (_tile / m_tilesX) * tileSize;
+	const int x1 = min(x0 + tileSize, m_w), y1 = min(y0 + tileSize, m_h);
+	auto pixel = [&](int _x, int _y) -> uint32_t& { return _image[(size_t)_y * m_w + _x]; };
+
+	for (int y = y0; y < y1; ++y)
+		fill(&pixel(x0, y), &pixel(x0, y) + (x1 - x0), black);
+
+	// Filled pixels [_ax, _bx) x [_ay, _by), clipped to the tile
+	auto fillRect = [&](int _ax, int _ay, int _bx, int _by, uint32_t _argb)
+	{
+		for (int y = max(_ay, y0); y < min(_by, y1); ++y)
+			for (int x = max(_ax, x0); x < min(_bx, x1); ++x)
+				pixel(x, y) = _argb;
+	};
+
+	for (auto const& line : _frame.gridLines)
+	{
+		const int ax = (int)floor(min(line.x0, line.x1)), bx = (int)floor(max(line.x0, line.x1));
+		const int ay = (int)floor(min(line.y0, line.y1)), by = (int)floor(max(line.y0, line.y1));
+		fillRect(ax, ay, bx + 1, by + 1, _frame.gridColour);
+	}
+
+	// Rings and markers in order, then single pixels on top like ParticleRenderer's locked pixels
+	Shape const* const* shapes = &m_tileShapes[m_tileStarts[_tile]];
+	const size_t numShapes = m_tileStarts[_tile + 1] - m_tileStarts[_tile];
+	for (size_t i = 0; i < numShapes; ++i)
+	{
+		Shape const& shape = *shapes[i];
+		if (shape.type == ShapeType::Ring)
+		{
+			DrawRing(shape.x, shape.y, shape.radius, shape.argb, x0, y0, x1, y1, _image);
+		}
+		else if (shape.type == ShapeType::Marker)
+		{
+			DrawRing(shape.x, shape.y, markerRadius, shape.argb, x0, y0, x1, y1, _image);
+			const int x = (int)floor(shape.x), y = (int)floor(shape.y);
+			fillRect((int)(shape.x - 10), y, (int)(shape.x + 10), y + 1, shape.argb);
+			fillRect(x, (int)(shape.y - 7.5f), x + 1, (int)(shape.y + 7.5f), shape.argb);
+		}
+	}
+	for (size_t i = 0; i < numShapes; ++i)
+	{
+		Shape const& shape = *shapes[i];
+		if (shape.type == ShapeType::Pixel)
+		{
+			uint32_t& dest = pixel((int)shape.x, (int)shape.y);
+			dest = (uint32_t)_mm_cvtsi128_si32(_mm_adds_epu8(_mm_cvtsi32_si128((int)dest), _mm_cvtsi32_si128((int)shape.argb)));
+		}
+	}
+}
+
+void SoftwareRenderer::DrawRing(float _x, float _y, float _radius, uint32_t _argb, int _x0, int _y0, int _x1, int _y1, uint32_t* _image) const
+{
+	// Coverage falls off over a pixel at each edge, about what the disc atlas's anti-aliased rings look like. Each row
+	// only looks at the pixels between the inner and outer edges, so big rings cost their circumference, not their area.
+	const float halfThickness = m_edgeThickness * 0.5f;
+	const float outer = _radius + halfThickness + 0.5f, inner = _radius - halfThickness - 0.5f;
+	const int ay = max(_y0, (int)floor(_y - outer)), by = min(_y1, (int)ceil(_y + outer));
+	for (int y = ay; y < by; ++y)
+	{
+		const float dy = y + 0.5f - _y;
+		const float outerSq = outer * outer - dy * dy;
+		if (outerSq <= 0.f)
+			continue;
+		const float outerDx = sqrt(outerSq);
+		const float innerDx = inner > 0.f && inner * inner > dy * dy ? sqrt(inner * inner - dy * dy) : -1.f;
+		uint32_t* row = _image + (size_t)y * m_w;
+		auto span = [&](int _from, int _to)
+		{
+			for (int x = max(_x0, _from); x < min(_x1, _to); ++x)
+			{
+				const float dx = x + 0.5f - _x;
+				const float coverage = halfThickness + 0.5f - fabs(sqrt(dx * dx + dy * dy) - _radius);
+				if (coverage >= 1.f)
+					row[x] = _argb;
+				else if (coverage > 0.f)
+					row[x] = Blend(row[x], _argb, coverage);
+			}
+		};
+
+		// Left and right of the hole in the middle, or all the way across if this row misses it. Nothing's drawn twice,
+		// even where the hole is narrower than a pixel.
+		const int left = (int)floor(_x - outerDx - 0.5f), right = (int)ceil(_x + outerDx + 0.5f);
+		if (innerDx < 0.f)
+		{
+			span(left, right);
+		}
+		else
+		{
+			const int holeLeft = (int)ceil(_x - innerDx + 0.5f);
+			span(left, holeLeft);
+			span(max(holeLeft, (int)floor(_x + innerDx - 0.5f)), right);
+		}
+	}
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "ARGCore/ThreadPool.h"
+
+#include "Particle.h"
+
+// Draws particles, trail points and grid lines into an image in memory, without Allegro, so frames can be rendered
+// on any thread and with no display at all. Particles use the same size classes as ParticleRenderer: a ring for
+// anything bigger than half a pixel, a cross hair marker for anything bigger than half the screen, and otherwise a
+// single pixel, added with saturation so crowded areas glow.
+//
+// The image is split into tiles, and each tile is drawn by one thread from a list of the shapes which touch it, so no
+// two threads ever write to the same pixel. Shapes are made and sorted into the tiles' lists in parallel too, in
+// chunks, keeping the order they were added in.
+class SoftwareRenderer
+{
+public:
+	struct Item
+	{
+		VectorType pos;
+		float mass;
+		uint32_t argb;
+	};
+
+	// In screen space, and horizontal or vertical
+	struct Line
+	{
+		float x0, y0, x1, y1;
+	};
+
+	// Everything needed to draw a frame, copied out of the simulation so it can be drawn while the simulation moves on.
+	// Screen position is world position * scale + offset for each axis, sizes use scale.x.
+	struct Frame
+	{
+		int w = 0, h = 0;
+		VectorType scale;
+		VectorType offset;
+		float sizeLogBase = 2.7f;
+		float edgeThickness = 1.f;
+		std::vector<Line> gridLines;	// underneath everything else
+		uint32_t gridColour = 0;
+		std::vector<Item> items;		// drawn in order, apart from single pixels which go on top
+	};
+
+	// _image is resized to _frame.w * _frame.h ARGB pixels. With no _threadPool it's all done on the calling thread,
+	// for when there's already a frame being drawn on each thread.
+	void Render(Frame const& _frame, std::vector<uint32_t>& _image, ThreadPool* _threadPool);
+
+private:
+	static constexpr size_t chunkSize = 4096;
+	static constexpr int tileSize = 64;
+
+	enum class ShapeType : uint8_t
+	{
+		Pixel,
+		Ring,
+		Marker
+	};
+
+	struct Shape
+	{
+		float x, y, radius;
+		uint32_t argb;
+		ShapeType type;
+	};
+
+	struct Chunk
+	{
+		std::vector<Shape> shapes;
+	};
+
+	// Tiles touched by the shape, inclusive
+	void GetTileRange(Shape const& _shape, int& _tx0, int& _ty0, int& _tx1, int& _ty1) const;
+	void DrawTile(Frame const& _frame, int _tile, uint32_t* _image) const;
+	void DrawRing(float _x, float _y, float _radius, uint32_t _argb, int _x0, int _y0, int _x1, int _y1, uint32_t* _image) const;
+
+	int m_w = 0, m_h = 0;
+	int m_tilesX = 0, m_tilesY = 0;
+	float m_edgeThickness = 1.f;
+
+	std::vector<Chunk> m_chunks;	// kept between frames so their memory is reused
+	size_t m_numChunks = 0;
+
+	// For sorting shapes into tiles, the same way ParticleRenderer sorts pixels into strips: where each chunk's shapes
+	// go in each tile, where each tile starts, and all the shapes tile by tile
+	std::vector<size_t> m_tileOffsets;
+	std::vector<size_t> m_tileStarts;
+	std::vector<Shape const*> m_tileShapes;
+};
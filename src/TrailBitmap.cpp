@@ -0,0 +1,207 @@
+#include "TrailBitmap.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include <emmintrin.h>
+
+#include <allegro5/allegro.h>
+
+using namespace std;
+
+namespace
+{
+	// What a particle adds to its pixel each frame, so a particle which stays put is at full brightness in a few frames
+	// and a moving one leaves a dimmer trail
+	const uint16_t particleIntensity = 0x5000;
+}
+
+void TrailBitmap::SetView(int _w, int _h, VectorType const& _cameraPos, double _viewportWidth)
+{
+	// Same as Universe::WorldToScreen, the view has the screen's aspect ratio so both axes have the same scale
+	const double scale = _w / _viewportWidth;
+	m_viewOffset = VectorType(_w * 0.5 - _cameraPos.x * scale, _h * 0.5 - _cameraPos.y * scale);
+
+	if (_w != m_w || _h != m_h)
+	{
+		// Only happens at startup and if the display changes size, not worth keeping what was there
+		m_w = _w;
+		m_h = _h;
+		m_intensity.assign((size_t)m_w * m_h, 0);
+		m_reprojected.assign((size_t)m_w * m_h, 0);
+		m_bitmap = make_unique<BitmapWrapper>(m_w, m_h, false);
+		m_viewportWidth = _viewportWidth;
+		m_scale = scale;
+		m_offset = m_viewOffset;
+		return;
+	}
+
+	if (_viewportWidth != m_viewportWidth)
+	{
+		m_viewportWidth = _viewportWidth;
+		Reproject(scale, m_viewOffset);
+		return;
+	}
+
+	// Just the camera moving. Only whole pixels are shifted, the rest builds up until it's worth one.
+	const int dx = (int)floor(m_viewOffset.x - m_offset.x + 0.5);
+	const int dy = (int)floor(m_viewOffset.y - m_offset.y + 0.5);
+	if (dx != 0 || dy != 0)
+	{
+		Shift(dx, dy);
+		m_offset.x += dx;
+		m_offset.y += dy;
+	}
+}
+
+void TrailBitmap::Shift(int _dx, int _dy)
+{
+	if (abs(_dx) >= m_w || abs(_dy) >= m_h)
+	{
+		clear();
+		return;
+	}
+
+	// Each row is copied from the row _dy above, which is still where it was, as long as the rows are done from
+	// the far end when moving down
+	const size_t rowBytes = (size_t)(m_w - abs(_dx)) * sizeof(uint16_t);
+	const int destX = max(_dx, 0), sourceX = max(-_dx, 0);
+	auto shiftRow = [&](int y)
+	{
+		uint16_t* dest = &m_intensity[(size_t)y * m_w];
+		const int sourceY = y - _dy;
+		if (sourceY < 0 || sourceY >= m_h)
+		{
+			fill(dest, dest + m_w, 0);
+			return;
+		}
+		memmove(dest + destX, &m_intensity[(size_t)sourceY * m_w] + sourceX, rowBytes);
+		fill(dest, dest + destX, 0);
+		fill(dest + m_w - sourceX, dest + m_w, 0);
+	};
+	if (_dy > 0)
+	{
+		for (int y = m_h - 1; y >= 0; --y)
+			shiftRow(y);
+	}
+	else
+	{
+		for (int y = 0; y < m_h; ++y)
+			shiftRow(y);
+	}
+}
+
+void TrailBitmap::Reproject(double _scale, VectorType const& _offset)
+{
+	// Each new pixel takes the old pixel its centre lands in. The mapping is the same scale and an offset on both
+	// axes, so it's worked out once for each column and row.
+	const double oldScale = m_scale;
+	const VectorType oldOffset = m_offset;
+	m_scale = _scale;
+	m_offset = _offset;
+
+	const double scale = oldScale / m_scale;
+	vector<int> sourceX(m_w);
+	for (int x = 0; x < m_w; ++x)
+	{
+		const double oldX = (x + 0.5 - m_offset.x) * scale + oldOffset.x;
+		sourceX[x] = oldX >= 0. && oldX < m_w ? (int)oldX : -1;
+	}
+	for (int y = 0; y < m_h; ++y)
+	{
+		uint16_t* dest = &m_reprojected[(size_t)y * m_w];
+		const double oldY = (y + 0.5 - m_offset.y) * scale + oldOffset.y;
+		if (oldY < 0. || oldY >= m_h)
+		{
+			fill(dest, dest + m_w, 0);
+			continue;
+		}
+		uint16_t const* source = &m_intensity[(size_t)oldY * m_w];
+		for (int x = 0; x < m_w; ++x)
+			dest[x] = sourceX[x] >= 0 ? source[sourceX[x]] : 0;
+	}
+	m_intensity.swap(m_reprojected);
+}
+
+void TrailBitmap::Decay(double _elapsed, double _fadeTime)
+{
+	// Multiply by a 16 bit fraction and keep the high half, 8 pixels at a time. Rounding down means anything left
+	// over does get to 0 eventually.
+	const double factor = _fadeTime > 0. ? pow(1. / 256., _elapsed / _fadeTime) : 0.;
+	const uint16_t multiplier = (uint16_t)clamp(factor * 65536., 0., 65535.);
+	const __m128i multipliers = _mm_set1_epi16((short)multiplier);
+
+	uint16_t* data = m_intensity.data();
+	const size_t count = m_intensity.size();
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		__m128i pixels = _mm_loadu_si128(reinterpret_cast<__m128i const*>(data + i));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(data + i), _mm_mulhi_epu16(pixels, multipliers));
+	}
+	for (; i < count; ++i)
+		data[i] = (uint16_t)((data[i] * (uint32_t)multiplier) >> 16);
+}
+
+void TrailBitmap::Add(ParticleList const& _particles)
+{
+	for (size_t i = 0; i < _particles.size(); ++i)
+	{
+		const VectorType pos = _particles.GetPos(i);
+		const double x = pos.x * m_scale + m_offset.x;
+		const double y = pos.y * m_scale + m_offset.y;
+		if (x < 0. || y < 0. || x >= m_w || y >= m_h)
+			continue;
+		uint16_t& pixel = m_intensity[(size_t)y * m_w + (size_t)x];
+		pixel = (uint16_t)min<uint32_t>(pixel + particleIntensity, 0xffff);
+	}
+}
+
+void TrailBitmap::Draw()
+{
+	if (!m_bitmap)
+		return;
+	ALLEGRO_LOCKED_REGION* region = al_lock_bitmap(m_bitmap->get(), ALLEGRO_PIXEL_FORMAT_ARGB_8888, ALLEGRO_LOCK_WRITEONLY);
+	if (!region)
+		return;
+
+	// Grey at half the intensity with the intensity as alpha, premultiplied, so it's the same grey as the other trail
+	// modes where it's bright and fades to nothing. 16 pixels at a time: the top byte of each intensity, then the
+	// bytes interleaved into a, h, h, h.
+	const __m128i lowBits = _mm_set1_epi8(0x7f);
+	for (int y = 0; y < m_h; ++y)
+	{
+		uint16_t const* source = &m_intensity[(size_t)y * m_w];
+		uint32_t* dest = reinterpret_cast<uint32_t*>(static_cast<char*>(region->data) + (ptrdiff_t)y * region->pitch);
+		int x = 0;
+		for (; x + 16 <= m_w; x += 16)
+		{
+			const __m128i a0 = _mm_srli_epi16(_mm_loadu_si128(reinterpret_cast<__m128i const*>(source + x)), 8);
+			const __m128i a1 = _mm_srli_epi16(_mm_loadu_si128(reinterpret_cast<__m128i const*>(source + x + 8)), 8);
+			const __m128i a = _mm_packus_epi16(a0, a1);
+			const __m128i h = _mm_and_si128(_mm_srli_epi16(a, 1), lowBits);
+
+			const __m128i hh0 = _mm_unpacklo_epi8(h, h), hh1 = _mm_unpackhi_epi8(h, h);
+			const __m128i ha0 = _mm_unpacklo_epi8(h, a), ha1 = _mm_unpackhi_epi8(h, a);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dest + x), _mm_unpacklo_epi16(hh0, ha0));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dest + x + 4), _mm_unpackhi_epi16(hh0, ha0));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dest + x + 8), _mm_unpacklo_epi16(hh1, ha1));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dest + x + 12), _mm_unpackhi_epi16(hh1, ha1));
+		}
+		for (; x < m_w; ++x)
+		{
+			const uint32_t a = source[x] >> 8, h = a >> 1;
+			dest[x] = (a << 24) | (h << 16) | (h << 8) | h;
+		}
+	}
+	al_unlock_bitmap(m_bitmap->get());
+
+	// Where the image's pixels are on the screen, which is less than a pixel out
+	al_draw_bitmap(m_bitmap->get(), (float)(m_viewOffset.x - m_offset.x), (float)(m_viewOffset.y - m_offset.y), 0);
+}
+
+void TrailBitmap::clear()
+{
+	fill(m_intensity.begin(), m_intensity.end(), 0);
+}
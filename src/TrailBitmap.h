@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "ARGCore/Sprites.h"
+
+#include "ParticleList.h"
+
+// Trails as a screen sized image which particles are drawn into every frame and which fades a little every frame,
+// so the memory doesn't depend on how many particles there are or how long the trails are.
+//
+// The image is kept as 16 bit intensities on the CPU and copied into a bitmap to be drawn, both with SSE2, so it
+// doesn't need anything from the GPU beyond drawing one bitmap. The image keeps its own transform rather than always
+// matching the view. When the camera moves, what's there is shifted by whole pixels and anything less than a pixel is
+// carried over to later frames, with the bitmap drawn that fraction of a pixel out, so slow pans still move it and
+// nothing is lost to rounding. Only a zoom resamples the image, with nearest neighbour sampling, so trails from before
+// a zoom in get blocky until they fade.
+class TrailBitmap
+{
+public:
+	// Matches the image to the screen and view, moving what's there if the view has changed
+	void SetView(int _w, int _h, VectorType const& _cameraPos, double _viewportWidth);
+
+	// Fades to 1/256 of the brightness over _fadeTime seconds
+	void Decay(double _elapsed, double _fadeTime);
+
+	void Add(ParticleList const& _particles);
+
+	// Onto the current target, at the top left give or take the part of a pixel the view hasn't been shifted by yet
+	void Draw();
+
+	void clear();
+
+	size_t GetBytes() const { return m_intensity.size() * sizeof(uint16_t) * 2 + m_w * m_h * sizeof(uint32_t); }
+	int w() const { return m_w; }
+	int h() const { return m_h; }
+
+private:
+	// Moves what's there by whole pixels, positive to the right and down
+	void Shift(int _dx, int _dy);
+	// Resamples what's there for a new scale and offset
+	void Reproject(double _scale, VectorType const& _offset);
+
+	int m_w = 0, m_h = 0;
+	double m_viewportWidth = 0.;
+
+	// Image position is world position * m_scale + m_offset. m_scale is always the view's, m_offset is within half a
+	// pixel of the view's offset m_viewOffset on each axis.
+	double m_scale = 0.;
+	VectorType m_offset;
+	VectorType m_viewOffset;
+
+	std::vector<uint16_t> m_intensity;
+	std::vector<uint16_t> m_reprojected;	// m_intensity is moved into here and swapped when the view changes
+	std::unique_ptr<BitmapWrapper> m_bitmap;
+};
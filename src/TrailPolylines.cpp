@@ -0,0 +1,129 @@
+#include "TrailPolylines.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "ARGCore/ARGMath.h"
+
+using namespace std;
+
+namespace
+{
+	const float openMin = -numeric_limits<float>::infinity();
+	const float openMax = numeric_limits<float>::infinity();
+}
+
+void TrailPolylines::Capture(ParticleList const& _particles, ParticleList const& _ballisticParticles, float _tolerance, size_t _maxVertices, size_t _maxTrails)
+{
+	++m_capture;
+	for (auto const* particles : { &_particles, &_ballisticParticles })
+	{
+		for (size_t i = 0; i < particles->size(); ++i)
+		{
+			const ParticleId id = particles->GetId(i);
+			auto it = m_trails.find(id);
+			if (it == m_trails.end())
+			{
+				if (m_trails.size() >= _maxTrails)
+					continue;
+				it = m_trails.try_emplace(id).first;
+			}
+			Trail& trail = it->second;
+			const VectorType pos = particles->GetPos(i);
+			AddPoint(trail, { static_cast<float>(pos.x), static_cast<float>(pos.y) }, _tolerance, _maxVertices);
+			trail.lastCapture = m_capture;
+			++m_numPointsCaptured;
+		}
+	}
+
+	// Anything which wasn't in this capture has merged into something or been deleted. If the limit's come down
+	// since, whatever's over it goes too.
+	for (auto it = m_trails.begin(); it != m_trails.end();)
+	{
+		if (it->second.lastCapture != m_capture || m_trails.size() > _maxTrails)
+		{
+			m_numVertices -= it->second.vertices.size();
+			it = m_trails.erase(it);
+		}
+		else
+			++it;
+	}
+}
+
+void TrailPolylines::clear()
+{
+	m_trails.clear();
+	m_numVertices = 0;
+	m_numPointsCaptured = 0;
+}
+
+void TrailPolylines::AddPoint(Trail& _trail, Point _point, float _tolerance, size_t _maxVertices)
+{
+	if (_trail.vertices.empty())
+	{
+		_trail.vertices.push_back(_point);
+		++m_numVertices;
+		_trail.head = _point;
+		_trail.minAngle = openMin;
+		_trail.maxAngle = openMax;
+		_trail.furthest = 0.f;
+		return;
+	}
+
+	Point anchor = _trail.vertices.back();
+	float dx = _point.x - anchor.x, dy = _point.y - anchor.y;
+	float distance = sqrt(dx * dx + dy * dy);
+
+	// Points within the tolerance of the last vertex fit any line from it, so they don't narrow the wedge, but they
+	// can still have come back from further out
+	const bool doubledBack = distance < _trail.furthest - _tolerance;
+	if (distance > _tolerance || doubledBack)
+	{
+		float angle = atan2(dy, dx);
+		if (_trail.minAngle != openMin)
+		{
+			// Same turn as the wedge, which doesn't wrap since it's always narrower than half a circle
+			const float centre = (_trail.minAngle + _trail.maxAngle) * 0.5f;
+			if (angle - centre > (float)ARGMath::PI)
+				angle -= (float)ARGMath::twoPI;
+			else if (angle - centre < -(float)ARGMath::PI)
+				angle += (float)ARGMath::twoPI;
+		}
+
+		if (doubledBack || angle < _trail.minAngle || angle > _trail.maxAngle)
+		{
+			// A segment to here would leave one of the earlier points behind, either to one side or beyond its end,
+			// so the last point becomes a vertex and the wedge starts again from it
+			_trail.vertices.push_back(_trail.head);
+			++m_numVertices;
+			_trail.minAngle = openMin;
+			_trail.maxAngle = openMax;
+			_trail.furthest = 0.f;
+
+			anchor = _trail.head;
+			dx = _point.x - anchor.x;
+			dy = _point.y - anchor.y;
+			distance = sqrt(dx * dx + dy * dy);
+			angle = atan2(dy, dx);
+		}
+
+		_trail.furthest = max(_trail.furthest, distance);
+		if (distance > _tolerance)
+		{
+			const float halfWidth = asin(_tolerance / distance);
+			_trail.minAngle = max(_trail.minAngle, angle - halfWidth);
+			_trail.maxAngle = min(_trail.maxAngle, angle + halfWidth);
+		}
+	}
+	_trail.head = _point;
+
+	// Drop the oldest vertices a batch at a time, rather than shifting the whole trail along for every new one
+	_maxVertices = max<size_t>(_maxVertices, 2);
+	if (_trail.vertices.size() > _maxVertices + _maxVertices / 4)
+	{
+		const size_t excess = _trail.vertices.size() - _maxVertices;
+		_trail.vertices.erase(_trail.vertices.begin(), _trail.vertices.begin() + excess);
+		m_numVertices -= excess;
+	}
+}
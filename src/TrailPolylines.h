@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "ParticleList.h"
+
+// A trail for each particle as a line strip, simplified as points are added so it only keeps the vertices needed to
+// stay within a tolerance of the path. A smooth orbit needs a handful of vertices rather than a point per capture.
+//
+// The simplification is done a point at a time with a sleeve rather than with Douglas-Peucker over the whole path,
+// so it only needs a little state per trail. From the last vertex, the directions a line could go in and still pass
+// within the tolerance of every point since are a wedge. Each new point narrows the wedge, and when one lands outside
+// it the point before becomes a vertex and a new wedge starts from there. The wedge only covers the directions, so a
+// point which doubles back more than the tolerance towards the last vertex ends the segment too, otherwise the
+// segment would stop short of the furthest point. Every point ends up within the tolerance of the segment between the
+// vertices either side of it.
+class TrailPolylines
+{
+public:
+	struct Point
+	{
+		float x, y;
+	};
+
+	// Adds the particles' positions to their trails, and drops the trails of particles which have gone. _tolerance is
+	// in world units, trails longer than _maxVertices lose their oldest vertices. Particles beyond the first
+	// _maxTrails with trails don't get one.
+	void Capture(ParticleList const& _particles, ParticleList const& _ballisticParticles, float _tolerance, size_t _maxVertices, size_t _maxTrails);
+
+	void clear();
+
+	size_t GetNumTrails() const { return m_trails.size(); }
+	size_t GetNumVertices() const { return m_numVertices; }
+	unsigned long long GetNumPointsCaptured() const { return m_numPointsCaptured; }
+
+	// _fn(vertices, head) for each trail, where head is the latest point and goes on the end of the strip
+	template<typename Fn>
+	void ForEach(Fn&& _fn) const;
+
+private:
+	struct Trail
+	{
+		std::vector<Point> vertices;	// oldest first, the last one is where the wedge starts
+		Point head;
+		float minAngle, maxAngle;		// the wedge, radians
+		float furthest;					// distance of the furthest point from the last vertex since it was added
+		unsigned lastCapture;
+	};
+
+	void AddPoint(Trail& _trail, Point _point, float _tolerance, size_t _maxVertices);
+
+	std::unordered_map<ParticleId, Trail> m_trails;
+	unsigned m_capture = 0;
+	size_t m_numVertices = 0;
+	unsigned long long m_numPointsCaptured = 0;
+};
+
+template<typename Fn>
+void TrailPolylines::ForEach(Fn&& _fn) const
+{
+	for (auto const& [id, trail] : m_trails)
+		_fn(trail.vertices, trail.head);
+}
@@ -0,0 +1,85 @@
+#include "TrailStore.h"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+void TrailStore::SetCapacity(size_t _capacity)
+{
+	if (_capacity == capacity())
+		return;
+
+	// Unwrap the newest points into the start of new buffers
+	const size_t keep = min(m_count, _capacity);
+	vector<float> x(_capacity), y(_capacity);
+	vector<uint8_t> mass(_capacity);
+	for (size_t i = 0; i < keep; ++i)
+	{
+		const size_t from = (m_first + m_count - keep + i) % capacity();
+		x[i] = m_x[from];
+		y[i] = m_y[from];
+		mass[i] = m_mass[from];
+	}
+	m_x.swap(x);
+	m_y.swap(y);
+	m_mass.swap(mass);
+	m_first = 0;
+	m_count = keep;
+}
+
+void TrailStore::Append(ParticleList const& _particles)
+{
+	const size_t cap = capacity();
+	if (cap == 0)
+		return;
+	size_t first = 0, count = _particles.size();
+	if (count > cap)
+	{
+		first = count - cap;
+		count = cap;
+	}
+
+	// Write in at most two runs, up to the end of the buffer and then round from the start
+	size_t next = (m_first + m_count) % cap;
+	for (size_t done = 0; done < count;)
+	{
+		const size_t run = min(count - done, cap - next);
+		float* x = &m_x[next];
+		float* y = &m_y[next];
+		uint8_t* mass = &m_mass[next];
+		for (size_t i = 0; i < run; ++i)
+		{
+			const VectorType pos = _particles.GetPos(first + done + i);
+			x[i] = static_cast<float>(pos.x);
+			y[i] = static_cast<float>(pos.y);
+			mass[i] = QuantiseMass(_particles.GetMass(first + done + i));
+		}
+		done += run;
+		next = (next + run) % cap;
+	}
+
+	// Anything overwritten was the oldest
+	const size_t overflow = m_count + count > cap ? m_count + count - cap : 0;
+	m_first = (m_first + overflow) % cap;
+	m_count += count - overflow;
+}
+
+uint8_t TrailStore::QuantiseMass(float _mass)
+{
+	if (!(_mass > 0.f))
+		return 0;
+	return static_cast<uint8_t>(clamp(lround((log(_mass) + 8.f) * 8.f), 0l, 255l));
+}
+
+float const* TrailStore::GetMasses()
+{
+	static const auto masses = []
+		{
+			vector<float> masses(256);
+			for (size_t i = 0; i < masses.size(); ++i)
+				masses[i] = exp(i / 8.f - 8.f);
+			return masses;
+		}();
+	return masses.data();
+}
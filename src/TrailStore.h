@@ -0,0 +1,66 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "ParticleList.h"
+
+// Trail points in a fixed size ring buffer, oldest overwritten first. Each point is a float position and the mass
+// quantised to 8 bits of log, which is all drawing needs (GetSize only uses the log), so 9 bytes a point rather
+// than a whole Particle. Points are added a snapshot at a time.
+class TrailStore
+{
+public:
+	// Keeps the newest points if it shrinks
+	void SetCapacity(size_t _capacity);
+	size_t capacity() const { return m_x.size(); }
+
+	// Only the last capacity() points are kept if there are more than that
+	void Append(ParticleList const& _particles);
+
+	size_t size() const { return m_count; }
+	void clear() { m_first = m_count = 0; }
+
+	size_t GetBytes() const { return capacity() * (2 * sizeof(float) + sizeof(uint8_t)); }
+
+	struct Point
+	{
+		float x, y, mass;
+	};
+
+	// Counting from the oldest
+	Point operator[](size_t _i) const
+	{
+		const size_t i = (m_first + _i) % capacity();
+		return { m_x[i], m_y[i], GetMasses()[m_mass[i]] };
+	}
+
+	// _fn(x, y, mass) for each point, oldest first
+	template<typename Fn>
+	void ForEach(Fn&& _fn) const;
+
+private:
+	// ln(mass) in eighths from -8 to 24. Sizes go with ln(mass), so a trail point is within a few percent of the size
+	// of the particle it came from for any mass that's big enough to see.
+	static uint8_t QuantiseMass(float _mass);
+	static float const* GetMasses();
+
+	std::vector<float> m_x;
+	std::vector<float> m_y;
+	std::vector<uint8_t> m_mass;
+	size_t m_first = 0;		// oldest point
+	size_t m_count = 0;
+};
+
+template<typename Fn>
+void TrailStore::ForEach(Fn&& _fn) const
+{
+	// In two runs, from the oldest to the end of the buffer and then round from the start
+	float const* masses = GetMasses();
+	const size_t firstRun = std::min(m_count, capacity() - m_first);
+	for (size_t i = m_first; i < m_first + firstRun; ++i)
+		_fn(m_x[i], m_y[i], masses[m_mass[i]]);
+	for (size_t i = 0; i < m_count - firstRun; ++i)
+		_fn(m_x[i], m_y[i], masses[m_mass[i]]);
+}
@@ -5,6 +5,8 @@
 #include "Universe.h"
 
 #include "ParticleUniverseGame.h"
+#include "ParticleMesh.h"
+#include "RecordingFormat.h"
 
 #include "ARGCore\TimingManager.h"
 #include "ARGCore\ARGUtils.h"
@@ -16,11 +18,11 @@
 
 #include <algorithm>
 #include <unordered_set>
-#include <queue>
+#include <unordered_map>
 #include <vector>
 #include <iterator>
+#include <numeric>
 #include <random>
-#include <future>
 #include <memory>
 #include <mutex>
 #include <fstream>
@@ -42,18 +44,23 @@ auto versionText = "v1.6";
 // particles (e.g. 10k or more)
 #define GRID_BASED_MODE_NEW
 
-// Default async policy is that std::async will decide whether each particle update is run on a new thread or the main thread
-#define ASYNC_POLICY_DEFAULT 1
-
-// asyncPolicy of launch::deferred means threading will not be used
-// asyncPolicy of launch::async means that each particle update will happen on a separate thread
-#if !ASYNC_POLICY_DEFAULT
-auto asyncPolicy = std::launch::deferred;
-#endif
-
 // 35 may work better for the latest version of the grid-based system
 const int defaultGridRowsCols = 20;
 
+// Particle mesh mode. The short range correction covers pairs within this many split radii, beyond that the mesh
+// force is within about 0.1% of the real thing.
+const int defaultMeshRowsCols = 128;
+const float defaultMeshSplitCells = 1.25f;
+const double particleMeshCutoff = 4.5;
+
+const char* const gravityModeNames[] = { "Normal", "Grid based", "Particle mesh" };
+const char* const densityModeNames[] = { "Off", "Auto", "On" };
+
+// Deterministic mode splits the particles into blocks of this many for normal mode, up to a maximum number of blocks.
+// Neither depends on the number of threads, or the result would.
+const size_t deterministicBlockSize = 256;
+const size_t deterministicMaxBlocks = 64;
+
 // High = faster but less accurate, if it's equal or close to gridRowsCols there's no benefit in the grid based 
 // approach (in fact it will be worse than normal mode)
 const int defaultHighAccuracyGridDistance = 2;
@@ -68,9 +75,30 @@ const float spiralMassDecrease = 0.999f;		// used 0.99 in latest video, old vers
 
 const float particleEdgeThickness = 1.5f;
 
+// Frames written with F5 go here, and headless frames are this size, see CaptureFrame
+const string frameDirectory = "frames";
+const int headlessWidth = 1920;
+const int headlessHeight = 1080;
+
+// In DensityMode::Auto the density map is only built this often while it isn't being shown, to see if it should be
+const int densityCheckInterval = 15;
+
+// Neighbour lists are rebuilt once any particle has moved half this distance. 0 = rebuild every step
+const float defaultNeighbourListSkin = 50.f;
+
+// Coarsening: how often to run the pass, the smallest cluster worth aggregating, and particles heavier than this
+// fraction of the heaviest count as massive bodies which small particles must be far from to be coarsened
+const int coarseningInterval = 16;
+const size_t coarseningMinClusterSize = 4;
+const float coarseningMassiveFraction = 0.1f;
+
+// Unbound particles further than this from the system's centre of mass are moved to the ballistic tier
+const float defaultBallisticRadius = 25000.f;
+
 // Recording: set num particles much higher (e.g. 15k like in my latest video), set recording mode
 // to save, and update the filenames below. Probably also enable save on quit, and then enable
-// load on start to resume the recording.
+// load on start to resume the recording. Recordings can then be rendered to frames with
+// --render-recording, see RecordingRenderer, rather than played back and captured.
 
 enum class RecordingMode
 {
@@ -116,7 +144,7 @@ std::ostream& operator<<(std::ostream& os, Particle const& p)
 {
 	os << p.m_pos.x << " " << p.m_pos.y << " "
 	   << p.m_vel.x << " " << p.m_vel.y << " "
-	   << p.m_mass << " " << p.m_col << " ";
+	   << p.m_mass << " " << p.GetColour() << " ";
 	return os;
 }
 
@@ -124,44 +152,116 @@ inline std::istream& operator>> (std::istream& is, Particle& p)
 {
 	is >> p.m_pos.x >> p.m_pos.y >> p.m_vel.x >> p.m_vel.y;
 	is >> p.m_mass;
-	is >> p.m_col.r >> p.m_col.g >> p.m_col.b;
+	ALLEGRO_COLOR col = al_map_rgb(255, 255, 255);
+	is >> col.r >> col.g >> col.b;
+	p.m_colour = ColourPalette::GetIndex(col);
 	return is;
 }
 
 const bool autoSaveConfigOptions = false;
 
+// Called on the simulation thread and the thread pool's workers. Their allocations are counted in debug builds, see
+// Step, and their arenas are created up front so that doesn't count as a steady state allocation.
+static void OnSimulationThreadStart()
+{
+	AllocationCounter::CountThisThread();
+	Arena::GetThreadArena();
+}
+
 Universe::Universe():
 	m_gravitationalConstant(DEFAULT_G),
 	m_defaultViewportWidth(800.0f),
 	m_viewportWidth(m_defaultViewportWidth * 1.f),
 	m_cameraPos(400.f, 300.f),
-	m_scW(al_get_display_width(g_display)),
-	m_scH(al_get_display_height(g_display)),
+	m_cameraFollow(0),
+	m_scW(g_display ? al_get_display_width(g_display) : headlessWidth),
+	m_scH(g_display ? al_get_display_height(g_display) : headlessHeight),
 	m_worldAspectRatio((float)m_scW / (float)m_scH),
 	//m_debug(true),
 	m_debugParticleInfo(false),
 	m_currentMenuPage(MenuPage::Default),
 	m_particles(500),
+	m_renderThreadPool(max(1u, thread::hardware_concurrency() / 4)),
 	m_showTrails(false),
+	m_trailMode(TrailMode::Points),
 	m_createTrailInterval("trails", "createTrailInterval", "Create trail interval", defaultTrailInterval, autoSaveConfigOptions),
 	m_maxTrails("trails", "maxTrails", "Max trails", 100000, autoSaveConfigOptions),
+	m_trailTolerance("trails", "tolerance", "Trail line tolerance (pixels)", 0.5f, autoSaveConfigOptions),
+	m_maxTrailLines("trails", "maxLines", "Max trail lines", 100000, autoSaveConfigOptions),
+	m_maxTrailVertices("trails", "maxVertices", "Max vertices per trail line", 2000, autoSaveConfigOptions),
+	m_trailFadeTime("trails", "fadeTime", "Trail bitmap fade time (s)", 3.f, autoSaveConfigOptions),
 	m_sizeLogBase("particles", "sizeLogBase", "Size log base", 2.7, autoSaveConfigOptions),
+	m_densityThreshold("particles", "densityThreshold", "Density map particles per pixel", 4.f, autoSaveConfigOptions),
 	m_gridRowsCols("grid", "gridRowsCols", "Grid rows and columns", defaultGridRowsCols, autoSaveConfigOptions),
 	m_numSpiralParticles("spiral", "numSpiralParticles", "Spiral particles to generate", spiralNumParticlesDefault, autoSaveConfigOptions),
 	m_highAccuracyGridDistance("grid", "highAccuracyGridDistance", "High accuracy grid distance", defaultHighAccuracyGridDistance, autoSaveConfigOptions),
+	m_meshRowsCols("particleMesh", "meshRowsCols", "Mesh rows and columns", defaultMeshRowsCols, autoSaveConfigOptions),
+	m_meshSplitCells("particleMesh", "splitCells", "Mesh split scale", defaultMeshSplitCells, autoSaveConfigOptions),
+	m_ballisticRadius("ballistic", "ballisticRadius", "Ballistic tier radius", defaultBallisticRadius, autoSaveConfigOptions),
+	m_timeStep("simulation", "timeStep", "Time step", 1.f, autoSaveConfigOptions),
+	m_neighbourListSkin("neighbourLists", "skin", "Neighbour list skin", defaultNeighbourListSkin, autoSaveConfigOptions),
+	m_coarsenMassFraction("coarsening", "massFraction", "Coarsen mass fraction", 0.01f, autoSaveConfigOptions),
+	m_coarsenCellSize("coarsening", "cellSize", "Coarsen cell size", 200.f, autoSaveConfigOptions),
+	m_coarsenDistance("coarsening", "distance", "Coarsen distance", 5000.f, autoSaveConfigOptions),
+	m_fidelityMargin("fidelity", "margin", "Full fidelity margin", 0.5f, autoSaveConfigOptions),
+	m_fidelityBand("fidelity", "band", "Transition band", 1.f, autoSaveConfigOptions),
+	m_fidelityMaxInterval("fidelity", "maxInterval", "Max kick interval", 8, autoSaveConfigOptions),
+	m_updatesPerSecond("simulation", "updatesPerSecond", "Updates per second", 60, autoSaveConfigOptions),
+	m_fastForwardBudgetMs("simulation", "fastForwardBudgetMs", "Fast forward budget (ms)", 15.f, autoSaveConfigOptions),
+	m_arenaLargePages("simulation", "arenaLargePages", "Large pages for step arenas", false, autoSaveConfigOptions),
+	m_threadPool(0, OnSimulationThreadStart),
+	m_recordingThreadPool(1),
+	m_particleMesh(m_threadPool),
 	m_createTrailIntervalCounter(0),
 	m_freeze(false),
+	m_pauseRequests(0),
+	m_quitSimulationThread(false),
+	m_fastForward(false),
+	m_useSimulationThread(true),
+	m_recordingInProgress(false),
+	m_msPerStep(0.),
+	m_stepsPerSecond(0.),
+	m_stepRateStartTime(TimingManager::GetTime()),
+	m_stepRateStartCount(0),
 	m_userGeneratedParticleMass(1e5f),
 	m_showConfigMenu(false),
-	m_useGridBasedMode(false)
+	m_gravityMode(GravityMode::Normal),
+	m_useBallisticTier(true),
+	m_useCoarsening(false),
+	m_useViewFidelity(false),
+	m_deterministic(false),
+	m_compactSnapshots(false),
+	m_stepCount(0),
+	m_simulationTime(0.),
+	m_interpolateSnapshots(true),
+	m_systemMass(0.)
 {
 	m_allOptions = {
 		&m_gridRowsCols,
 		&m_highAccuracyGridDistance,
+		&m_meshRowsCols,
+		&m_meshSplitCells,
 		&m_numSpiralParticles,
 		&m_createTrailInterval,
 		&m_maxTrails,
-		&m_sizeLogBase
+		&m_trailTolerance,
+		&m_maxTrailLines,
+		&m_maxTrailVertices,
+		&m_trailFadeTime,
+		&m_sizeLogBase,
+		&m_densityThreshold,
+		&m_ballisticRadius,
+		&m_timeStep,
+		&m_neighbourListSkin,
+		&m_coarsenMassFraction,
+		&m_coarsenCellSize,
+		&m_coarsenDistance,
+		&m_fidelityMargin,
+		&m_fidelityBand,
+		&m_fidelityMaxInterval,
+		&m_updatesPerSecond,
+		&m_fastForwardBudgetMs,
+		&m_arenaLargePages
 	};
 
 
@@ -175,6 +275,8 @@ Universe::Universe():
 			option->save();
 	}
 
+	Arena::SetUseLargePages(m_arenaLargePages);
+
 	Fonts::load();
 
 	m_configMenu = CreateConfigMenu();
@@ -191,6 +293,7 @@ Universe::Universe():
 		case RecordingMode::Save:
 		{
 			outputFile.open(recordingOutputFileName, ios::binary);
+			RecordingFormat::WriteHeader(outputFile);
 			break;
 		}
 	}
@@ -201,19 +304,70 @@ Universe::Universe():
 	}
 }
 
+Universe::~Universe()
+{
+	StopSimulationThread();
+	WaitForRecording();
+}
+
 void Universe::AddParticle(VectorType _pos,	VectorType _vel, float _mass,
 	ALLEGRO_COLOR _col = al_map_rgb(255, 255, 255))
 {
 	m_particles.emplace_back( _pos, _vel, _mass, _col );
+	m_particles.back().m_id = m_particleSlots.Insert(static_cast<uint32_t>(m_particles.size() - 1));
+	ParticlesReordered();
+}
+
+void Universe::ClearTrails()
+{
+	m_trails.clear();
+	m_trailPolylines.clear();
+	m_trailBitmap.clear();
+}
+
+void Universe::RemoveParticle(ParticleId _id)
+{
+	// Swap in the last particle rather than erasing, so nothing else has to move
+	const uint32_t location = m_particleSlots.Get(_id);
+	if (location == SlotMap::none)
+		return;
+	auto& particles = (location & ballisticLocation) ? m_ballisticParticles : m_particles;
+	const size_t index = location & ~ballisticLocation;
+
+	Particle& p = particles[index];
+	if (p.IsMacro())
+	{
+		for (auto const& c : m_macroParticles.at(_id).constituents)
+			m_particleSlots.Erase(c.m_id);
+		m_macroParticles.erase(_id);
+	}
+	m_particleSlots.Erase(_id);
+	if (index + 1 < particles.size())
+	{
+		p = move(particles.back());
+		m_particleSlots.Set(p.m_id, location);
+	}
+	particles.pop_back();
+	ParticlesReordered();
 }
 
-void Universe::AddTrailParticle(VectorType _pos, float _mass)
+void Universe::ParticlesReordered()
 {
-	if (m_trails.size() >= (size_t)m_maxTrails)
-		m_trails.pop_front();
+	// Both hold indices into m_particles
+	m_neighbourLists.valid = false;
+	m_sweepOrder.clear();
+}
 
-	//m_trails.push_back( Particle(_pos, _mass, 128, 128, 128) );
-	m_trails.emplace_back(_pos, VectorType(0,0), _mass, al_map_rgb(128, 128, 128));
+void Universe::UpdateParticleSlots()
+{
+	// Each particle has its own slot, so they can all be set at once
+	ParallelForParticles([&](size_t begin, size_t end)
+		{
+			for (size_t i = begin; i < end; ++i)
+				m_particleSlots.Set(m_particles[i].m_id, static_cast<uint32_t>(i));
+		});
+	for (size_t i = 0; i < m_ballisticParticles.size(); ++i)
+		m_particleSlots.Set(m_ballisticParticles[i].m_id, static_cast<uint32_t>(i) | ballisticLocation);
 }
 
 void Universe::Advance(float _deltaTime)
@@ -224,74 +378,64 @@ void Universe::Advance(float _deltaTime)
 		_deltaTime = 1 / 60.f;
 */
 
-	// Create trail particles
-	if (m_maxTrails > 0 && m_createTrailIntervalCounter++ % m_createTrailInterval == 0)
-	{
-		for (auto const& p : m_particles)
-		{
-			AddTrailParticle(p.GetPos(), p.GetMass());
-		}
-	}
+	if (m_useSimulationThread && !m_simulationThread.joinable())
+		StartSimulationThread();
+	else if (!m_useSimulationThread && m_simulationThread.joinable())
+		StopSimulationThread();
 
-	if (recordingMode == RecordingMode::Load)
+	// Pick up the latest snapshot from the simulation, keeping hold of the one before for interpolation
+	const bool newSnapshot = m_snapshots.HasNewData();
+	if (newSnapshot)
 	{
-		if (!inputFile.is_open())
-		{
-			auto filename = recordingInputFileNames[currentRecordingFileI];
-			inputFile.open(filename, ios::binary);
-			argDebugf("opened %s\n", filename.c_str());
-		}
-		else if (inputFile.eof())
-		{
-			// open next file in sequence
-			if (currentRecordingFileI < recordingInputFileNames.size() - 1)
-			{
-				++currentRecordingFileI;
-				inputFile.close();
-				auto filename = recordingInputFileNames[currentRecordingFileI];
-				inputFile.open(filename, ios::binary);
-				argDebugf("opened %s\n", filename.c_str());
-			}
-		}
-
-		if (inputFile.good())
+		if (m_interpolateSnapshots)
 		{
-			size_t pCount;
-			read(inputFile, pCount);
-			if (inputFile.good())
+			Snapshot const& previous = m_snapshots.GetReadBuffer();
+			m_previousSnapshot.compact = previous.compact;
+			if (previous.compact)
 			{
-				m_particles.resize(pCount);
-				for (size_t i = 0; i < pCount; ++i)
+				// Copied as it is, which keeps it compact
+				m_previousSnapshot.compactParticles = previous.compactParticles;
+				m_previousSnapshot.compactBallisticParticles = previous.compactBallisticParticles;
+				if (!m_previousSnapshot.particles.empty())
 				{
-					// todo could save pos as floats rather than doubles
-					read(inputFile, m_particles[i].m_mass);
-					read(inputFile, m_particles[i].m_pos.x);
-					read(inputFile, m_particles[i].m_pos.y);
-					read(inputFile, m_particles[i].m_vel.x);
-					read(inputFile, m_particles[i].m_vel.y);
-					read(inputFile, m_particles[i].m_col.r);
-					read(inputFile, m_particles[i].m_col.g);
-					read(inputFile, m_particles[i].m_col.b);
+					m_previousSnapshot.particles = {};
+					m_previousSnapshot.ballisticParticles = {};
 				}
 			}
+			else
+			{
+				m_previousSnapshot.particles.assign(previous.particles.begin(), previous.particles.end());
+				m_previousSnapshot.ballisticParticles.assign(previous.ballisticParticles.begin(), previous.ballisticParticles.end());
+				m_previousSnapshot.compactParticles.clear();
+				m_previousSnapshot.compactBallisticParticles.clear();
+			}
+			m_previousSnapshot.publishTime = previous.publishTime;
+			m_previousSnapshot.simulationTime = previous.simulationTime;
 		}
+		m_snapshots.Acquire();
+		m_particleTreeStale = true;
+
+		if (m_interpolateSnapshots)
+			MatchPreviousSnapshot(m_snapshots.GetReadBuffer());
 	}
-	else if (!m_freeze)
+	Snapshot const& snapshot = m_snapshots.GetReadBuffer();
+
+	// Create trail particles. These belong to the main thread, and are added from new snapshots so that a slow
+	// simulation doesn't leave a pile of trail particles in the same place. Polylines and points each have their own
+	// limit, which turns them off at 0.
+	m_trails.SetCapacity(max(m_maxTrails.get(), 0));
+	const int maxTrails = m_trailMode == TrailMode::Polylines ? m_maxTrailLines : m_maxTrails;
+	if (newSnapshot && maxTrails > 0 && m_createTrailIntervalCounter++ % m_createTrailInterval == 0)
 	{
-		// todo make fast forward cut off if time taken is too long
-		int numGravityUpdates = Keyboard::keyCurrentlyDown(ALLEGRO_KEY_Z) ? 100 : 1;
-
-		for (int i = 0; i < numGravityUpdates; ++i)
+		if (m_trailMode == TrailMode::Polylines)
 		{
-			// Update velocity of each particle
-			if (!m_useGridBasedMode)
-				AdvanceGravityNormalMode();
-			else
-				AdvanceGravityGridBasedMode();
-
-			// Now apply the velocity of each particle to its position
-			for (auto& p : m_particles)
-				p.SetPos(p.GetPos() + p.GetVel());
+			const float tolerance = m_trailTolerance * (float)(m_viewportWidth / m_scW);
+			m_trailPolylines.Capture(GetParticles(snapshot), GetBallisticParticles(snapshot), tolerance, max(m_maxTrailVertices.get(), 0), maxTrails);
+		}
+		else if (m_trailMode == TrailMode::Points)
+		{
+			m_trails.Append(GetParticles(snapshot));
+			m_trails.Append(GetBallisticParticles(snapshot));
 		}
 	}
 
@@ -311,34 +455,28 @@ void Universe::Advance(float _deltaTime)
 				float velx = 0.f; // (float)(getrandom(-100, 100)) / 100.0f;
 				float vely = 0.f; // (float)(getrandom(-100, 100)) / 100.0f;
 
-				AddParticle(
+				VectorType pos = ScreenToWorld(VectorType(mouseState.x, mouseState.y));
+				double mass = m_userGeneratedParticleMass;
+				QueueCommand([=] { AddParticle(
 					//VectorType(getrandom(0, m_defaultViewportWidth), getrandom(0, m_defaultViewportWidth*0.75f)),
-					ScreenToWorld(VectorType(mouseState.x, mouseState.y)),
+					pos,
 					VectorType(velx, vely),
-					m_userGeneratedParticleMass);
+					mass); });
 			}
 
-#if 0
-			if (al_mouse_button_down(&mouseState, 3))
+			// Middle click follows the nearest particle with the camera, or stops following if there isn't one near
+			if (al_mouse_button_down(&mouseState, 3) && !al_mouse_button_down(&lastMouseState, 3))
 			{
-				auto pos = ScreenToWorld(VectorType(mouseState.x, mouseState.y));
-				m_cameraFollow = FindNearest(pos);
+				m_cameraFollow = PickParticle(VectorType(mouseState.x, mouseState.y));
 			}
-#endif
 
-			if (al_mouse_button_down(&mouseState, 2) && !m_particles.empty())
+			if (al_mouse_button_down(&mouseState, 2))
 			{
-				VectorType mouseScreenPos = VectorType(mouseState.x, mouseState.y);
-				VectorType mouseWorldPos = ScreenToWorld(mouseScreenPos);
-				auto nearest = FindNearest(mouseWorldPos);
-				if (nearest != m_particles.end())
-				{
-					// Only delete if it's within a certain distance from the mouse in screen space
-					auto particleScreenPos = WorldToScreen(nearest->GetPos());
-					float dist = (mouseScreenPos - particleScreenPos).Mag();
-					if (dist < rightClickDeleteMaxPixelDistance)
-						m_particles.erase(nearest);
-				}
+				// The particle is picked from what's on screen, by the time the command runs it may have been merged
+				// or already deleted, in which case its ID won't be found
+				ParticleId id = PickParticle(VectorType(mouseState.x, mouseState.y));
+				if (id != 0)
+					QueueCommand([=] { RemoveParticle(id); });
 			}
 
 			lastMouseState = mouseState;
@@ -365,12 +503,13 @@ void Universe::Advance(float _deltaTime)
 			if (Keyboard::keyCurrentlyDown(ALLEGRO_KEY_DOWN)) { m_cameraPos.y += m_viewportWidth * 0.75f * _deltaTime; }
 			if (Keyboard::keyCurrentlyDown(ALLEGRO_KEY_LEFT)) { m_cameraPos.x -= m_viewportWidth * 0.75f * _deltaTime; }
 			if (Keyboard::keyCurrentlyDown(ALLEGRO_KEY_RIGHT)) { m_cameraPos.x += m_viewportWidth * 0.75f * _deltaTime; }
-#if 0
-			if (m_cameraFollow != m_particles.end())
+
+			// Moving the camera by hand stops following
+			if (Keyboard::keyCurrentlyDown(ALLEGRO_KEY_UP) || Keyboard::keyCurrentlyDown(ALLEGRO_KEY_DOWN)
+				|| Keyboard::keyCurrentlyDown(ALLEGRO_KEY_LEFT) || Keyboard::keyCurrentlyDown(ALLEGRO_KEY_RIGHT))
 			{
-				m_cameraPos = m_cameraFollow->m_pos;
+				m_cameraFollow = 0;
 			}
-#endif
 		}
 	}
 
@@ -379,189 +518,786 @@ void Universe::Advance(float _deltaTime)
 	if (Keyboard::keyPressed(ALLEGRO_KEY_F1)) { m_debugParticleInfo = !m_debugParticleInfo; }
 	if (Keyboard::keyPressed(ALLEGRO_KEY_F2)) { m_freeze = !m_freeze; }
 	if (Keyboard::keyPressed(ALLEGRO_KEY_F3)) { m_showTrails = !m_showTrails; }
+	if (Keyboard::keyPressed(ALLEGRO_KEY_F4)) { m_trailMode = static_cast<TrailMode>((static_cast<int>(m_trailMode) + 1) % static_cast<int>(TrailMode::Count)); ClearTrails(); }
+	if (Keyboard::keyPressed(ALLEGRO_KEY_F5))
+	{
+		m_writeFrames = !m_writeFrames;
+		if (m_writeFrames)
+		{
+			m_frameDirectory = frameDirectory;
+			filesystem::create_directories(m_frameDirectory);
+		}
+	}
 	
-	if (Keyboard::keyPressed(ALLEGRO_KEY_G)) { m_useGridBasedMode = !m_useGridBasedMode; }
+	if (Keyboard::keyPressed(ALLEGRO_KEY_G)) { m_gravityMode = static_cast<GravityMode>((static_cast<int>(m_gravityMode.load()) + 1) % static_cast<int>(GravityMode::Count)); }
+	if (Keyboard::keyPressed(ALLEGRO_KEY_B)) { m_useBallisticTier = !m_useBallisticTier; }
+	if (Keyboard::keyPressed(ALLEGRO_KEY_K)) { m_useCoarsening = !m_useCoarsening; }
+	if (Keyboard::keyPressed(ALLEGRO_KEY_V)) { m_useViewFidelity = !m_useViewFidelity; }
+	if (Keyboard::keyPressed(ALLEGRO_KEY_D)) { m_deterministic = !m_deterministic; }
+	if (Keyboard::keyPressed(ALLEGRO_KEY_P)) { m_compactSnapshots = !m_compactSnapshots; }
+	if (Keyboard::keyPressed(ALLEGRO_KEY_T)) { m_useSimulationThread = !m_useSimulationThread; }
+	if (Keyboard::keyPressed(ALLEGRO_KEY_S)) { m_useDiscSprites = !m_useDiscSprites; }
+	if (Keyboard::keyPressed(ALLEGRO_KEY_X)) { m_lockPixels = !m_lockPixels; }
+	if (Keyboard::keyPressed(ALLEGRO_KEY_M)) { m_densityMode = static_cast<DensityMode>((static_cast<int>(m_densityMode) + 1) % static_cast<int>(DensityMode::Count)); m_densityCheckCounter = densityCheckInterval; }
+	if (Keyboard::keyPressed(ALLEGRO_KEY_I))
+	{
+		m_interpolateSnapshots = !m_interpolateSnapshots;
+		m_previousSnapshot = {};
+	}
+
+	// Streams 64 MB through each node, which takes long enough that it's only done when asked for
+	if (Keyboard::keyPressed(ALLEGRO_KEY_N))
+	{
+		RunWithSimulationPaused([&] { m_nodeBandwidth = m_threadPool.MeasureNodeBandwidth(); });
+		for (size_t node = 0; node < m_nodeBandwidth.size(); ++node)
+			argDebugf("NUMA node %d: %.1f GB/s", (int)node, m_nodeBandwidth[node]);
+	}
+
+	m_fastForward = Keyboard::keyCurrentlyDown(ALLEGRO_KEY_Z);
 
 	AdvanceMenu();
 
-	if (recordingMode == RecordingMode::Save)
 	{
-		write(outputFile, m_particles.size());
-		for (auto const& p : m_particles)
-		{
-			write(outputFile, p.m_mass);
-			write(outputFile, p.m_pos.x);
-			write(outputFile, p.m_pos.y);
-			write(outputFile, p.m_vel.x);
-			write(outputFile, p.m_vel.y);
-			write(outputFile, p.m_col.r);
-			write(outputFile, p.m_col.g);
-			write(outputFile, p.m_col.b);
-		}
+		scoped_lock lock(m_commandMutex);
+		m_pendingView = { m_cameraPos, m_viewportWidth };
 	}
+
+	// Inline mode, one update per frame like it used to be
+	if (!m_simulationThread.joinable())
+		RunSimulationUpdate();
 }
 
-void Universe::AdvanceGravityNormalMode()
+void Universe::StartSimulationThread()
 {
-	// Check every other particle and for each one, adjust my velocity
-	// according to the gravitational attraction.
-
-	// Gravitational equation:
-	// Force = (GMm / r^2)
-	// Where G is the universal gravitational constant
-	// M and m are the masses of the two objects
-	// r is the distance between the two objects
+	// Config options load themselves the first time they're read, make sure that's already happened so the two
+	// threads don't both go to the config file at once
+	for (auto* option : m_allOptions)
+		option->preload();
 
-	vector<unordered_set<int>> mergeSets;
-	mutex mergeMutex;
+	m_quitSimulationThread = false;
+	m_simulationThread = thread(&Universe::SimulationThreadMain, this);
+}
 
-	size_t count = m_particles.size();
+void Universe::StopSimulationThread()
+{
+	if (!m_simulationThread.joinable())
+		return;
 
-	vector<mutex> mutexes(count);
+	m_quitSimulationThread = true;
+	m_simulationCondition.notify_all();
+	m_simulationThread.join();
+}
 
-	const float sizeLogBase = m_sizeLogBase;
+void Universe::SimulationThreadMain()
+{
+	OnSimulationThreadStart();
 
-	// Cache sizes to avoid having to call GetSize (with slow logarithm calls) multiple times per particle
-	// 10k particles, with only a single log, update = 170ms
-	// with two logs, update = 203ms
-	// with caching sizes, update = 154ms
-	vector<float> sizes(count);
-	for (size_t i = 0; i < m_particles.size(); ++i)
-		sizes[i] = m_particles[i].GetSize(sizeLogBase);
+	auto nextUpdate = chrono::steady_clock::now();
 
-	auto execute = [&](int i)
+	while (!m_quitSimulationThread)
 	{
-		Particle& me = m_particles[i];
-		float const meMass = me.m_mass;
-		float size = sizes[i];
+		// Config options are only read while holding the lock, as the menu changes them, see CreateConfigMenu
+		int updatesPerSecond;
+		{
+			unique_lock lock(m_simulationMutex);
+			m_simulationCondition.wait(lock, [&] { return m_pauseRequests == 0 || m_quitSimulationThread; });
+			if (m_quitSimulationThread)
+				break;
 
-		scoped_lock lock1(mutexes[i]);
+			RunSimulationUpdate();
+			updatesPerSecond = m_updatesPerSecond;
+		}
 
-		for (int p = i + 1; p < count; p++)
+		// Pace updates if there's a rate set. If we've fallen behind, carry on from now rather than trying to catch up.
+		if (updatesPerSecond > 0)
 		{
-			Particle& other = m_particles[p];
+			nextUpdate = max(nextUpdate + chrono::microseconds(1000000 / updatesPerSecond), chrono::steady_clock::now() - chrono::milliseconds(100));
+			this_thread::sleep_until(nextUpdate);
+		}
+		else if (m_freeze)
+		{
+			// Don't spin while there's nothing to do
+			this_thread::sleep_for(chrono::milliseconds(1));
+		}
+	}
+}
 
-			// Get vector between objects
-			VectorType objectsVector = other.GetPos() - me.GetPos();
+void Universe::RunSimulationUpdate()
+{
+	// Commands and view from the main thread
+	vector<function<void()>> commands;
+	{
+		scoped_lock lock(m_commandMutex);
+		commands.swap(m_commands);
+		m_simulationView = m_pendingView;
+	}
+	for (auto& command : commands)
+		command();
 
-			float distanceSq = objectsVector.MagSq();
+	if (recordingMode == RecordingMode::Load)
+	{
+		// A file from a build with a different layout is left failed, so playback stops there
+		auto openRecording = [](string const& _filename)
+		{
+			inputFile.open(_filename, ios::binary);
+			argDebugf("opened %s\n", _filename.c_str());
+			if (inputFile.is_open() && !RecordingFormat::ReadHeader(inputFile))
+			{
+				argDebugf("%s isn't a version %d recording\n", _filename.c_str(), (int)RecordingFormat::version);
+				inputFile.setstate(ios::failbit);
+			}
+		};
 
-			float combinedRadius = size + sizes[p];
-			if (distanceSq < combinedRadius * combinedRadius)
+		if (!inputFile.is_open())
+		{
+			openRecording(recordingInputFileNames[currentRecordingFileI]);
+		}
+		else if (inputFile.eof())
+		{
+			// open next file in sequence
+			if (currentRecordingFileI < recordingInputFileNames.size() - 1)
 			{
-				scoped_lock mergeLock(mergeMutex);
+				++currentRecordingFileI;
+				inputFile.close();
+				openRecording(recordingInputFileNames[currentRecordingFileI]);
+			}
+		}
 
-				//argDebugf("Merge %d,%d", i, p);
-				bool mergedIntoExistingSet = false;
-				for (auto& set : mergeSets)
+		if (inputFile.good())
+		{
+			size_t pCount;
+			read(inputFile, pCount);
+			if (inputFile.good())
+			{
+				m_particles.resize(pCount);
+				ParticlesReordered();
+				m_particleSlots.clear();
+				m_macroParticles.clear();
+				for (size_t i = 0; i < pCount; ++i)
 				{
-					bool foundI = set.find(i) != set.end();
-					bool foundP = set.find(p) != set.end();
-					if (foundI || foundP)
-					{
-						set.insert(i);
-						set.insert(p);
-						mergedIntoExistingSet = true;
-						break;
-					}
+					m_particles[i].m_isMacro = false;
+					// todo could save pos as floats rather than doubles
+					read(inputFile, m_particles[i].m_mass);
+					read(inputFile, m_particles[i].m_pos.x);
+					read(inputFile, m_particles[i].m_pos.y);
+					read(inputFile, m_particles[i].m_vel.x);
+					read(inputFile, m_particles[i].m_vel.y);
+					ALLEGRO_COLOR col = al_map_rgb(255, 255, 255);
+					read(inputFile, col.r);
+					read(inputFile, col.g);
+					read(inputFile, col.b);
+
+					// Colours hardly ever change from one frame to the next, so only go to the palette when they do
+					ALLEGRO_COLOR const& current = m_particles[i].GetColour();
+					if (col.r != current.r || col.g != current.g || col.b != current.b)
+						m_particles[i].m_colour = ColourPalette::GetIndex(col);
+
+					// The recording's IDs, so particles can be followed through it
+					read(inputFile, m_particles[i].m_id);
+					m_particleSlots.Restore(m_particles[i].m_id, static_cast<uint32_t>(i));
 				}
-
-				if (!mergedIntoExistingSet)
-					mergeSets.push_back(unordered_set<int>({ i, p }));
-
-				continue;
+				m_particleSlots.RebuildFreeSlots();
 			}
+		}
+	}
+	else if (!m_freeze)
+	{
+		// Fast forward runs as many steps as fit in the time budget, rather than a fixed number of steps which could
+		// take seconds with a lot of particles. There's always at least one step.
+		const double start = TimingManager::GetTime();
+		const double budget = m_fastForward ? m_fastForwardBudgetMs / 1000. : 0.;
+		int numGravityUpdates = 0;
+		double elapsed;
+		do
+		{
+			Step();
+			++numGravityUpdates;
+			elapsed = TimingManager::GetTime() - start;
+		}
+		while (elapsed < budget);
 
-			// Calculate gravitational attraction
-			float force = (m_gravitationalConstant * meMass * other.m_mass) / distanceSq;
-
-			// Apply force to velocity of particle (accel = force / mass)
-			objectsVector.Normalise();
-
-			VectorType objectsVectorOther = objectsVector;
-
-			float accelMe = force / meMass;
-			float accelOther = force / other.m_mass;
+		double ms = elapsed * 1000. / numGravityUpdates;
+		m_msPerStep = m_msPerStep * 0.9 + ms * 0.1;
+	}
 
-			scoped_lock lock2(mutexes[p]);
+	// Achieved steps per second, over half a second or so
+	const double now = TimingManager::GetTime();
+	if (now - m_stepRateStartTime >= 0.5)
+	{
+		m_stepsPerSecond = (m_stepCount - m_stepRateStartCount) / (now - m_stepRateStartTime);
+		m_stepRateStartTime = now;
+		m_stepRateStartCount = m_stepCount;
+	}
 
-			objectsVector.SetLength(accelMe);
-			objectsVectorOther.SetLength(accelOther);
+	PublishSnapshot();
+}
 
-			me.AddToVel(objectsVector);
-			other.AddToVel(-objectsVectorOther);
+void Universe::PublishSnapshot()
+{
+	// The last recording task might still be reading what's about to become the write buffer
+	WaitForRecording();
+
+	// The write buffer is one of the three snapshots we've published before, assigning over it reuses its memory
+	Snapshot& snapshot = m_snapshots.GetWriteBuffer();
+	// Steps move particles around without keeping their slots up to date, this catches up once per update
+	UpdateParticleSlots();
+	snapshot.cameraFollow = m_cameraFollow;
+	snapshot.cameraFollowLocation = m_particleSlots.Get(snapshot.cameraFollow);
+
+	// Recordings are written from the snapshot and want the full precision
+	snapshot.compact = m_compactSnapshots && recordingMode != RecordingMode::Save;
+	if (snapshot.compact)
+	{
+		// Compact particles are in a different order, which the followed particle's location has to go through too
+		uint32_t& location = snapshot.cameraFollowLocation;
+		snapshot.compactParticles.Assign(m_particles, m_threadPool, m_compactScratch);
+		if (location != SlotMap::none && !(location & ballisticLocation))
+			location = m_compactScratch.GetCompactIndex(location);
+		snapshot.compactBallisticParticles.Assign(m_ballisticParticles, m_threadPool, m_compactScratch);
+		if (location != SlotMap::none && (location & ballisticLocation))
+			location = m_compactScratch.GetCompactIndex(location & ~ballisticLocation) | ballisticLocation;
+		if (!snapshot.particles.empty())
+		{
+			snapshot.particles = {};
+			snapshot.ballisticParticles = {};
 		}
-	};
+	}
+	else
+	{
+		snapshot.particles.assign(m_particles.begin(), m_particles.end());
+		snapshot.ballisticParticles.assign(m_ballisticParticles.begin(), m_ballisticParticles.end());
+		snapshot.compactParticles.clear();
+		snapshot.compactBallisticParticles.clear();
+	}
+	snapshot.stepCount = m_stepCount;
+	snapshot.msPerStep = m_msPerStep;
+
+	snapshot.stepsPerSecond = m_stepsPerSecond;
+	snapshot.publishTime = TimingManager::GetTime();
+	snapshot.simulationTime = m_simulationTime;
+	snapshot.averageStepsBetweenRebuilds = m_neighbourLists.averageStepsBetweenRebuilds;
+	snapshot.neighbourListRebuilds = m_neighbourLists.rebuilds;
+	snapshot.nearPairCount = m_neighbourLists.nearPairCount;
+	snapshot.mergeCandidateCount = m_neighbourLists.mergeCandidates.size();
+	snapshot.coarseningStats = m_coarseningStats;
+	snapshot.subCycledCount = m_subCycledCount;
+	snapshot.skippedKickCount = m_skippedKickCount;
+
+	// FNV-1a over the particles' state, so two deterministic runs can be compared at a glance from the HUD
+	snapshot.stateHash = 0;
+	if (m_deterministic)
+	{
+		unsigned long long hash = 14695981039346656037ull;
+		auto hashBytes = [&hash](void const* data, size_t size)
+		{
+			for (size_t i = 0; i < size; ++i)
+				hash = (hash ^ static_cast<unsigned char const*>(data)[i]) * 1099511628211ull;
+		};
+		for (auto const* particles : { &m_particles, &m_ballisticParticles })
+		{
+			for (auto const& p : *particles)
+			{
+				hashBytes(&p.m_pos, sizeof(p.m_pos));
+				hashBytes(&p.m_vel, sizeof(p.m_vel));
+				hashBytes(&p.m_mass, sizeof(p.m_mass));
+			}
+		}
+		snapshot.stateHash = hash;
+	}
 
-	vector<future<void>> futures;
+	snapshot.stageMs.resize(m_stageMs.size());
+	for (size_t i = 0; i < m_stageMs.size(); ++i)
+		snapshot.stageMs[i] = { m_stepGraph.GetName(static_cast<TaskGraph::TaskId>(i)), m_stageMs[i] };
 
-	for (int i = 0; i < count - 1; i++)
-#if ASYNC_POLICY_DEFAULT
-		futures.push_back(std::async(execute, i));
-#else
-		futures.push_back(std::async(asyncPolicy, execute, i));
-#endif
+	// The recording is written from the snapshot on its own worker, so it overlaps the next update's steps. Nothing
+	// writes to the snapshot until the next PublishSnapshot, which waits for it. It can't go on m_threadPool, where
+	// anything waiting in a step could pick it up and hold the step up until the file's written.
+	if (recordingMode == RecordingMode::Save)
+	{
+		m_recordingInProgress = true;
+		m_recordingSnapshot = &snapshot;
+		m_recordingThreadPool.Submit([](void* _universe, size_t)
+			{
+				auto& universe = *static_cast<Universe*>(_universe);
+				universe.WriteRecording(*universe.m_recordingSnapshot);
+				universe.m_recordingInProgress = false;
+			}, this);
+	}
 
-	// Await all
-	for (size_t i = 0; i < futures.size(); ++i)
-		futures[i].wait();
+	m_snapshots.Publish();
+}
 
-	// Priority queue because we are deleting based on index
-	// We want to delete high indicies first so as not to invalidate lower indicies
-	priority_queue<size_t> deleteQueue;
+void Universe::WriteRecording(Snapshot const& _snapshot)
+{
+	// Both tiers are recorded together, on playback everything goes into m_particles. Macro particles are
+	// recorded as they are, so a recording made with coarsening on shows what was actually simulated.
+	// Everything is packed into a buffer and written in one go rather than a field at a time. The layout is
+	// RecordingFormat's, whose header went at the start of the file when it was opened.
+	auto& buffer = m_recordingBuffer;
+	buffer.clear();
+	auto pack = [&buffer](auto const& data)
+	{
+		auto bytes = reinterpret_cast<const char*>(&data);
+		buffer.insert(buffer.end(), bytes, bytes + sizeof(data));
+	};
 
-	for (auto& set : mergeSets)
+	pack(_snapshot.particles.size() + _snapshot.ballisticParticles.size());
+	for (auto const* particles : { &_snapshot.particles, &_snapshot.ballisticParticles })
 	{
-		auto i = set.cbegin();
-		//argDebugf("Merge set: " + ToString(set) + " into %d", *i);
-		Particle& p = m_particles[*i];
-		while (++i != set.cend())
+		for (auto const& p : *particles)
 		{
-			//argDebugf("merging %d", *i);
-			p.Merge(m_particles[*i]);
-			deleteQueue.push(*i);
+			pack(p.m_mass);
+			pack(p.m_pos.x);
+			pack(p.m_pos.y);
+			pack(p.m_vel.x);
+			pack(p.m_vel.y);
+			pack(p.GetColour().r);
+			pack(p.GetColour().g);
+			pack(p.GetColour().b);
+			pack(p.m_id);
 		}
 	}
 
-	// now delete old particles
-	while (!deleteQueue.empty())
+	if (!outputFile.is_open())
+		throw std::runtime_error("File not open for writing");
+	outputFile.write(buffer.data(), buffer.size());
+}
+
+void Universe::WaitForRecording()
+{
+	while (m_recordingInProgress)
+		if (!m_recordingThreadPool.RunPendingJob())
+			this_thread::yield();
+}
+
+void Universe::QueueCommand(std::function<void()> _command)
+{
+	scoped_lock lock(m_commandMutex);
+	m_commands.push_back(move(_command));
+}
+
+void Universe::RunWithSimulationPaused(std::function<void()> const& _function)
+{
+	// Waits for the current update to finish, and stops the next one starting until we're done
+	++m_pauseRequests;
 	{
-		//argDebugf("deleting %d", deleteQueue.top());
-		m_particles.erase(m_particles.begin() + deleteQueue.top());
-		deleteQueue.pop();
+		scoped_lock lock(m_simulationMutex);
+		_function();
 	}
+	--m_pauseRequests;
+	m_simulationCondition.notify_all();
 }
 
-void Universe::AdvanceGravityGridBasedMode()
+void Universe::Step()
 {
-	// Check every other particle and for each one, adjust my velocity
-	// according to the gravitational attraction.
+	// The step is a graph of tasks rather than a strict sequence, so stages which don't depend on each other overlap
+	// (the ballistic tier doesn't need anything from the interacting particles' gravity, for example). It's built
+	// once and run every step, see BuildStepGraph.
+	if (m_stepGraph.GetNumTasks() == 0)
+		BuildStepGraph();
+
+	// Nothing from the last step's arenas is still in use, and none of the threads are doing anything. The last
+	// update's recording job might still be going, but on m_recordingThreadPool's worker, which has no arena.
+	Arena::ResetThreadArenas();
+
+#ifdef _DEBUG
+	const size_t allocationsBefore = AllocationCounter::GetCount();
+	const StepShape shapeBefore = GetStepShape();
+#endif
 
-	// Gravitational equation:
-	// Force = (GMm / r^2)
-	// Where G is the universal gravitational constant
-	// M and m are the masses of the two objects
-	// r is the distance between the two objects
+	m_stepGraph.Run(m_threadPool);
+
+#ifdef _DEBUG
+	// Once things have settled down a step shouldn't touch the heap at all, everything step local comes from the
+	// arenas and everything kept between steps is already big enough. Anything which changes the particle count,
+	// rebuilds the neighbour lists, coarsens or refines something or changes the mode or mesh can legitimately grow
+	// something, so only check when the last two steps were the same shape as this one.
+	const StepShape shapeAfter = GetStepShape();
+	const bool steadyState = shapeBefore == shapeAfter && shapeBefore == m_lastStepShape;
+	assert(!steadyState || AllocationCounter::GetCount() == allocationsBefore);
+	m_lastStepShape = shapeAfter;
+#endif
 
-	// Merging particles: when a collision is detected, we make a note that we will merge the other particle into
-	// the current particle at the end of the frame. If the current particle collides with multiple other particles
-	// during the same frame, they'll all be added to the same merge set.
-	// Used to reference the particles by index but do it by pointer because we don't know the other
-	// particle's index in m_particles when we find it in a grid square
-	vector<unordered_set<Particle*>> mergeSets;
+	// Per stage timing for the HUD
+	m_stageMs.resize(m_stepGraph.GetNumTasks(), 0.);
+	for (size_t i = 0; i < m_stageMs.size(); ++i)
+		m_stageMs[i] = m_stageMs[i] * 0.9 + m_stepGraph.GetMs(static_cast<TaskGraph::TaskId>(i)) * 0.1;
+}
 
-	mutex mergeMutex;
+#ifdef _DEBUG
+Universe::StepShape Universe::GetStepShape() const
+{
+	return { m_particles.size(), m_ballisticParticles.size(), m_neighbourLists.rebuilds, m_coarseningChanges, m_gravityMode.load(),
+		m_deterministic.load(), m_particleMesh.GetRowsCols(), m_neighbourLists.gridRowsCols };
+}
+#endif
 
-	const size_t count = m_particles.size();
-	const int gridRowsCols = m_gridRowsCols;
+void Universe::BuildStepGraph()
+{
+	// Cache sizes to avoid having to call GetSize (with slow logarithm calls) multiple times per particle
+	// 10k particles in normal mode, with only a single log, update = 170ms
+	// with two logs, update = 203ms
+	// with caching sizes, update = 154ms
+	auto sizes = m_stepGraph.Add("sizes", [this]
+		{
+			const float sizeLogBase = m_sizeLogBase;
+			m_sizes.resize(m_particles.size());
+			ParallelForParticles([&](size_t begin, size_t end)
+				{
+					// Macro particles never merge, and their size is that of all their constituents merged together,
+					// so nearby particles would lose their gravity with them to the overlap check without ever merging.
+					// They count as points instead.
+					for (size_t i = begin; i < end; ++i)
+						m_sizes[i] = m_particles[i].IsMacro() ? 0.f : m_particles[i].GetSize(sizeLogBase);
+				});
+		});
 
-	// Get grid extents
-	double minX, maxX, minY, maxY, gridW, gridH, stepX, stepY;
-	GetGridExtents(m_particles, minX, maxX, minY, maxY, gridW, gridH, stepX, stepY);
+	auto kicks = m_stepGraph.Add("kicks", [this] { UpdateKickIntervals(); });
 
-	auto particleGridPos = [&](Particle const& p)
-	{
-		// Count a particle off the bottom/right as being in the bottom/right square
+	auto lists = m_stepGraph.Add("lists", [this] { UpdateNeighbourLists(); }, { sizes });
+
+	// Update velocity of each particle
+	auto gravity = m_stepGraph.Add("gravity", [this]
+		{
+			switch (m_gravityMode)
+			{
+				case GravityMode::Normal:
+					if (m_deterministic)
+						AdvanceGravityNormalModeDeterministic();
+					else
+						AdvanceGravityNormalMode();
+					break;
+				case GravityMode::GridBased:
+					if (m_deterministic)
+						AdvanceGravityGridBasedModeDeterministic();
+					else
+						AdvanceGravityGridBasedMode();
+					break;
+				case GravityMode::ParticleMesh:
+					AdvanceGravityParticleMeshMode();
+					break;
+			}
+		}, { kicks, lists });
+
+	// Ballistic particles only need the system's monopole from the end of the last step, so they're done alongside
+	// everything else
+	auto ballistic = m_stepGraph.Add("ballistic", [this]
+		{
+			AdvanceBallisticParticles();
+			const double dt = m_timeStep;
+			for (auto& p : m_ballisticParticles)
+				p.SetPos(p.GetPos() + p.GetVel() * dt);
+		});
+
+	// Merges are found separately from the gravity update, by sweeping each particle along its motion for this step
+	auto collisions = m_stepGraph.Add("collisions", [this] { DetectCollisions(); }, { gravity });
+
+	// Now apply the velocity of each particle to its position
+	auto integrate = m_stepGraph.Add("integrate", [this]
+		{
+			const double dt = m_timeStep;
+			ParallelForParticles([&](size_t begin, size_t end)
+				{
+					for (size_t i = begin; i < end; ++i)
+						m_particles[i].SetPos(m_particles[i].GetPos() + m_particles[i].GetVel() * dt);
+				});
+		}, { collisions });
+
+	auto tier = m_stepGraph.Add("tier", [this]
+		{
+			m_simulationTime += m_timeStep;
+			UpdateBallisticTier();
+		}, { integrate, ballistic });
+
+	m_stepGraph.Add("coarsening", [this]
+		{
+			if (++m_stepCount % coarseningInterval == 0)
+				UpdateCoarsening();
+		}, { tier });
+}
+
+void Universe::UpdateKickIntervals()
+{
+	// View fidelity mode. Particles in or near the view get a gravity kick every step, further out they're sub-cycled,
+	// only getting a kick every few steps, multiplied up to cover the steps in between. Pairs where neither particle
+	// is due a kick are skipped, which is where the saving comes from. A pair where only one is due a kick only
+	// affects that one, so momentum isn't exactly conserved between the regions.
+	const size_t count = m_particles.size();
+	m_kickScales.resize(count);
+	m_subCycledCount = 0;
+	m_skippedKickCount = 0;
+
+	if (!m_useViewFidelity)
+	{
+		for (auto& p : m_particles)
+			p.m_kickInterval = 1;
+		fill(m_kickScales.begin(), m_kickScales.end(), 1.f);
+		return;
+	}
+
+	// Particle::m_kickInterval is 8 bits
+	int maxInterval = 1;
+	while (maxInterval * 2 <= m_fidelityMaxInterval && maxInterval < (1 << 7))
+		maxInterval *= 2;
+
+	// Intervals are powers of 2 and a particle gets its kick on steps which are a multiple of its interval, so all
+	// the sub-cycled particles line up and more pairs are skipped than if they were staggered. A particle can only
+	// change interval when it gets a kick, and only to one which divides the current step.
+	const unsigned long long step = m_stepCount;
+	const int alignment = step == 0 ? maxInterval : (int)min<unsigned long long>(step & (~step + 1), maxInterval);
+
+	const VectorType cameraPos = m_simulationView.cameraPos;
+	const double viewportWidth = m_simulationView.viewportWidth;
+	const double halfW = viewportWidth / 2.;
+	const double halfH = viewportWidth / m_worldAspectRatio / 2.;
+	const double margin = viewportWidth * m_fidelityMargin;
+	const double band = max(viewportWidth * m_fidelityBand, 1.);
+	const double maxLevel = log2(maxInterval);
+
+	for (size_t i = 0; i < count; ++i)
+	{
+		Particle& p = m_particles[i];
+		if (step % p.m_kickInterval == 0)
+		{
+			// Distance outside the expanded view rectangle. Across the transition band the interval goes up a power
+			// of 2 at a time, rather than jumping straight from every step to the maximum.
+			double dx = max(abs(p.m_pos.x - cameraPos.x) - halfW, 0.);
+			double dy = max(abs(p.m_pos.y - cameraPos.y) - halfH, 0.);
+			double outside = sqrt(dx * dx + dy * dy) - margin;
+			int level = outside <= 0. ? 0 : (int)ceil(min(outside / band, 1.) * maxLevel);
+			p.m_kickInterval = static_cast<uint8_t>(min(1 << level, alignment));
+			m_kickScales[i] = (float)p.m_kickInterval;
+		}
+		else
+		{
+			m_kickScales[i] = 0.f;
+			++m_skippedKickCount;
+		}
+
+		if (p.m_kickInterval > 1)
+			++m_subCycledCount;
+	}
+}
+
+void Universe::AdvanceGravityNormalMode()
+{
+	// Check every other particle and for each one, adjust my velocity
+	// according to the gravitational attraction.
+
+	// Gravitational equation:
+	// Force = (GMm / r^2)
+	// Where G is the universal gravitational constant
+	// M and m are the masses of the two objects
+	// r is the distance between the two objects
+
+	// Collisions are no longer detected here, see DetectCollisions
+
+	size_t count = m_particles.size();
+
+	// Step local containers come from this thread's arena, see Arena.h
+	Arena& arena = Arena::GetThreadArena();
+
+	ArenaVector<mutex> mutexes(count, arena);
+
+	// G * dt, so the results below are velocity changes for this step
+	const double gDt = m_gravitationalConstant * m_timeStep;
+
+	vector<float> const& sizes = m_sizes;
+	vector<float> const& kickScales = m_kickScales;
+
+	// Particles which aren't due a kick this step (see UpdateKickIntervals) only need to go through the ones which are
+	ArenaVector<int> kickedIndices(arena);
+	if (m_skippedKickCount > 0)
+		for (int i = 0; i < count; ++i)
+			if (kickScales[i] > 0.f)
+				kickedIndices.push_back(i);
+
+	auto execute = [&](int i)
+	{
+		Particle& me = m_particles[i];
+		float const meMass = me.m_mass;
+		float size = sizes[i];
+		float const meKick = kickScales[i];
+
+		scoped_lock lock1(mutexes[i]);
+
+		auto interact = [&](int p)
+		{
+			Particle& other = m_particles[p];
+
+			// Get vector between objects
+			VectorType objectsVector = other.GetPos() - me.GetPos();
+
+			float distanceSq = objectsVector.MagSq();
+
+			// Don't do gravitational force with a particle we overlap, we're about to merge with it
+			float combinedRadius = size + sizes[p];
+			if (distanceSq < combinedRadius * combinedRadius)
+				return;
+
+			// Calculate gravitational attraction
+			float force = (gDt * meMass * other.m_mass) / distanceSq;
+
+			// Apply force to velocity of particle (accel = force / mass)
+			objectsVector.Normalise();
+
+			VectorType objectsVectorOther = objectsVector;
+
+			float accelMe = force * meKick / meMass;
+			float accelOther = force * kickScales[p] / other.m_mass;
+
+			scoped_lock lock2(mutexes[p]);
+
+			objectsVector.SetLength(accelMe);
+			objectsVectorOther.SetLength(accelOther);
+
+			me.AddToVel(objectsVector);
+			other.AddToVel(-objectsVectorOther);
+		};
+
+		if (meKick > 0.f)
+		{
+			for (int p = i + 1; p < count; p++)
+				interact(p);
+		}
+		else
+		{
+			for (auto it = upper_bound(kickedIndices.begin(), kickedIndices.end(), i); it != kickedIndices.end(); ++it)
+				interact(*it);
+		}
+	};
+
+	// Particle i does count - 1 - i pairs, so do the first and last together and so on to keep the work even
+	m_threadPool.ParallelFor((count + 1) / 2, [&](size_t begin, size_t end)
+		{
+			for (size_t i = begin; i < end; ++i)
+			{
+				execute((int)i);
+				if (count - 1 - i != i)
+					execute((int)(count - 1 - i));
+			}
+		});
+}
+
+// Runs _tile(a, b) for each pair of blocks a <= b out of _numBlocks, a round at a time, where no two tiles in a round
+// share a block. Tiles in a round run in parallel and can update both blocks' particles without locking, and since
+// each particle's velocity changes are added up round by round in a fixed order, the result is the same however
+// many threads there are. Rounds come from the circle method for round robin tournaments, plus one round of each
+// block with itself.
+template<typename Tile>
+static void RunTileRounds(ThreadPool& _threadPool, int _numBlocks, Tile&& _tile)
+{
+	const int n = _numBlocks + (_numBlocks & 1);	// the circle method needs an even number, the extra block is empty
+	for (int round = 0; round < n; ++round)
+	{
+		const size_t numTiles = round == 0 ? _numBlocks : n / 2;
+		_threadPool.ParallelFor(numTiles, [&](size_t begin, size_t end)
+			{
+				for (size_t k = begin; k < end; ++k)
+				{
+					if (round == 0)
+					{
+						_tile((int)k, (int)k);
+						continue;
+					}
+
+					// Block n - 1 stays put and the others rotate around it
+					const int r = round - 1;
+					int a = k == 0 ? n - 1 : (r + (int)k) % (n - 1);
+					int b = k == 0 ? r : (r - (int)k + n - 1) % (n - 1);
+					if (a > b)
+						swap(a, b);
+					if (b < _numBlocks)
+						_tile(a, b);
+				}
+			}, 1);
+	}
+}
+
+void Universe::AdvanceGravityNormalModeDeterministic()
+{
+	// Same as normal mode, but pairs are done a tile (block of particles against block of particles) at a time, see
+	// RunTileRounds. The blocks only depend on the particle count, not the number of threads.
+	const size_t count = m_particles.size();
+	if (count == 0)
+		return;
+
+	const int numBlocks = (int)clamp<size_t>(count / deterministicBlockSize, 1, deterministicMaxBlocks);
+	auto blockStart = [&](int b) { return count * b / numBlocks; };
+
+	// G * dt, so the results below are velocity changes for this step
+	const double gDt = m_gravitationalConstant * m_timeStep;
+
+	vector<float> const& sizes = m_sizes;
+	vector<float> const& kickScales = m_kickScales;
+
+	auto interact = [&](size_t i, size_t p)
+	{
+		// Neither particle is due a kick this step (see UpdateKickIntervals)
+		if (kickScales[i] == 0.f && kickScales[p] == 0.f)
+			return;
+
+		Particle& me = m_particles[i];
+		Particle& other = m_particles[p];
+
+		// Get vector between objects
+		VectorType objectsVector = other.GetPos() - me.GetPos();
+
+		float distanceSq = objectsVector.MagSq();
+
+		// Don't do gravitational force with a particle we overlap, we're about to merge with it
+		float combinedRadius = sizes[i] + sizes[p];
+		if (distanceSq < combinedRadius * combinedRadius)
+			return;
+
+		// Calculate gravitational attraction
+		float force = (gDt * me.m_mass * other.m_mass) / distanceSq;
+
+		// Apply force to velocity of particle (accel = force / mass)
+		objectsVector.Normalise();
+
+		VectorType objectsVectorOther = objectsVector;
+
+		objectsVector.SetLength(force * kickScales[i] / me.m_mass);
+		objectsVectorOther.SetLength(force * kickScales[p] / other.m_mass);
+
+		me.AddToVel(objectsVector);
+		other.AddToVel(-objectsVectorOther);
+	};
+
+	RunTileRounds(m_threadPool, numBlocks, [&](int a, int b)
+		{
+			const size_t endA = blockStart(a + 1);
+			for (size_t i = blockStart(a); i < endA; ++i)
+				for (size_t p = (a == b ? i + 1 : blockStart(b)); p < blockStart(b + 1); ++p)
+					interact(i, p);
+		});
+}
+
+void Universe::AdvanceGravityGridBasedMode()
+{
+	// Check every other particle and for each one, adjust my velocity
+	// according to the gravitational attraction.
+
+	// Gravitational equation:
+	// Force = (GMm / r^2)
+	// Where G is the universal gravitational constant
+	// M and m are the masses of the two objects
+	// r is the distance between the two objects
+
+	// Collisions are no longer detected here, see DetectCollisions
+
+#ifndef GRID_BASED_MODE_NEW
+	const size_t count = m_particles.size();
+	const int gridRowsCols = m_gridRowsCols;
+
+	// Get grid extents
+	double minX, maxX, minY, maxY, gridW, gridH, stepX, stepY;
+	GetGridExtents(m_particles, minX, maxX, minY, maxY, gridW, gridH, stepX, stepY);
+
+	auto particleGridPos = [&](Particle const& p)
+	{
+		// Count a particle off the bottom/right as being in the bottom/right square
 		return pair<int, int>{ min(static_cast<int>((p.m_pos.x - minX) / stepX), gridRowsCols - 1),
 							   min(static_cast<int>((p.m_pos.y - minY) / stepY), gridRowsCols - 1) };
 	};
@@ -607,24 +1343,13 @@ void Universe::AdvanceGravityGridBasedMode()
 	for (GridSquare* p : nonEmptyGridSquaresSet)
 		nonEmptyGridSquares.push_back(p);
 
-	const float sizeLogBase = m_sizeLogBase;
-
-	// Cache sizes to avoid having to call GetSize (with slow logarithm calls) multiple times per particle
-	// 10k particles, with only a single log, update = 87ms
-	// with two logs, update = 103ms
-	// with caching sizes, update = 95ms
-	// Unlike normal mode, we have to use a map (much slower than the vector) for some particles because we
-	// don't always know the particle index
-	// No longer need to use sizesMap since grid squares track particle indices
-	vector<float> sizes(count);
-	//unordered_map<Particle*, float> sizesMap;
-	for (size_t i = 0; i < m_particles.size(); ++i)
-	{
-		//sizesMap[&m_particles[i]] =
-		sizes[i] = m_particles[i].GetSize(sizeLogBase);
-	}
+	// Sizes are cached in Step. Unlike normal mode, we used to have to use a map (much slower than the vector) for
+	// some particles because we didn't always know the particle index, but grid squares now track particle indices
+	vector<float> const& sizes = m_sizes;
 
-#ifndef GRID_BASED_MODE_NEW
+	// G * dt, so the results below are velocity changes for this step. Scaled per particle by its kick interval, this
+	// mode only does one-way interactions so particles which aren't due a kick can be skipped altogether.
+	const double gDt = m_gravitationalConstant * m_timeStep;
 	// Old grid based mode
 	// Run a thread for each particle
 
@@ -634,6 +1359,10 @@ void Universe::AdvanceGravityGridBasedMode()
 
 	auto execute = [&](int i)
 		{
+			float const meKick = m_kickScales[i];
+			if (meKick == 0.f)
+				return;
+
 			Particle& me = m_particles[i];
 			float const meMass = me.m_mass;
 			float size = sizes[i];
@@ -681,48 +1410,19 @@ void Universe::AdvanceGravityGridBasedMode()
 						VectorType objectsVector = other.GetPos() - me.GetPos();
 						float distance = objectsVector.Mag();
 
-#if 1
+						// Don't do gravitational force with another particle if we're going to merge with it
 						if (distance < size + sizes[index2])
-						{
-							scoped_lock mergeLock(mergeMutex);
-
-							//argDebugf("Merge %d,%d", i, p);
-
-							// Find if there's an existing merge set which contains at least one of the two particles,
-							// if so merge particles into that existing merge set
-							bool mergedIntoExistingSet = false;
-							for (auto& set : mergeSets)
-							{
-								bool foundI = set.find(&m_particles[i]) != set.end();
-								bool foundP = set.find(&other) != set.end();
-								if (foundI || foundP)
-								{
-									//argDebugf("Found in existing set: i:%d p:%d", foundI, foundP);
-									set.insert(&m_particles[i]);
-									set.insert(&other);
-									mergedIntoExistingSet = true;
-									break;
-								}
-							}
-
-							// Otherwise create a new merge set
-							if (!mergedIntoExistingSet)
-								mergeSets.push_back({ &m_particles[i], &other });
-
-							// Don't do gravitational force with another particle if we're going to merge with it
 							continue;
-						}
-#endif
 
 						// Calculate gravitational attraction
-						float force = (m_gravitationalConstant * meMass * other.m_mass) / (distance * distance);
+						float force = (gDt * meMass * other.m_mass) / (distance * distance);
 
 						// Apply force to velocity of particle (accel = force / mass)
 						objectsVector.Normalise();
 
 						VectorType objectsVectorOther = objectsVector;
 
-						float accelMe = force / meMass;
+						float accelMe = force * meKick / meMass;
 						float accelOther = force / other.m_mass;
 
 						// This lock was to allow for two-way particle interations without having to do the calculations
@@ -744,321 +1444,1291 @@ void Universe::AdvanceGravityGridBasedMode()
 					float distance = vec.Mag();
 
 					// Calculate gravitational attraction
-					float force = (m_gravitationalConstant * meMass * grid[otherGY][otherGX].mass) / (distance * distance);
+					float force = (gDt * meMass * grid[otherGY][otherGX].mass) / (distance * distance);
 
 					// Apply force to velocity of particle (accel = force / mass)
 					vec.Normalise();
 
-					float accelMe = force / meMass;
+					float accelMe = force * meKick / meMass;
 					vec.SetLength(accelMe);
 					me.AddToVel(vec);
 				}
 			}
 		};
 
-	vector<future<void>> futures;
-
-	for (int i = 0; i < count; i++)
-#if ASYNC_POLICY_DEFAULT
-		futures.push_back(std::async(execute, i));
-#else
-		futures.push_back(std::async(asyncPolicy, execute, i));
-#endif
+	// Each particle only changes its own velocity, so they can be shared out between the workers like anything else
+	ParallelForParticles([&](size_t begin, size_t end)
+		{
+			for (size_t i = begin; i < end; ++i)
+				execute((int)i);
+		});
 #else
 	// New approach
-	// Run a thread for each grid square
+	// Run a thread for each non-empty grid square
 	// Each grid square runs the traditional simulation for particles in itself, including two-way interactions
 	// It also runs two way interactions with nearby grid squares with a higher index
 	// And for each particle we apply force for distant grid squares
-	vector<future<void>> futures;
+	// Square membership and which squares are near/far come from m_neighbourLists, which are only rebuilt when
+	// particles have moved far enough (see UpdateNeighbourLists) rather than being recalculated every step
+	auto const& lists = m_neighbourLists;
+	assert(lists.valid && lists.hasGrid);
+
+	const size_t count = m_particles.size();
+
+	vector<float> const& sizes = m_sizes;
+	vector<float> const& kickScales = m_kickScales;
+
+	// G * dt, so the results below are velocity changes for this step
+	const double gDt = m_gravitationalConstant * m_timeStep;
+
+	// Membership is frozen between rebuilds so particles may have drifted a little outside their square, use each
+	// square's centre of mass rather than its geometric centre for the far field
+	Arena& arena = Arena::GetThreadArena();
+	const size_t numSquares = lists.squareParticles.size();
+	ArenaVector<float> squareMass(numSquares, 0.f, arena);
+	ArenaVector<VectorType> squareCentre(numSquares, arena);
+	for (int s : lists.nonEmptySquares)
+	{
+		VectorType weightedPos;
+		double mass = 0.;
+		for (size_t i : lists.squareParticles[s])
+		{
+			weightedPos += m_particles[i].GetPos() * (double)m_particles[i].GetMass();
+			mass += m_particles[i].GetMass();
+		}
+		squareMass[s] = (float)mass;
+		squareCentre[s] = mass > 0. ? weightedPos / mass : weightedPos;
+	}
+
+	ArenaVector<mutex> mutexes(count, arena);
+
+	auto executeGridSquare = [&](int square)
+		{
+			auto const& members = lists.squareParticles[square];
+
+			for (size_t i = 0; i < members.size(); ++i)
+			{
+				const auto index1 = members[i];
+				Particle& me = m_particles[index1];
+				const float meMass = me.m_mass;
+				const float size = sizes[index1];
+				const float meKick = kickScales[index1];
+
+				VectorType accumulatedVelChange;
+
+				scoped_lock lock1(mutexes[index1]);
+
+				auto interact = [&](size_t index2)
+				{
+					// Neither particle is due a kick this step (see UpdateKickIntervals)
+					if (meKick == 0.f && kickScales[index2] == 0.f)
+						return;
+
+					Particle& other = m_particles[index2];
+
+					// Get vector between objects
+					VectorType objectsVector = other.m_pos - me.m_pos;
+
+					float distanceSq = objectsVector.MagSq();
+					float combinedRadius = size + sizes[index2];
+
+					// Don't do gravitational force with another particle if we're going to merge with it
+					if (distanceSq < combinedRadius * combinedRadius)
+						return;
+
+					// Calculate gravitational attraction
+					float force = (gDt * meMass * other.m_mass) / distanceSq;
+
+					// Apply force to velocity of particle (accel = force / mass)
+					objectsVector.Normalise();
+
+					VectorType objectsVectorOther = objectsVector;
+
+					float accelMe = force * meKick / meMass;
+					float accelOther = force * kickScales[index2] / other.m_mass;
+
+					objectsVector.SetLength(accelMe);
+					accumulatedVelChange += objectsVector;
+
+					// Apply interaction to other particle
+					scoped_lock lock2(mutexes[index2]);
+
+					objectsVectorOther.SetLength(accelOther);
+					other.AddToVel(-objectsVectorOther);
+				};
+
+				// Go through particles in same square
+				for (size_t p = i + 1; p < members.size(); ++p)
+					interact(members[p]);
+
+				// Go through particles in nearby squares (only squares with higher index, so each pair is done once)
+				// Is there any benefit in going through nearby squares rather than just having bigger grid squares with
+				// no buffer zone? Well, yes, if two particles overlap in different squares.
+				// Also force vector will be super inaccurate for neighbouring grid squares
+				for (int otherSquare : lists.nearSquares[square])
+					for (size_t index2 : lists.squareParticles[otherSquare])
+						interact(index2);
+
+				// Gravitational attraction from this particle to whole distant grid squares
+				// Sub-cycled particles skip the far field on steps they're not due a kick
+				if (meKick > 0.f)
+				{
+					for (int otherSquare : lists.farSquares[square])
+					{
+						VectorType vec = squareCentre[otherSquare] - me.GetPos();
+
+						float distanceSq = vec.MagSq();
+
+						vec.Normalise();
+
+						// Calculate gravitational attraction
+						float force = (gDt * meMass * squareMass[otherSquare]) / distanceSq;
+
+						float accelMe = force * meKick / meMass;
+						vec.SetLength(accelMe);
+						accumulatedVelChange += vec;
+					}
+				}
+
+				// Add accumulated vel change to vel
+				me.AddToVel(accumulatedVelChange);
+			}
+		};
+
+	// Squares have very different numbers of particles, so they're handed out one at a time
+	m_threadPool.ParallelFor(lists.nonEmptySquares.size(), [&](size_t begin, size_t end)
+		{
+			for (size_t s = begin; s < end; ++s)
+				executeGridSquare(lists.nonEmptySquares[s]);
+		}, 1);
+
+#endif
+}
+
+void Universe::AdvanceGravityGridBasedModeDeterministic()
+{
+	// Same as the new grid based mode, but without the locks. Each square's own pairs and far field go first, all
+	// squares in parallel since each one only touches its own particles. Then the near square pairs are done in
+	// rounds, one per offset between the two squares and parity of the first square's position along the offset.
+	// No square is in two pairs in the same round, so the pairs in a round run in parallel without locking, and
+	// every particle gets its velocity changes in the same order however the work is split between threads.
+	auto const& lists = m_neighbourLists;
+	assert(lists.valid && lists.hasGrid);
+
+	const int gridRowsCols = lists.gridRowsCols;
+
+	vector<float> const& sizes = m_sizes;
+	vector<float> const& kickScales = m_kickScales;
+
+	// G * dt, so the results below are velocity changes for this step
+	const double gDt = m_gravitationalConstant * m_timeStep;
+
+	// Centre of mass of each square for the far field, see AdvanceGravityGridBasedMode
+	Arena& arena = Arena::GetThreadArena();
+	const size_t numSquares = lists.squareParticles.size();
+	ArenaVector<float> squareMass(numSquares, 0.f, arena);
+	ArenaVector<VectorType> squareCentre(numSquares, arena);
+	for (int s : lists.nonEmptySquares)
+	{
+		VectorType weightedPos;
+		double mass = 0.;
+		for (size_t i : lists.squareParticles[s])
+		{
+			weightedPos += m_particles[i].GetPos() * (double)m_particles[i].GetMass();
+			mass += m_particles[i].GetMass();
+		}
+		squareMass[s] = (float)mass;
+		squareCentre[s] = mass > 0. ? weightedPos / mass : weightedPos;
+	}
+
+	auto interact = [&](size_t index1, size_t index2)
+	{
+		// Neither particle is due a kick this step (see UpdateKickIntervals)
+		if (kickScales[index1] == 0.f && kickScales[index2] == 0.f)
+			return;
+
+		Particle& me = m_particles[index1];
+		Particle& other = m_particles[index2];
+
+		// Get vector between objects
+		VectorType objectsVector = other.m_pos - me.m_pos;
+
+		float distanceSq = objectsVector.MagSq();
+		float combinedRadius = sizes[index1] + sizes[index2];
+
+		// Don't do gravitational force with another particle if we're going to merge with it
+		if (distanceSq < combinedRadius * combinedRadius)
+			return;
+
+		// Calculate gravitational attraction
+		float force = (gDt * me.m_mass * other.m_mass) / distanceSq;
+
+		// Apply force to velocity of particle (accel = force / mass)
+		objectsVector.Normalise();
+
+		VectorType objectsVectorOther = objectsVector;
+
+		objectsVector.SetLength(force * kickScales[index1] / me.m_mass);
+		objectsVectorOther.SetLength(force * kickScales[index2] / other.m_mass);
+
+		me.AddToVel(objectsVector);
+		other.AddToVel(-objectsVectorOther);
+	};
+
+	m_threadPool.ParallelFor(lists.nonEmptySquares.size(), [&](size_t begin, size_t end)
+		{
+			for (size_t s = begin; s < end; ++s)
+			{
+				const int square = lists.nonEmptySquares[s];
+				auto const& members = lists.squareParticles[square];
+				for (size_t i = 0; i < members.size(); ++i)
+				{
+					const size_t index1 = members[i];
+
+					// Go through particles in same square
+					for (size_t p = i + 1; p < members.size(); ++p)
+						interact(index1, members[p]);
+
+					// Gravitational attraction from this particle to whole distant grid squares
+					Particle& me = m_particles[index1];
+					const float meKick = kickScales[index1];
+					if (meKick > 0.f)
+					{
+						VectorType accumulatedVelChange;
+						for (int otherSquare : lists.farSquares[square])
+						{
+							VectorType vec = squareCentre[otherSquare] - me.GetPos();
+							float distanceSq = vec.MagSq();
+							vec.Normalise();
+							float force = (gDt * me.m_mass * squareMass[otherSquare]) / distanceSq;
+							vec.SetLength(force * meKick / me.m_mass);
+							accumulatedVelChange += vec;
+						}
+						me.AddToVel(accumulatedVelChange);
+					}
+				}
+			}
+		});
+
+	// Near squares always have a higher index, so the offset is in the lower half plane (dy > 0, or dy == 0 and
+	// dx > 0). Squares a single offset apart have different parities along it, so a square can't be the first of
+	// one pair and the second of another in the same round.
+	struct NearPair
+	{
+		int round;
+		int square;
+		int otherSquare;
+	};
+	ArenaVector<NearPair> nearPairs(arena);
+	for (int square : lists.nonEmptySquares)
+	{
+		const int x = square % gridRowsCols, y = square / gridRowsCols;
+		for (int otherSquare : lists.nearSquares[square])
+		{
+			const int dx = otherSquare % gridRowsCols - x, dy = otherSquare / gridRowsCols - y;
+			const int parity = dx != 0 ? (x / abs(dx)) & 1 : (y / dy) & 1;
+			const int offset = dy * (2 * gridRowsCols - 1) + dx + gridRowsCols - 1;
+			nearPairs.push_back({ offset * 2 + parity, square, otherSquare });
+		}
+	}
+	// Not stable_sort, which allocates a buffer. Each square is the first of at most one pair per round so this is
+	// a total order anyway.
+	sort(nearPairs.begin(), nearPairs.end(), [](NearPair const& a, NearPair const& b)
+		{ return a.round != b.round ? a.round < b.round : a.square < b.square; });
+
+	for (size_t roundStart = 0; roundStart < nearPairs.size();)
+	{
+		size_t roundEnd = roundStart;
+		while (roundEnd < nearPairs.size() && nearPairs[roundEnd].round == nearPairs[roundStart].round)
+			++roundEnd;
+
+		m_threadPool.ParallelFor(roundEnd - roundStart, [&](size_t begin, size_t end)
+			{
+				for (size_t n = roundStart + begin; n < roundStart + end; ++n)
+					for (size_t index1 : lists.squareParticles[nearPairs[n].square])
+						for (size_t index2 : lists.squareParticles[nearPairs[n].otherSquare])
+							interact(index1, index2);
+			});
+
+		roundStart = roundEnd;
+	}
+}
+
+void Universe::AdvanceGravityParticleMeshMode()
+{
+	// Long range gravity comes from the mesh (see ParticleMesh.h), and the short range remainder is done directly for
+	// pairs within the cutoff. Both are one-way, each particle only changes its own velocity, so there's no locking.
+	const size_t count = m_particles.size();
+	if (count == 0)
+		return;
+
+	m_particleMesh.SetResolution(m_meshRowsCols, m_meshSplitCells);
+	m_particleMesh.Deposit(m_particles, m_deterministic);
+	m_particleMesh.Solve();
+
+	vector<float> const& sizes = m_sizes;
+	vector<float> const& kickScales = m_kickScales;
+
+	// G * dt, so the results below are velocity changes for this step
+	const double gDt = m_gravitationalConstant * m_timeStep;
+
+	// Cell list for the short range part, cells are the size of the cutoff so only neighbouring cells need checking.
+	// Particles are sorted by cell (counting sort) so each cell's particles are contiguous.
+	const double splitRadius = m_particleMesh.GetSplitRadius();
+	const double cutoff = splitRadius * particleMeshCutoff;
+	const VectorType origin = m_particleMesh.GetOrigin();
+	const int cellsPerSide = max(1, static_cast<int>(ceil(m_particleMesh.GetCellSize() * m_particleMesh.GetRowsCols() / cutoff)));
+
+	auto cellOf = [&](VectorType const& pos)
+	{
+		int cx = clamp(static_cast<int>((pos.x - origin.x) / cutoff), 0, cellsPerSide - 1);
+		int cy = clamp(static_cast<int>((pos.y - origin.y) / cutoff), 0, cellsPerSide - 1);
+		return cy * cellsPerSide + cx;
+	};
+
+	Arena& arena = Arena::GetThreadArena();
+	ArenaVector<int> particleCells(count, arena);
+	ArenaVector<size_t> cellStart(cellsPerSide * cellsPerSide + 1, 0, arena);
+	for (size_t i = 0; i < count; ++i)
+	{
+		particleCells[i] = cellOf(m_particles[i].GetPos());
+		++cellStart[particleCells[i] + 1];
+	}
+	partial_sum(cellStart.begin(), cellStart.end(), cellStart.begin());
+	ArenaVector<size_t> sorted(count, arena);
+	{
+		ArenaVector<size_t> next(cellStart.begin(), cellStart.end() - 1, arena);
+		for (size_t i = 0; i < count; ++i)
+			sorted[next[particleCells[i]]++] = i;
+	}
+
+	ParallelForParticles([&](size_t begin, size_t end)
+		{
+			for (size_t i = begin; i < end; ++i)
+			{
+				// Not due a kick this step (see UpdateKickIntervals)
+				const float meKick = kickScales[i];
+				if (meKick == 0.f)
+					continue;
+
+				Particle& me = m_particles[i];
+				const VectorType pos = me.GetPos();
+				const float size = sizes[i];
+
+				// Mesh force, per unit G
+				VectorType accel = m_particleMesh.Interpolate(pos);
+
+				// Short range correction
+				const int cell = particleCells[i];
+				const int cx = cell % cellsPerSide, cy = cell / cellsPerSide;
+				for (int y = max(cy - 1, 0); y <= min(cy + 1, cellsPerSide - 1); ++y)
+				{
+					for (int x = max(cx - 1, 0); x <= min(cx + 1, cellsPerSide - 1); ++x)
+					{
+						const int otherCell = y * cellsPerSide + x;
+						for (size_t s = cellStart[otherCell]; s < cellStart[otherCell + 1]; ++s)
+						{
+							const size_t index2 = sorted[s];
+							if (index2 == i)
+								continue;
+
+							VectorType objectsVector = m_particles[index2].GetPos() - pos;
+							double distanceSq = objectsVector.MagSq();
+							if (distanceSq >= cutoff * cutoff)
+								continue;
+
+							// Don't do gravitational force with a particle we overlap, we're about to merge with it
+							float combinedRadius = size + sizes[index2];
+							if (distanceSq < combinedRadius * combinedRadius)
+								continue;
+
+							double distance = sqrt(distanceSq);
+							double factor = ParticleMesh::ShortRangeForceFactor(distance, splitRadius);
+							accel += objectsVector * (m_particles[index2].GetMass() * factor / (distanceSq * distance));
+						}
+					}
+				}
+
+				me.AddToVel(accel * (gDt * meKick));
+			}
+		});
+}
+
+void Universe::UpdateNeighbourLists()
+{
+	auto& lists = m_neighbourLists;
+	const size_t count = m_particles.size();
+	const double skin = max(0.f, (float)m_neighbourListSkin);
+	const int gridRowsCols = m_gridRowsCols;
+	const int highAccuracyGridDistance = m_highAccuracyGridDistance;
+
+	bool rebuild = !lists.valid || lists.particleCount != count || lists.skin != skin
+		|| (m_gravityMode == GravityMode::GridBased && (!lists.hasGrid || lists.gridRowsCols != gridRowsCols || lists.highAccuracyGridDistance != highAccuracyGridDistance));
+
+	// Rebuild once any particle has moved more than half the skin, by then two particles could have closed the gap
+	// between them by a whole skin
+	if (!rebuild)
+	{
+		const double halfSkinSq = skin * skin * 0.25;
+		for (size_t i = 0; i < count; ++i)
+		{
+			if ((m_particles[i].GetPos() - lists.builtPositions[i]).MagSq() > halfSkinSq)
+			{
+				rebuild = true;
+				break;
+			}
+		}
+	}
+
+	if (!rebuild)
+	{
+		++lists.stepsSinceRebuild;
+		return;
+	}
+
+	++lists.rebuilds;
+	lists.averageStepsBetweenRebuilds = lists.averageStepsBetweenRebuilds * 0.9f + (lists.stepsSinceRebuild + 1) * 0.1f;
+	lists.stepsSinceRebuild = 0;
+
+	lists.valid = true;
+	lists.particleCount = count;
+	lists.skin = skin;
+	lists.builtPositions.resize(count);
+	for (size_t i = 0; i < count; ++i)
+		lists.builtPositions[i] = m_particles[i].GetPos();
+
+	// Merge candidates are pairs whose circles, each expanded by half the skin, overlap
+	lists.mergeCandidates.clear();
+	if (skin > 0.)
+	{
+		ArenaVector<AABB> boxes(count, Arena::GetThreadArena());
+		for (size_t i = 0; i < count; ++i)
+		{
+			VectorType pos = m_particles[i].GetPos();
+			double reach = fabs(m_sizes[i]) + skin * 0.5;
+			boxes[i] = { pos.x - reach, pos.x + reach, pos.y - reach, pos.y + reach };
+		}
+		SweepAndPrune(boxes, [&](size_t i, size_t j)
+			{
+				double reach = fabs(m_sizes[i]) + fabs(m_sizes[j]) + skin;
+				if ((m_particles[j].GetPos() - m_particles[i].GetPos()).MagSq() < reach * reach)
+					lists.mergeCandidates.emplace_back(min(i, j), max(i, j));
+			});
+	}
+
+	lists.hasGrid = m_gravityMode == GravityMode::GridBased;
+	if (!lists.hasGrid)
+		return;
+
+	lists.gridRowsCols = gridRowsCols;
+	lists.highAccuracyGridDistance = highAccuracyGridDistance;
+
+	// Get grid extents
+	double minX, maxX, minY, maxY, gridW, gridH, stepX, stepY;
+	GetGridExtents(m_particles, minX, maxX, minY, maxY, gridW, gridH, stepX, stepY);
+
+	// Assign each particle to a grid square
+	const int numSquares = gridRowsCols * gridRowsCols;
+	lists.squareParticles.resize(numSquares);
+	for (auto& square : lists.squareParticles)
+		square.clear();
+	for (size_t i = 0; i < count; ++i)
+	{
+		auto const& p = m_particles[i];
+		// Count a particle off the bottom/right as being in the bottom/right square
+		int gx = min(static_cast<int>((p.m_pos.x - minX) / stepX), gridRowsCols - 1);
+		int gy = min(static_cast<int>((p.m_pos.y - minY) / stepY), gridRowsCols - 1);
+		lists.squareParticles[gy * gridRowsCols + gx].push_back(i);
+	}
+
+	// Track which grid squares contain particles so we don't waste time checking particles against empty squares
+	lists.nonEmptySquares.clear();
+	for (int square = 0; square < numSquares; ++square)
+		if (!lists.squareParticles[square].empty())
+			lists.nonEmptySquares.push_back(square);
+
+	// If another square is within this many grid squares, go through its particles individually, otherwise it's
+	// treated as a single mass
+	lists.nearSquares.resize(numSquares);
+	lists.farSquares.resize(numSquares);
+	lists.nearPairCount = 0;
+	for (int square : lists.nonEmptySquares)
+	{
+		lists.nearSquares[square].clear();
+		lists.farSquares[square].clear();
+
+		const size_t n = lists.squareParticles[square].size();
+		lists.nearPairCount += n * (n - 1) / 2;
+
+		for (int otherSquare : lists.nonEmptySquares)
+		{
+			if (otherSquare == square)
+				continue;
+
+			int gridDistance = abs(square % gridRowsCols - otherSquare % gridRowsCols) + abs(square / gridRowsCols - otherSquare / gridRowsCols);
+			if (gridDistance <= highAccuracyGridDistance)
+			{
+				// Don't do two-way interactions with other grid squares with lower index
+				if (otherSquare > square)
+				{
+					lists.nearSquares[square].push_back(otherSquare);
+					lists.nearPairCount += n * lists.squareParticles[otherSquare].size();
+				}
+			}
+			else
+				lists.farSquares[square].push_back(otherSquare);
+		}
+	}
+}
+
+void Universe::DetectCollisions()
+{
+	// Pairs are tested continuously over the step rather than just at their start positions, so fast particles
+	// can't tunnel through each other when the time step is large
+	const size_t count = m_particles.size();
+	const double dt = m_timeStep;
+
+	// Closest approach of two circles over the step, assuming straight line motion
+	auto sweptCirclesCollide = [&](size_t i, size_t j)
+	{
+		VectorType start = m_particles[j].GetPos() - m_particles[i].GetPos();
+		VectorType motion = (m_particles[j].GetVel() - m_particles[i].GetVel()) * dt;
+		double motionSq = motion.MagSq();
+		double t = motionSq > 0. ? clamp(-(start * motion) / motionSq, 0., 1.) : 0.;
+		VectorType closest = start + motion * t;
+		double combinedRadius = m_sizes[i] + m_sizes[j];
+		return closest.MagSq() < combinedRadius * combinedRadius;
+	};
+
+	// Union-find for merge groups. The root of each group is always its lowest index, so the result doesn't depend
+	// on the order the pairs were found in.
+	Arena& arena = Arena::GetThreadArena();
+	ArenaVector<size_t> roots(count, arena);
+	iota(roots.begin(), roots.end(), 0);
+	auto findRoot = [&](size_t i)
+	{
+		while (roots[i] != i)
+			i = roots[i] = roots[roots[i]];
+		return i;
+	};
+
+	bool anyCollisions = false;
+	auto testPair = [&](size_t i, size_t j)
+	{
+		// Macro particles don't collide, their size doesn't mean anything physical and merging one would lose
+		// track of its constituents
+		if (m_particles[i].IsMacro() || m_particles[j].IsMacro() || !sweptCirclesCollide(i, j))
+			return;
+
+		size_t rootI = findRoot(i), rootJ = findRoot(j);
+		if (rootI != rootJ)
+			roots[max(rootI, rootJ)] = min(rootI, rootJ);
+		anyCollisions = true;
+	};
+
+	// The neighbour lists' merge candidates cover this step as long as no particle will have moved more than half
+	// the skin from where it was when they were built by the end of the step
+	auto& lists = m_neighbourLists;
+	bool useLists = lists.valid && lists.particleCount == count && lists.skin > 0.;
+	for (size_t i = 0; i < count && useLists; ++i)
+	{
+		auto const& p = m_particles[i];
+		if ((p.GetPos() - lists.builtPositions[i]).Mag() + p.GetVel().Mag() * dt > lists.skin * 0.5)
+			useLists = false;
+	}
+
+	if (useLists)
+	{
+		for (auto [i, j] : lists.mergeCandidates)
+			testPair(i, j);
+	}
+	else
+	{
+		// Broadphase: sort and sweep along x over the bounding box of each particle's motion for this step
+		ArenaVector<AABB> boxes(count, Arena::GetThreadArena());
+		for (size_t i = 0; i < count; ++i)
+		{
+			auto const& p = m_particles[i];
+			VectorType start = p.GetPos();
+			VectorType end = start + p.GetVel() * dt;
+			double radius = fabs(m_sizes[i]);
+			boxes[i] = { min(start.x, end.x) - radius, max(start.x, end.x) + radius,
+						 min(start.y, end.y) - radius, max(start.y, end.y) + radius };
+		}
+		SweepAndPrune(boxes, testPair);
+
+		// The lists didn't cover this step, so they're due a rebuild anyway
+		lists.valid = false;
+	}
+
+	if (!anyCollisions)
+		return;
+
+	// Merge each group into its lowest index particle, in index order, then remove the merged particles in a single
+	// pass (erasing them one at a time was O(N) each)
+	// The merged particles' IDs are freed, and if the camera was following one it follows what it merged into
+	ArenaVector<bool> merged(count, false, arena);
+	for (size_t i = 0; i < count; ++i)
+	{
+		size_t root = findRoot(i);
+		if (root != i)
+		{
+			m_particles[root].Merge(m_particles[i]);
+			merged[i] = true;
+
+			ParticleId id = m_particles[i].m_id;
+			m_cameraFollow.compare_exchange_strong(id, m_particles[root].m_id);
+			m_particleSlots.Erase(m_particles[i].m_id);
+		}
+	}
+
+	// Work out where each survivor goes first, then move them into a second vector in parallel
+	ArenaVector<size_t> destinations(count, arena);
+	size_t next = 0;
+	for (size_t i = 0; i < count; ++i)
+	{
+		destinations[i] = next;
+		if (!merged[i])
+			++next;
+	}
+	m_compactedParticles.resize(next);
+	ParallelForParticles([&](size_t begin, size_t end)
+		{
+			for (size_t i = begin; i < end; ++i)
+				if (!merged[i])
+					m_compactedParticles[destinations[i]] = move(m_particles[i]);
+		});
+	m_particles.swap(m_compactedParticles);
+	lists.valid = false;
+
+	// The broadphase order is still nearly sorted without the merged particles, it just needs the new indices
+	if (m_sweepOrder.size() == count)
+	{
+		size_t kept = 0;
+		for (size_t i : m_sweepOrder)
+			if (!merged[i])
+				m_sweepOrder[kept++] = destinations[i];
+		m_sweepOrder.resize(kept);
+	}
+}
+
+void Universe::AdvanceBallisticParticles()
+{
+	if (m_ballisticParticles.empty() || m_systemMass <= 0.)
+		return;
+
+	// Ballistic particles are only pulled by the monopole of the whole system, and never collide with anything.
+	// They're far away from everything else by definition so this is a reasonable approximation, and it's O(N)
+	// rather than O(N^2). Their own pull on the system is ignored.
+	const double gDt = m_gravitationalConstant * m_timeStep;
+	for (auto& p : m_ballisticParticles)
+	{
+		VectorType vec = m_systemCentre - p.GetPos();
+		double distanceSq = vec.MagSq();
+		vec.SetLength((gDt * m_systemMass) / distanceSq);
+		p.AddToVel(vec);
+	}
+}
+
+void Universe::UpdateBallisticTier()
+{
+	// Work out the monopole of the interacting particles, used both for deciding which particles have escaped
+	// and for pulling the ballistic ones back towards the system
+	m_systemMass = 0.;
+	VectorType weightedPos, weightedVel;
+	for (auto const& p : m_particles)
+	{
+		m_systemMass += p.GetMass();
+		weightedPos += p.GetPos() * (double)p.GetMass();
+		weightedVel += p.GetVel() * (double)p.GetMass();
+	}
+	if (m_systemMass > 0.)
+	{
+		m_systemCentre = weightedPos / m_systemMass;
+		m_systemVel = weightedVel / m_systemMass;
+	}
+
+	if (!m_useBallisticTier || m_particles.size() < 2)
+	{
+		// Put everything back, so turning the tier off is the same as never having had it
+		if (!m_ballisticParticles.empty())
+			ParticlesReordered();
+		for (auto& p : m_ballisticParticles)
+			m_particles.push_back(move(p));
+		m_ballisticParticles.clear();
+		return;
+	}
+
+	const double radius = m_ballisticRadius;
+	const double radiusSq = radius * radius;
+
+	// Promote particles which have come back inside the radius
+	for (size_t i = 0; i < m_ballisticParticles.size();)
+	{
+		if ((m_ballisticParticles[i].GetPos() - m_systemCentre).MagSq() < radiusSq)
+		{
+			m_particles.push_back(move(m_ballisticParticles[i]));
+			m_ballisticParticles[i] = move(m_ballisticParticles.back());
+			m_ballisticParticles.pop_back();
+			ParticlesReordered();
+		}
+		else
+			++i;
+	}
+
+	// Demote particles which are outside the radius and energetically unbound, i.e. kinetic energy relative to
+	// the system is greater than the potential energy of the system's monopole (per unit mass for both)
+	auto isUnbound = [&](Particle const& p)
+	{
+		VectorType offset = p.GetPos() - m_systemCentre;
+		double distanceSq = offset.MagSq();
+		if (distanceSq < radiusSq)
+			return false;
+		double kinetic = 0.5 * (p.GetVel() - m_systemVel).MagSq();
+		double potential = (m_gravitationalConstant * m_systemMass) / sqrt(distanceSq);
+		return kinetic > potential;
+	};
+
+	// Moves the unbound ones straight across and closes the gaps in place, keeping the order of both, rather than
+	// stable_partition, which allocates a buffer every time
+	size_t kept = 0;
+	for (size_t i = 0; i < m_particles.size(); ++i)
+	{
+		if (isUnbound(m_particles[i]))
+			m_ballisticParticles.push_back(move(m_particles[i]));
+		else
+		{
+			if (kept != i)
+				m_particles[kept] = move(m_particles[i]);
+			++kept;
+		}
+	}
+	if (kept != m_particles.size())
+	{
+		m_particles.erase(m_particles.begin() + kept, m_particles.end());
+		ParticlesReordered();
+	}
+}
+
+void Universe::UpdateCoarsening()
+{
+	// When a macro particle is refined the camera goes back to the particle it was following before, if it's still
+	// following the macro particle
+	auto followConstituent = [&](Particle const& _macro)
+	{
+		ParticleId id = _macro.m_id;
+		if (ParticleId followed = m_macroParticles.at(_macro.m_id).followed)
+			m_cameraFollow.compare_exchange_strong(id, followed);
+	};
 
-	vector<mutex> mutexes(count);
+	// Step local containers come from this thread's arena, see Arena.h
+	Arena& arena = Arena::GetThreadArena();
 
-	auto executeGridSquare = [&](int row, int col)
+	if (!m_useCoarsening)
+	{
+		// Put everything back, so turning coarsening off is the same as never having had it
+		if (!m_macroParticles.empty())
 		{
-			const int gridIdx = row * m_gridRowsCols + col;
-			auto& gridSquare = grid[row][col];
-			const auto gridSquareCount = gridSquare.particles.size();
-
-			// Go through particles in own square
-			for (size_t i = 0; i < gridSquare.particles.size(); ++i)
+			for (auto* particles : { &m_particles, &m_ballisticParticles })
 			{
-				Particle& me = *(gridSquare.particles[i]);
-				const auto index1 = gridSquare.particleIndices[i];
-				const float meMass = me.m_mass;
-				const float size = sizes[index1];
-
-				VectorType accumulatedVelChange;
-
-				scoped_lock lock1(mutexes[index1]);
-
-				// Go through particles in same square
-				for (size_t p = i + 1; p < gridSquareCount; p++)
+				ArenaVector<Particle> refined(arena);
+				for (auto const& p : *particles)
 				{
-					Particle& other = *(gridSquare.particles[p]);
-					const auto index2 = gridSquare.particleIndices[p];
-
-					// Get vector between objects
-					VectorType objectsVector = other.GetPos() - me.GetPos();
-					
-					float distanceSq = objectsVector.MagSq();
-					
-					objectsVector.Normalise();
-					
-					float combinedRadius = size + sizes[index2];
-
-					// Check for collision
-					if (distanceSq < combinedRadius * combinedRadius)
+					if (p.IsMacro())
 					{
-						scoped_lock mergeLock(mergeMutex);
-
-						// Find if there's an existing merge set which contains at least one of the two particles,
-						// if so merge particles into that existing merge set
-						// TODO now that we have particleIndices we can go back to using ints here
-						bool mergedIntoExistingSet = false;
-						for (auto& set : mergeSets)
-						{
-							bool foundI = set.find(&m_particles[index1]) != set.end();
-							bool foundP = set.find(&other) != set.end();
-							if (foundI || foundP)
-							{
-								//argDebugf("Found in existing set: i:%d p:%d", foundI, foundP);
-								set.insert(&m_particles[index1]);
-								set.insert(&other);
-								mergedIntoExistingSet = true;
-								break;
-							}
-						}
-
-						// Otherwise create a new merge set
-						if (!mergedIntoExistingSet)
-							mergeSets.push_back({ &m_particles[index1], &other });
-
-						// Don't do gravitational force with another particle if we're going to merge with it
-						continue;
+						RefineMacroParticle(p, refined);
+						followConstituent(p);
+						m_particleSlots.Erase(p.m_id);
 					}
+					else
+						refined.push_back(p);
+				}
+				particles->assign(refined.begin(), refined.end());
+			}
+			m_macroParticles.clear();
+			m_coarseningStats = {};
+			++m_coarseningChanges;
+			ParticlesReordered();
+		}
+		return;
+	}
 
-					// Calculate gravitational attraction
-					float force = (m_gravitationalConstant * meMass * other.m_mass) / distanceSq;
+	if (m_particles.empty())
+		return;
 
-					// Apply force to velocity of particle (accel = force / mass)
+	float maxMass = 0.f;
+	for (auto const& p : m_particles)
+		maxMass = max(maxMass, p.GetMass());
 
-					float accelMe = force / meMass;
-					float accelOther = force / other.m_mass;
+	const float smallMass = maxMass * m_coarsenMassFraction;
+	const float massiveMass = maxMass * coarseningMassiveFraction;
+	const double distance = m_coarsenDistance;
+	const double cellSize = m_coarsenCellSize;
 
-					objectsVector.SetLength(accelMe);
+	// "Far from the camera" is a whole viewport width away from the centre of the screen, so it's relative to zoom
+	const double cameraDistance = m_simulationView.viewportWidth;
 
-					scoped_lock lock2(mutexes[index2]);
+	// Bucket the massive bodies into cells the size of the coarsening distance, so checking whether a particle is
+	// far from all of them only has to look at the neighbouring cells
+	auto cellKey = [](double x, double y, double size)
+	{
+		// Shifted as unsigned, as shifting negative values left is undefined
+		return static_cast<int64_t>((static_cast<uint64_t>(static_cast<int64_t>(floor(x / size))) << 32) ^ (static_cast<uint64_t>(static_cast<int64_t>(floor(y / size))) & 0xffffffff));
+	};
+	ArenaUnorderedMap<int64_t, ArenaVector<VectorType>> massiveBodies(arena);
+	for (auto const& p : m_particles)
+		if (p.GetMass() >= massiveMass)
+			massiveBodies.try_emplace(cellKey(p.m_pos.x, p.m_pos.y, distance), arena).first->second.push_back(p.GetPos());
 
-					accumulatedVelChange += objectsVector;
+	auto isFar = [&](VectorType const& pos, double scale)
+	{
+		if ((pos - m_simulationView.cameraPos).MagSq() < cameraDistance * cameraDistance * scale * scale)
+			return false;
+		for (int dy = -1; dy <= 1; ++dy)
+		{
+			for (int dx = -1; dx <= 1; ++dx)
+			{
+				auto it = massiveBodies.find(cellKey(pos.x + dx * distance, pos.y + dy * distance, distance));
+				if (it == massiveBodies.end())
+					continue;
+				for (auto const& body : it->second)
+					if ((pos - body).MagSq() < distance * distance * scale * scale)
+						return false;
+			}
+		}
+		return true;
+	};
 
-					VectorType objectsVectorOther = objectsVector;
-					objectsVectorOther.SetLength(accelOther);
-					other.AddToVel(-objectsVectorOther);
-				}
+	bool changed = false;
 
-				// Go through particles in nearby squares (only for squares with higher index) and distant squares
-				// Is there any benefit in going through nearby squares rather than just having bigger grid squares with
-				// no buffer zone? Well, yes, if two particles overlap in different squares.
-				// Also force vector will be super inaccurate for neighbouring grid squares
-				for (GridSquare* otherGridSquareP : nonEmptyGridSquares)
-				{
-					auto const& otherGridSquare = *otherGridSquareP;
+	// Refine macro particles which have come near again. This uses a slightly smaller distance than coarsening does,
+	// so particles near the boundary don't flip back and forth.
+	const double refineScale = 0.8;
+	for (auto* particles : { &m_particles, &m_ballisticParticles })
+	{
+		ArenaVector<Particle> refined(arena);
+		for (size_t i = 0; i < particles->size();)
+		{
+			Particle const& p = (*particles)[i];
+			if (p.IsMacro() && !isFar(p.GetPos(), refineScale))
+			{
+				RefineMacroParticle(p, refined);
+				followConstituent(p);
+				m_macroParticles.erase(p.m_id);
+				m_particleSlots.Erase(p.m_id);
+				(*particles)[i] = move(particles->back());
+				particles->pop_back();
+				changed = true;
+			}
+			else
+				++i;
+		}
+		move(refined.begin(), refined.end(), back_inserter(*particles));
+	}
 
-					if (otherGridSquare.index == gridSquare.index)
-						continue;
+	// Group the small, far away particles by cell, in order of first appearance so the result is repeatable
+	ArenaUnorderedMap<int64_t, size_t> cellGroups(arena);
+	ArenaVector<ArenaVector<size_t>> groups(arena);
+	for (size_t i = 0; i < m_particles.size(); ++i)
+	{
+		auto const& p = m_particles[i];
+		if (p.IsMacro() || p.GetMass() >= smallMass || !isFar(p.GetPos(), 1.))
+			continue;
+		auto [it, inserted] = cellGroups.try_emplace(cellKey(p.m_pos.x, p.m_pos.y, cellSize), groups.size());
+		if (inserted)
+			groups.emplace_back(arena);
+		groups[it->second].push_back(i);
+	}
 
-					// get grid coordinates from the first particle
-					auto [otherGX, otherGY] = particleGridPos(*otherGridSquare.particles.front());
+	// Replace each big enough group with a single macro particle which conserves mass and momentum, and remember
+	// where each constituent was relative to it so it can be refined later
+	ArenaVector<bool> coarsened(m_particles.size(), false, arena);
+	ArenaVector<Particle> newMacros(arena);
+	for (auto const& group : groups)
+	{
+		if (group.size() < coarseningMinClusterSize)
+			continue;
 
-					// If other grid square is within this many grid squares, go through particles individually
-					int gridDistance = abs(col - otherGX) + abs(row - otherGY);
-					if (gridDistance <= m_highAccuracyGridDistance)
-					{
-						// Don't do two-way interactions with other grid squares with lower index
-						if (otherGridSquare.index < gridSquare.index)
-							continue;
+		double mass = 0.;
+		VectorType weightedPos, weightedVel;
+		float r = 0.f, g = 0.f, b = 0.f;
+		for (size_t i : group)
+		{
+			auto const& p = m_particles[i];
+			mass += p.GetMass();
+			weightedPos += p.GetPos() * (double)p.GetMass();
+			weightedVel += p.GetVel() * (double)p.GetMass();
+			r += p.GetColour().r * p.GetMass();
+			g += p.GetColour().g * p.GetMass();
+			b += p.GetColour().b * p.GetMass();
+		}
 
-						for (size_t p = 0; p < otherGridSquare.particles.size(); p++)
-						{
-							Particle& other = *(otherGridSquare.particles[p]);
-							const auto index2 = otherGridSquare.particleIndices[p];
+		Particle macro(weightedPos / mass, weightedVel / mass, (float)mass, al_map_rgba_f(r / mass, g / mass, b / mass, 1.f));
+		macro.m_id = m_particleSlots.Insert();
+		macro.m_isMacro = true;
 
-							if (&me == &other)	// shouldn't be necessary, we won't be checking current grid square here
-								continue;
+		auto& record = m_macroParticles[macro.m_id];
+		record.createdStep = m_stepCount;
+		double offsetSq = 0., velOffsetSq = 0.;
+		for (size_t i : group)
+		{
+			Particle constituent = m_particles[i];
+			constituent.SetPos(constituent.GetPos() - macro.GetPos());
+			constituent.SetVel(constituent.GetVel() - macro.GetVel());
+			offsetSq += constituent.GetPos().MagSq() * constituent.GetMass();
+			velOffsetSq += constituent.GetVel().MagSq() * constituent.GetMass();
+			record.constituents.push_back(constituent);
+			coarsened[i] = true;
+
+			// Keeps its ID while it's coarsened, it just can't be found, so if the camera was following it it follows
+			// the macro particle instead
+			m_particleSlots.Set(constituent.m_id, SlotMap::none);
+			ParticleId id = constituent.m_id;
+			if (m_cameraFollow.compare_exchange_strong(id, macro.m_id))
+				record.followed = constituent.m_id;
+		}
+		record.rmsOffset = sqrt(offsetSq / mass);
+		record.rmsVelOffset = sqrt(velOffsetSq / mass);
 
-							// Get vector between objects
-							VectorType objectsVector = other.m_pos - me.m_pos;
+		newMacros.push_back(macro);
+		changed = true;
+	}
 
-							float distanceSq = objectsVector.MagSq();
-							float combinedRadius = size + sizes[index2];
+	if (!newMacros.empty())
+	{
+		size_t next = 0;
+		for (size_t i = 0; i < m_particles.size(); ++i)
+		{
+			if (!coarsened[i])
+			{
+				if (next != i)
+					m_particles[next] = move(m_particles[i]);
+				++next;
+			}
+		}
+		m_particles.resize(next);
+		move(newMacros.begin(), newMacros.end(), back_inserter(m_particles));
+	}
 
-							// Check for collision
-							if (distanceSq < combinedRadius * combinedRadius)
-							{
-								scoped_lock mergeLock(mergeMutex);
-
-								//argDebugf("Merge %d,%d", i, p);
-
-								// Find if there's an existing merge set which contains at least one of the two particles,
-								// if so merge particles into that existing merge set
-								bool mergedIntoExistingSet = false;
-								for (auto& set : mergeSets)
-								{
-									bool foundI = set.find(&m_particles[index1]) != set.end();
-									bool foundP = set.find(&other) != set.end();
-									if (foundI || foundP)
-									{
-										//argDebugf("Found in existing set: i:%d p:%d", foundI, foundP);
-										set.insert(&m_particles[index1]);
-										set.insert(&other);
-										mergedIntoExistingSet = true;
-										break;
-									}
-								}
-
-								// Otherwise create a new merge set
-								if (!mergedIntoExistingSet)
-									mergeSets.push_back({ &m_particles[index1], &other });
-
-								// Don't do gravitational force with another particle if we're going to merge with it
-								continue;
-							}
+	if (changed)
+	{
+		++m_coarseningChanges;
+		ParticlesReordered();
+	}
 
-							// Calculate gravitational attraction
-							float force = (m_gravitationalConstant * meMass * other.m_mass) / distanceSq;
+	// Report how much N has been reduced by and roughly how much error that introduces. Constituents are frozen
+	// relative to their macro particle, so the drift estimate is how far they'd have moved relative to it since.
+	const double dt = m_timeStep;
+	double totalOffsetSq = 0., totalMass = 0.;
+	m_coarseningStats = {};
+	for (auto const& [id, record] : m_macroParticles)
+	{
+		double mass = 0.;
+		for (auto const& c : record.constituents)
+			mass += c.GetMass();
+		++m_coarseningStats.macroCount;
+		m_coarseningStats.constituentCount += record.constituents.size();
+		totalOffsetSq += record.rmsOffset * record.rmsOffset * mass;
+		totalMass += mass;
+		m_coarseningStats.maxDrift = max(m_coarseningStats.maxDrift, record.rmsVelOffset * (m_stepCount - record.createdStep) * dt);
+	}
+	if (totalMass > 0.)
+		m_coarseningStats.rmsOffset = sqrt(totalOffsetSq / totalMass);
+}
 
-							// Apply force to velocity of particle (accel = force / mass)
-							objectsVector.Normalise();
+template<typename Vector>
+void Universe::RefineMacroParticle(Particle const& _macro, Vector& _dest)
+{
+	// Constituents keep their offsets from when they were coarsened, plus whatever the macro particle has done since
+	for (auto const& c : m_macroParticles.at(_macro.m_id).constituents)
+		_dest.emplace_back(_macro.GetPos() + c.GetPos(), _macro.GetVel() + c.GetVel(), c.GetMass(), c.m_colour, c.m_id);
+}
 
-							VectorType objectsVectorOther = objectsVector;
+void Universe::MatchPreviousSnapshot(Snapshot const& _latest)
+{
+	const ParticleList particles = GetParticles(_latest);
+	const ParticleList ballisticParticles = GetBallisticParticles(_latest);
+
+	// Each particle is found in the previous snapshot through the slot in its ID, which works across the tiers too.
+	// The table is only ever as big as the number of slots, and is emptied again afterwards.
+	auto& bySlot = m_previousBySlot;
+	PreviousSnapshot const& previous = m_previousSnapshot;
+	auto forEachPrevious = [&previous](auto&& _fn)
+	{
+		if (previous.compact)
+		{
+			for (size_t i = 0; i < previous.compactParticles.size(); ++i)
+				_fn(static_cast<uint32_t>(i), previous.compactParticles.GetId(i));
+			for (size_t i = 0; i < previous.compactBallisticParticles.size(); ++i)
+				_fn(static_cast<uint32_t>(i) | ballisticLocation, previous.compactBallisticParticles.GetId(i));
+		}
+		else
+		{
+			for (size_t i = 0; i < previous.particles.size(); ++i)
+				_fn(static_cast<uint32_t>(i), previous.particles[i].m_id);
+			for (size_t i = 0; i < previous.ballisticParticles.size(); ++i)
+				_fn(static_cast<uint32_t>(i) | ballisticLocation, previous.ballisticParticles[i].m_id);
+		}
+	};
+	auto getPreviousId = [&previous](uint32_t _location)
+	{
+		const size_t i = _location & ~ballisticLocation;
+		if (previous.compact)
+			return (_location & ballisticLocation) ? previous.compactBallisticParticles.GetId(i) : previous.compactParticles.GetId(i);
+		return (_location & ballisticLocation) ? previous.ballisticParticles[i].m_id : previous.particles[i].m_id;
+	};
 
-							float accelMe = force / meMass;
-							float accelOther = force / other.m_mass;
-							
-							objectsVector.SetLength(accelMe);
-							accumulatedVelChange += objectsVector;
+	forEachPrevious([&](uint32_t _location, ParticleId _id)
+		{
+			const uint32_t slot = SlotMap::GetSlot(_id);
+			if (slot >= bySlot.size())
+				bySlot.resize(slot + 1, SlotMap::none);
+			bySlot[slot] = _location;
+		});
+
+	m_previousLocations.resize(particles.size() + ballisticParticles.size());
+	size_t next = 0;
+	for (auto const* current : { &particles, &ballisticParticles })
+	{
+		for (size_t i = 0; i < current->size(); ++i)
+		{
+			const ParticleId id = current->GetId(i);
+			const uint32_t slot = SlotMap::GetSlot(id);
+			uint32_t location = slot < bySlot.size() ? bySlot[slot] : SlotMap::none;
+
+			// The slot could have been reused for something else since
+			if (location != SlotMap::none && getPreviousId(location) != id)
+				location = SlotMap::none;
+			m_previousLocations[next++] = location;
+		}
+	}
 
-							// Apply interaction to other particle
-							scoped_lock lock2(mutexes[index2]);
+	forEachPrevious([&](uint32_t, ParticleId _id) { bySlot[SlotMap::GetSlot(_id)] = SlotMap::none; });
+	m_previousSnapshot.matched = true;
+}
 
-							objectsVectorOther.SetLength(accelOther);
-							other.AddToVel(-objectsVectorOther);
-						}
-					}
-					else
-					{
-						// Gravitational attraction from this particle to a whole grid square
-						VectorType vec = grid[otherGY][otherGX].centre - me.GetPos();
-						
-						float distanceSq = vec.MagSq();
-						
-						vec.Normalise();
+void Universe::GetPrevious(uint32_t _location, VectorType& _pos, VectorType& _vel) const
+{
+	const size_t i = _location & ~ballisticLocation;
+	if (m_previousSnapshot.compact)
+	{
+		CompactParticles const& previous = (_location & ballisticLocation) ? m_previousSnapshot.compactBallisticParticles : m_previousSnapshot.compactParticles;
+		_pos = previous.GetPos(i);
+		_vel = previous.GetVel(i);
+	}
+	else
+	{
+		Particle const& previous = (_location & ballisticLocation) ? m_previousSnapshot.ballisticParticles[i] : m_previousSnapshot.particles[i];
+		_pos = previous.GetPos();
+		_vel = previous.GetVel();
+	}
+}
 
-						// Calculate gravitational attraction
-						float force = (m_gravitationalConstant * meMass * grid[otherGY][otherGX].mass) / distanceSq;
+// Cubic Hermite interpolation of each particle in the latest snapshot from where it was in the previous one, using the
+// velocities at both ends, into m_renderPositions. _time is the simulated time between them, _alpha how far through it
+// we are. Particles which weren't in the previous snapshot are left where they are now.
+void Universe::InterpolateRenderParticles(Snapshot const& _latest, double _alpha, double _time)
+{
+	const double s = _alpha, s2 = s * s, s3 = s2 * s;
+	const double h00 = 2. * s3 - 3. * s2 + 1., h10 = s3 - 2. * s2 + s, h01 = -2. * s3 + 3. * s2, h11 = s3 - s2;
 
-						float accelMe = force / meMass;
-						vec.SetLength(accelMe);
-						accumulatedVelChange += vec;
+	const ParticleList particles = GetParticles(_latest);
+	const ParticleList ballisticParticles = GetBallisticParticles(_latest);
+	m_renderPositions.resize(particles.size() + ballisticParticles.size());
+	auto interpolate = [&](ParticleList const& _current, size_t _first)
+	{
+		m_renderThreadPool.ParallelFor(_current.size(), [&](size_t begin, size_t end)
+			{
+				for (size_t i = begin; i < end; ++i)
+				{
+					const VectorType currentPos = _current.GetPos(i);
+					const uint32_t location = m_previousLocations[_first + i];
+					if (location == SlotMap::none)
+					{
+						m_renderPositions[_first + i] = currentPos;
+						continue;
 					}
+					VectorType previousPos, previousVel;
+					GetPrevious(location, previousPos, previousVel);
+					const VectorType currentVel = _current.GetVel(i);
+					m_renderPositions[_first + i] = previousPos * h00 + previousVel * (h10 * _time) + currentPos * h01 + currentVel * (h11 * _time);
 				}
+			});
+	};
+	interpolate(particles, 0);
+	interpolate(ballisticParticles, particles.size());
+}
 
-				// Add accumulated vel change to vel
-				me.AddToVel(accumulatedVelChange);
-			}
-		};
-
-	// todo just do empty ones
-	for (int rowI = 0; rowI < gridRowsCols; ++rowI)
-		for (int colI = 0; colI < gridRowsCols; ++colI)
-	#if ASYNC_POLICY_DEFAULT
-			futures.push_back(std::async(executeGridSquare, rowI, colI));
-	#else
-			futures.push_back(std::async(asyncPolicy, executeGridSquare, rowI, colI));
-	#endif
+void Universe::Render()
+{
+	const float sizeLogBase = m_sizeLogBase;
 
-#endif
+	// Everything from the simulation comes from the latest snapshot, see Advance
+	Snapshot const& snapshot = m_snapshots.GetReadBuffer();
+
+	// Interpolate between the previous snapshot and the latest one, so the display is smooth whether steps are slower
+	// or faster than frames. This means showing things one snapshot interval behind the simulation.
+	ParticleList particles = GetParticles(snapshot);
+	ParticleList ballisticParticles = GetBallisticParticles(snapshot);
+	const double interval = snapshot.publishTime - m_previousSnapshot.publishTime;
+	const double simulatedInterval = snapshot.simulationTime - m_previousSnapshot.simulationTime;
+	const bool interpolated = m_interpolateSnapshots && m_previousSnapshot.matched && interval > 0. && simulatedInterval > 0.;
+	if (interpolated)
+	{
+		const double alpha = clamp((TimingManager::GetTime() - snapshot.publishTime) / interval, 0., 1.);
+		InterpolateRenderParticles(snapshot, alpha, simulatedInterval);
+		particles = particles.WithPositions(m_renderPositions.data());
+		ballisticParticles = ballisticParticles.WithPositions(m_renderPositions.data() + particles.size());
+	}
 
-	// Await all
-	for (size_t i = 0; i < futures.size(); ++i)
-		futures[i].wait();
+	// Follow the particle picked with the middle button. Stops when it's gone, unless it merged into something or was
+	// coarsened into a macro particle, in which case m_cameraFollow has moved on to that.
+	if (m_cameraFollow != 0 && snapshot.cameraFollow == m_cameraFollow)
+	{
+		const uint32_t location = snapshot.cameraFollowLocation;
+		if (location == SlotMap::none)
+			m_cameraFollow = 0;
+		else if (location & ballisticLocation)
+			m_cameraPos = ballisticParticles.GetPos(location & ~ballisticLocation);
+		else
+			m_cameraPos = particles.GetPos(location);
+	}
 
-	// Priority queue because we are deleting based on index
-	// We want to delete high indicies first so as not to invalidate lower indicies
-	priority_queue<size_t> deleteQueue;
+	// WorldToScreen as a scale and offset, for ParticleRenderer
+	const VectorType renderOffset = WorldToScreen(VectorType(0, 0));
+	const VectorType renderScale = WorldToScreen(VectorType(1, 1)) - renderOffset;
+	DiscAtlas const* discAtlas = nullptr;
+	if (m_useDiscSprites)
+	{
+		m_discAtlas.Create(particleEdgeThickness);
+		discAtlas = &m_discAtlas;
+	}
 
-	for (auto& set : mergeSets)
+	// Index everything that's about to be drawn, for culling here and picking in Advance. Only rebuilt when what's
+	// drawn has moved, so a paused or slow simulation with interpolation off doesn't pay for it every frame.
+	const size_t numParticles = particles.size();
+	const size_t numTreeParticles = numParticles + ballisticParticles.size();
+	auto getTreeList = [&](size_t i) -> ParticleList const& { return i < numParticles ? particles : ballisticParticles; };
+	auto getTreeIndex = [&](size_t i) { return i < numParticles ? i : i - numParticles; };
+	auto getTreeParticle = [&](size_t i) { return getTreeList(i)[getTreeIndex(i)]; };
+	if (m_particleTreeStale || interpolated || m_particleTreeInterpolated)
 	{
-		//argDebugf("Merge set: " + ToString(set) + " into %d", *i);	// old
+		m_particleTreeIds.resize(numTreeParticles);
+		atomic<float> maxMass = 0.f;
+		m_particleTree.Build(numTreeParticles, [&](size_t i) { return getTreeList(i).GetPos(getTreeIndex(i)); }, m_renderThreadPool,
+			[&](size_t begin, size_t end)
+			{
+				float chunkMaxMass = 0.f;
+				for (size_t i = begin; i < end; ++i)
+				{
+					ParticleList const& list = getTreeList(i);
+					m_particleTreeIds[i] = list.GetId(getTreeIndex(i));
+					chunkMaxMass = max(chunkMaxMass, list.GetMass(getTreeIndex(i)));
+				}
+				float current = maxMass;
+				while (chunkMaxMass > current && !maxMass.compare_exchange_weak(current, chunkMaxMass)) {}
+			});
+		m_particleTreeMaxMass = maxMass;
+		m_particleTreeStale = false;
+		m_particleTreeInterpolated = interpolated;
+	}
 
-		auto it = set.cbegin();
-		Particle* firstParticle = *it;
-		while (++it != set.cend())
-		{
-			firstParticle->Merge(**it);
+	// Anything whose circle could reach the screen, going by the biggest one
+	const float maxMass = m_particleTreeMaxMass;
+	const float maxSize = maxMass > 0.f ? log(maxMass) / log(sizeLogBase) * 2.5f * (float)renderScale.x : 0.f;	// Particle::GetSize
+	const double cullMargin = (clamp(maxSize, 10.f, m_scW / 2.f) + particleEdgeThickness) / renderScale.x;
+	m_particleTree.FindInRect(VectorType(-renderOffset.x / renderScale.x - cullMargin, -renderOffset.y / renderScale.y - cullMargin),
+		VectorType((m_scW - renderOffset.x) / renderScale.x + cullMargin, (m_scH - renderOffset.y) / renderScale.y + cullMargin),
+		m_visibleParticles, m_renderThreadPool);
 
-			// Find index of other particle in m_particles so we can delete it later
-			size_t i;
-			for (i = 0; i < m_particles.size(); ++i)
+	// Grid lines, underneath everything
+	if (m_gravityMode == GravityMode::GridBased)
+	{
+		ALLEGRO_COLOR gridCol = al_map_rgb(32, 32, 32);
+		ForEachGridLine(particles, [&](VectorType const& pos1, VectorType const& pos2)
 			{
-				if (&m_particles[i] == *it)
-					break;
-			}
-			assert(i < m_particles.size());
-			deleteQueue.push(i);
-		}
+				al_draw_line(pos1.x, pos1.y, pos2.x, pos2.y, gridCol, 1.f);
+			});
 	}
-	
-	// now delete old particles
-	while (!deleteQueue.empty())
+
+	// Render trails
+	if (m_showTrails && m_trailMode == TrailMode::Bitmap)
 	{
-		//argDebugf("deleting %d", deleteQueue.top());
-		m_particles.erase(m_particles.begin() + deleteQueue.top());
-		deleteQueue.pop();
+		// Drawn into every frame rather than from snapshots, so it follows the interpolated positions
+		const double time = TimingManager::GetTime();
+		m_trailBitmap.SetView(m_scW, m_scH, m_cameraPos, m_viewportWidth);
+		m_trailBitmap.Decay(time - m_trailBitmapTime, m_trailFadeTime);
+		m_trailBitmapTime = time;
+		m_trailBitmap.Add(particles);
+		m_trailBitmap.Add(ballisticParticles);
+		m_trailBitmap.Draw();
+	}
+	else if (m_showTrails && m_trailMode == TrailMode::Polylines)
+	{
+		// Every trail's segments as one line list, so it's a single draw call however many trails there are
+		const ALLEGRO_COLOR trailColour = al_map_rgb(128, 128, 128);
+		m_trailVertices.clear();
+		m_trailVertices.reserve(m_trailPolylines.GetNumVertices() * 2);
+		m_trailPolylines.ForEach([&](vector<TrailPolylines::Point> const& vertices, TrailPolylines::Point const& head)
+			{
+				VectorType from = WorldToScreen(VectorType(vertices[0].x, vertices[0].y));
+				for (size_t i = 1; i <= vertices.size(); ++i)
+				{
+					TrailPolylines::Point const& point = i < vertices.size() ? vertices[i] : head;
+					const VectorType to = WorldToScreen(VectorType(point.x, point.y));
+					m_trailVertices.push_back({ (float)from.x, (float)from.y, 0.f, 0.f, 0.f, trailColour });
+					m_trailVertices.push_back({ (float)to.x, (float)to.y, 0.f, 0.f, 0.f, trailColour });
+					from = to;
+				}
+			});
+		if (!m_trailVertices.empty())
+			al_draw_prim(m_trailVertices.data(), nullptr, nullptr, 0, (int)m_trailVertices.size(), ALLEGRO_PRIM_LINE_LIST);
 	}
-}
 
-void Universe::Render()
-{
-	const float sizeLogBase = m_sizeLogBase;
+	// With lots of particles on each pixel, a density map instead of the particles themselves. In Auto it's switched
+	// on and off by how crowded the last one was, with some hysteresis so it doesn't flicker at the threshold.
+	if (m_densityMode == DensityMode::On || (m_densityMode == DensityMode::Auto && (m_densityAutoOn || ++m_densityCheckCounter >= densityCheckInterval)))
+	{
+		m_densityMap.Build(particles, ballisticParticles, renderScale, renderOffset, m_scW, m_scH, m_renderThreadPool);
+		m_densityCheckCounter = 0;
+		m_densityAutoOn = m_densityMap.GetParticlesPerPixel() > (m_densityAutoOn ? m_densityThreshold * 0.5f : m_densityThreshold);
+	}
+	const bool showDensity = m_densityMode == DensityMode::On || (m_densityMode == DensityMode::Auto && m_densityAutoOn);
 
-	// Render trails
-	if (m_showTrails)
+	// Render each particle. Trail points in TrailMode::Points go in first, so they're underneath. With locked pixels
+	// that only holds for the circles: single pixels, trails' and particles' alike, are added in one lock of the
+	// screen after everything else, so they end up on top.
+	m_particleRenderer.Begin(renderScale, renderOffset, m_scW, m_scH, sizeLogBase, particleEdgeThickness, discAtlas, m_lockPixels);
+	if (m_showTrails && m_trailMode == TrailMode::Points)
 	{
-		int iTrail = 0;
-		for( auto const& particle : m_trails )
-		{
-			if (iTrail++ % drawTrailInterval == 0)
-				RenderParticle(particle, sizeLogBase, true);
-		}
+		const ALLEGRO_COLOR trailColour = al_map_rgb(128, 128, 128);
+		m_particleRenderer.Add(m_trails.size() / drawTrailInterval, [&](size_t i)
+			{
+				const TrailStore::Point point = m_trails[i * drawTrailInterval];
+				return ParticleRenderer::Item{ VectorType(point.x, point.y), point.mass, trailColour };
+			}, m_renderThreadPool);
+	}
+	if (!showDensity)
+	{
+		m_particleRenderer.Add(m_visibleParticles.size(), [&](size_t i)
+			{
+				const size_t j = m_visibleParticles[i];
+				ParticleList const& list = getTreeList(j);
+				return ParticleRenderer::Item{ list.GetPos(getTreeIndex(j)), list.GetMass(getTreeIndex(j)), list.GetColour(getTreeIndex(j)) };
+			}, m_renderThreadPool);
 	}
+	m_particleRenderer.Draw(m_renderThreadPool);
+	if (showDensity)
+		m_densityMap.Draw();
 
-	// Grid lines
-	if (m_useGridBasedMode)
+	if (m_debugParticleInfo)
 	{
-		const int gridRowsCols = m_gridRowsCols;
-		ALLEGRO_COLOR gridCol = al_map_rgb(32, 32, 32);
-		double minX, maxX, minY, maxY, gridW, gridH, stepX, stepY;
-		GetGridExtents(m_particles, minX, maxX, minY, maxY, gridW, gridH, stepX, stepY);
-		int gx = 0, gy = 0;
-		for (double x = minX; gx <= gridRowsCols; ++gx, x += stepX)
-		{
-			auto pos1 = WorldToScreen({ x, minY });
-			auto pos2 = WorldToScreen({ x, maxY });
-			al_draw_line(pos1.x, pos1.y, pos2.x, pos2.y, gridCol, 1.f);
-		}
-		for (double y = minY; gy <= gridRowsCols; ++gy, y += stepY)
-		{
-			auto pos1 = WorldToScreen({ minX, y });
-			auto pos2 = WorldToScreen({ maxX, y });
-			al_draw_line(pos1.x, pos1.y, pos2.x, pos2.y, gridCol, 1.f);
-		}
+		for (uint32_t i : m_visibleParticles)
+			RenderParticleInfo(getTreeParticle(i));
 	}
 
-	// Render each particle
-	for (auto const& p : m_particles)
-		RenderParticle(p, sizeLogBase);
+	if (m_writeFrames)
+		CaptureFrame(particles, ballisticParticles, false);
 
 	// Display text stuff
 
@@ -1071,34 +2741,62 @@ void Universe::Render()
 		al_get_mouse_state(&mouseState);
 		VectorType mouseScreenPos = VectorType(mouseState.x, mouseState.y);
 		VectorType mouseWorldPos = ScreenToWorld(mouseScreenPos);
-		auto nearest = FindNearest(mouseWorldPos);
-		if (nearest != m_particles.end())
+		const uint32_t hovered = m_particleTree.FindNearest(mouseWorldPos, rightClickDeleteMaxPixelDistance / renderScale.x);
+		if (hovered != KdTree::npos)
 		{
-			// Only delete if it's within a certain distance from the mouse in screen space
-			auto particleScreenPos = WorldToScreen(nearest->GetPos());
-			float dist = (mouseScreenPos - particleScreenPos).Mag();
-			if (dist < rightClickDeleteMaxPixelDistance)
-			{
-				al_draw_text(g_font, g_colWhite, al_get_display_width(g_display), 30, ALLEGRO_ALIGN_RIGHT, "Particle:");
-				ostringstream ss;
-				ss << "Mass " << nearest->GetMass();
-				al_draw_text(g_font, g_colWhite, al_get_display_width(g_display), 55, ALLEGRO_ALIGN_RIGHT, ss.str().c_str());
-				ss.str("");
-				ss.clear();
-				ss << "Velocity " << nearest->GetVel().x << ", " << nearest->GetVel().y;
-				al_draw_text(g_font, g_colWhite, al_get_display_width(g_display), 80, ALLEGRO_ALIGN_RIGHT, ss.str().c_str());
-			}
+			const Particle nearest = getTreeParticle(hovered);
+			al_draw_text(g_font, g_colWhite, al_get_display_width(g_display), 30, ALLEGRO_ALIGN_RIGHT, "Particle:");
+			ostringstream ss;
+			ss << "Mass " << nearest.GetMass();
+			al_draw_text(g_font, g_colWhite, al_get_display_width(g_display), 55, ALLEGRO_ALIGN_RIGHT, ss.str().c_str());
+			ss.str("");
+			ss.clear();
+			ss << "Velocity " << nearest.GetVel().x << ", " << nearest.GetVel().y;
+			al_draw_text(g_font, g_colWhite, al_get_display_width(g_display), 80, ALLEGRO_ALIGN_RIGHT, ss.str().c_str());
 		}
 	}
 
+	// Time spent in each stage of the step (they overlap, so they don't add up to the total)
+	string stageText = "Stages (ms):";
+	for (auto const& [name, ms] : snapshot.stageMs)
+		stageText += stringFormat(" %s %.2f", name, ms);
+
+	string numaText = stringFormat("NUMA nodes: %d, GB/s:", (int)m_threadPool.GetNumNodes());
+	for (double gbPerSecond : m_nodeBandwidth)
+		numaText += stringFormat(" %.1f", gbPerSecond);
+	numaText += m_nodeBandwidth.empty() ? " not measured (N)" : " (N)";
+
 	// top left
-	std::vector<string> entries = { stringFormat("Particles: %d", m_particles.size()),
-								stringFormat("Trail particles: %d", m_trails.size()),
+	std::vector<string> entries = { stringFormat("Particles: %d", (int)particles.size()),
+								stringFormat("Ballistic particles: %d", (int)ballisticParticles.size()),
+								m_trailMode == TrailMode::Polylines ? stringFormat("Trails: %d lines, %d vertices from %llu points (F4)", (int)m_trailPolylines.GetNumTrails(), (int)m_trailPolylines.GetNumVertices(), m_trailPolylines.GetNumPointsCaptured())
+									: m_trailMode == TrailMode::Bitmap ? stringFormat("Trails: bitmap, %dx%d (%.1f MB) (F4)", m_trailBitmap.w(), m_trailBitmap.h(), m_trailBitmap.GetBytes() / (1024. * 1024.))
+									: stringFormat("Trails: %d points (%.1f MB) (F4)", (int)m_trails.size(), m_trails.GetBytes() / (1024. * 1024.)),
 								stringFormat("Zoom: %.2f (-/+)", 100.f * m_viewportWidth / m_defaultViewportWidth),
 								stringFormat("Camera: %.1f, %.1f", m_cameraPos.x, m_cameraPos.y),
 								stringFormat("Gravity: %e", m_gravitationalConstant),
 								"",
-								stringFormat("Grid mode: %s (G)", m_useGridBasedMode ? "On" : "Off")
+								stringFormat("Simulation: %s, %.2f ms per step, %.0f steps/s (T)", m_simulationThread.joinable() ? "Own thread" : "Inline", snapshot.msPerStep, snapshot.stepsPerSecond),
+								stageText,
+								stringFormat("Step arenas: %.1f MB", Arena::GetThreadArenasCapacity() / (1024. * 1024.)),
+								numaText,
+								snapshot.compact ? stringFormat("Snapshots: Compact, %d bytes drawn per particle, %.1f in all, %d colours (P)", (int)CompactParticles::hotBytes, snapshot.compactParticles.GetBytesPerParticle(), (int)ColourPalette::GetNumColours())
+									: stringFormat("Snapshots: Full, %d bytes per particle (P)", (int)sizeof(Particle)),
+								stringFormat("Interpolation: %s (I)", m_interpolateSnapshots ? "On" : "Off"),
+								stringFormat("Density map: %s%s, %.1f particles per pixel (%.1f MB) (M)", densityModeNames[static_cast<int>(m_densityMode)], m_densityMode == DensityMode::Auto ? (m_densityAutoOn ? " (showing)" : " (not showing)") : "", m_densityMap.GetParticlesPerPixel(), m_densityMap.GetBytes() / (1024. * 1024.)),
+								stringFormat("Drawing: %d visible, %d draw calls, disc sprites %s (S), locked pixels %s (X)", (int)m_particleRenderer.GetNumVisible(), (int)m_particleRenderer.GetNumDrawCalls(), m_useDiscSprites ? "On" : "Off", m_lockPixels ? "On" : "Off"),
+								m_writeFrames || m_frameWriter ? stringFormat("Frames: %s, %d written, %d dropped, %d failed (F5)", m_writeFrames ? ("writing to " + m_frameDirectory).c_str() : "Off", m_frameWriter ? (int)m_frameWriter->GetNumWritten() : 0, (int)m_framesDropped, m_frameWriter ? (int)m_frameWriter->GetNumFailed() : 0)
+									: "Frames: Off (F5)",
+								stringFormat("Gravity mode: %s (G)", gravityModeNames[static_cast<int>(m_gravityMode.load())]),
+								m_deterministic ? stringFormat("Deterministic: On, state %016llx (D)", snapshot.stateHash) : "Deterministic: Off (D)",
+								stringFormat("Ballistic tier: %s (B)", m_useBallisticTier ? "On" : "Off"),
+								stringFormat("Neighbour lists: rebuilt every %.1f steps (%d rebuilds)", snapshot.averageStepsBetweenRebuilds, (int)snapshot.neighbourListRebuilds),
+								stringFormat("Near field pairs: %d, merge candidates: %d", (int)snapshot.nearPairCount, (int)snapshot.mergeCandidateCount),
+								stringFormat("Coarsening: %s (K)", m_useCoarsening ? "On" : "Off"),
+								stringFormat("Macro particles: %d holding %d (N reduced by %d)", (int)snapshot.coarseningStats.macroCount, (int)snapshot.coarseningStats.constituentCount, (int)(snapshot.coarseningStats.constituentCount - snapshot.coarseningStats.macroCount)),
+								stringFormat("Coarsening error: RMS offset %.1f, drift up to %.1f", snapshot.coarseningStats.rmsOffset, snapshot.coarseningStats.maxDrift),
+								stringFormat("View fidelity: %s (V)", m_useViewFidelity ? "On" : "Off"),
+								stringFormat("Sub-cycled particles: %d, no kick last step: %d", (int)snapshot.subCycledCount, (int)snapshot.skippedKickCount)
 							};
 
 	float y = 100;
@@ -1113,11 +2811,24 @@ void Universe::Render()
 				"+/-: Zoom",
 				"Cursor keys: Move",
 				"Left/right mouse: Add/remove particles",
-				"G: Toggle grid-based mode",
+				"Middle mouse: Follow particle",
+				"G: Cycle gravity mode",
+				"D: Toggle deterministic mode",
+				"P: Toggle compact snapshots",
+				"B: Toggle ballistic tier",
+				"K: Toggle coarsening",
+				"V: Toggle view fidelity",
+				"T: Toggle simulation thread",
+				"I: Toggle interpolation",
+				"S: Toggle disc sprites",
+				"X: Toggle locked pixel drawing",
+				"M: Cycle density map mode",
 				"Z: Fast forward",
 				"F1: Show/hide particle info",
 				"F2: Freeze",
 				"F3: Show/hide trails",
+				"F4: Cycle trail mode",
+				"F5: Start/stop writing frames",
 				"ESC: Quit" };
 	y = al_get_display_height(g_display) - g_fontSize * entries.size();
 
@@ -1136,88 +2847,122 @@ void Universe::Render()
 
 void Universe::OnClose()
 {
+	StopSimulationThread();
+	WaitForRecording();
+	if (m_frameWriter)
+		m_frameWriter->Wait();
+
 	if (saveOnQuit)
 		Save();
 }
 
-void Universe::RenderParticle(Particle const & _particle, float _sizeLogBase, bool _isTrail)
+// Mass and speed next to each particle with F1, one at a time since it's only for debugging
+void Universe::RenderParticleInfo(Particle const & _particle)
 {
-	float viewportHeight = m_viewportWidth / m_worldAspectRatio;
-
-	float size = _particle.GetSize(_sizeLogBase) * (m_scW / m_viewportWidth);
-
-	VectorType pos = _particle.GetPos();
+	auto scPos = WorldToScreen(_particle.GetPos());
+	float x = scPos.x, y = scPos.y;
+	if (x < 0 || y < 0 || x >= m_scW || y >= m_scH)
+		return;
 
-	// Uncomment this to show the smallest particles as circles rather than dots
-	//size = max(size, 1.1f);
+	ostringstream ss;
+	ss << "m:" << setprecision(2) << _particle.m_mass << " sp:" << setprecision(8) << _particle.GetVel().Mag();
+	al_draw_textf(g_font, g_colWhite, (int)x, (int)y, 0, ss.str().c_str(), _particle.m_mass, _particle.GetVel().Mag());
+	al_draw_line(x, y, x + _particle.GetVel().x, y + _particle.GetVel().y, _particle.GetColour(), 1.f);
+}
 
-	enum class SizeClass
+void Universe::CaptureFrame(ParticleList const& _particles, ParticleList const& _ballisticParticles, bool _wait)
+{
+	// Half the hardware threads, so the simulation still has most of them
+	if (!m_frameWriter)
+		m_frameWriter = make_unique<FrameWriter>(max(1u, thread::hardware_concurrency() / 2));
+	SoftwareRenderer::Frame* frame = m_frameWriter->BeginFrame(_wait);
+	if (!frame)
 	{
-		Large,
-		Normal,
-		Small,
-		None
-	};
+		++m_framesDropped;
+		return;
+	}
 
-	auto sizeClass = SizeClass::None;
-	// See if particle is within viewport
-	// todo use screen pos of particle
-	if (
-		(pos.GetX() + (size / 2.0f) > (m_cameraPos.x - (m_viewportWidth / 2.0f)))	// left
-		&& (pos.GetX() - (size / 2.0f) < (m_cameraPos.x + (m_viewportWidth / 2.0f)))	// right
-		&& (pos.GetY() + (size / 2.0f) > (m_cameraPos.y - (viewportHeight / 2.0f)))	// top
-		&& (pos.GetY() - (size / 2.0f) < (m_cameraPos.y + (viewportHeight / 2.0f)))	// bottom
-		)
+	frame->w = m_scW;
+	frame->h = m_scH;
+	frame->offset = WorldToScreen(VectorType(0, 0));
+	frame->scale = WorldToScreen(VectorType(1, 1)) - frame->offset;
+	frame->sizeLogBase = m_sizeLogBase;
+	frame->edgeThickness = particleEdgeThickness;
+
+	frame->gridLines.clear();
+	frame->gridColour = 0xff202020;
+	if (m_gravityMode == GravityMode::GridBased)
 	{
-		if (size > m_scW / 2)
-		{
-			sizeClass = SizeClass::Large;
-		}
-		else if (size > 0.5f)
-		{
-			sizeClass = SizeClass::Normal;
-		}
-		else
-		{
-			sizeClass = SizeClass::Small;
-		}
+		ForEachGridLine(_particles, [&](VectorType const& pos1, VectorType const& pos2)
+			{
+				frame->gridLines.push_back({ (float)pos1.x, (float)pos1.y, (float)pos2.x, (float)pos2.y });
+			});
 	}
 
-	if (sizeClass != SizeClass::None)
+	// Trail points first so they're underneath, as in Render. Only TrailMode::Points trails are drawn, the other
+	// modes' trails only exist as Allegro primitives and bitmaps.
+	auto toArgb = [](ALLEGRO_COLOR const& c)
 	{
-		// Calculate screen pos of particle
-		auto scPos = WorldToScreen(pos);
-		float x = scPos.x, y = scPos.y;
-
-		switch (sizeClass)
+		return ((uint32_t)(c.a * 255.f + 0.5f) << 24) | ((uint32_t)(c.r * 255.f + 0.5f) << 16) | ((uint32_t)(c.g * 255.f + 0.5f) << 8) | (uint32_t)(c.b * 255.f + 0.5f);
+	};
+	const uint32_t trailColour = 0xff808080;
+	const size_t numTrails = m_showTrails && m_trailMode == TrailMode::Points ? m_trails.size() / drawTrailInterval : 0;
+	const size_t numParticles = _particles.size();
+	frame->items.resize(numTrails + numParticles + _ballisticParticles.size());
+	m_renderThreadPool.ParallelFor(frame->items.size(), [&](size_t begin, size_t end)
 		{
-			case SizeClass::Large:
-			{
-				al_draw_circle(x, y, 10, _particle.m_col, particleEdgeThickness);
-				al_draw_line((int)(x - 10), (int)y, (int)(x + 10), y, _particle.m_col, 1.f);
-				al_draw_line(x, (int)(y - 7.5f), x, (int)(y + 7.5f), _particle.m_col, 1.f);
-				break;
-			}
-			case SizeClass::Normal:
+			for (size_t i = begin; i < end; ++i)
 			{
-				al_draw_circle(x, y, size, _particle.m_col, particleEdgeThickness);
-				break;
-			}
-			case SizeClass::Small:
-			{
-				al_draw_pixel((int)x, (int)y, _particle.m_col);
-				break;
+				if (i < numTrails)
+				{
+					const TrailStore::Point point = m_trails[i * drawTrailInterval];
+					frame->items[i] = { VectorType(point.x, point.y), point.mass, trailColour };
+				}
+				else
+				{
+					const size_t p = i - numTrails;
+					ParticleList const& list = p < numParticles ? _particles : _ballisticParticles;
+					const size_t j = p < numParticles ? p : p - numParticles;
+					frame->items[i] = { list.GetPos(j), list.GetMass(j), toArgb(list.GetColour(j)) };
+				}
 			}
-		}
+		});
+
+	m_frameWriter->Submit(frame, stringFormat("%s/frame_%06d.png", m_frameDirectory.c_str(), m_frameNumber++));
+}
 
-		if (m_debugParticleInfo && !_isTrail)
+void Universe::RunHeadless(int _numUpdates, string const& _directory)
+{
+	// Everything runs on this thread apart from the frames, which are rendered and written while the next updates
+	// run. There's no keyboard to turn trails on with, so they're on.
+	m_showTrails = true;
+	m_trailMode = TrailMode::Points;
+	m_compactSnapshots = false;
+	m_pendingView = { m_cameraPos, m_viewportWidth };
+	m_frameDirectory = _directory;
+	filesystem::create_directories(m_frameDirectory);
+
+	const double start = TimingManager::GetTime();
+	for (int update = 0; update < _numUpdates; ++update)
+	{
+		RunSimulationUpdate();
+		m_snapshots.Acquire();
+		Snapshot const& snapshot = m_snapshots.GetReadBuffer();
+
+		m_trails.SetCapacity(max(m_maxTrails.get(), 0));
+		if (m_maxTrails > 0 && m_createTrailIntervalCounter++ % m_createTrailInterval == 0)
 		{
-			ostringstream ss;
-			ss << "m:" << setprecision(2) << _particle.m_mass << " sp:" << setprecision(8) << _particle.GetVel().Mag();
-			al_draw_textf(g_font, g_colWhite, (int)x, (int)y, 0, ss.str().c_str(), _particle.m_mass, _particle.GetVel().Mag());
-			al_draw_line(x, y, x + _particle.GetVel().x, y + _particle.GetVel().y, _particle.m_col, 1.f);
+			m_trails.Append(snapshot.particles);
+			m_trails.Append(snapshot.ballisticParticles);
 		}
+
+		CaptureFrame(snapshot.particles, snapshot.ballisticParticles, true);
 	}
+	if (m_frameWriter)
+		m_frameWriter->Wait();
+	WaitForRecording();
+
+	argDebugf("Wrote %d frames to %s in %.1f s, %d failed", m_frameWriter ? (int)m_frameWriter->GetNumWritten() : 0, _directory.c_str(), TimingManager::GetTime() - start, m_frameWriter ? (int)m_frameWriter->GetNumFailed() : 0);
 }
 
 void Universe::CreateUniverse(int _id)
@@ -1225,7 +2970,11 @@ void Universe::CreateUniverse(int _id)
 	m_gravitationalConstant = DEFAULT_G;
 
 	m_particles.clear();
-	m_trails.clear();
+	m_ballisticParticles.clear();
+	m_particleSlots.clear();
+	m_macroParticles.clear();
+	m_coarseningStats = {};
+	ClearTrails();
 
 	m_cameraPos.x = 400.f;
 	m_cameraPos.y = 300.f;
@@ -1427,10 +3176,6 @@ void Universe::CreateUniverse(int _id)
 			AddParticle(VectorType(400, 300), VectorType(0, 0.2), 100000);
 		}
 	}
-
-#if 0
-	m_cameraFollow = m_particles.end();
-#endif
 }
 
 void Universe::MakeSpiralUniverse(float startMass, int numParticles, float r, float rStep, float step, float massDecrease, float velMultiplier)
@@ -1465,14 +3210,27 @@ void Universe::Save()
 	// todo change to use Particle operator <<
 	ofstream file(saveLoadFilename, std::ios::trunc);
 	file.exceptions(std::ifstream::failbit | std::ifstream::badbit | std::ifstream::eofbit);
+	// Macro particles are saved as their constituents, the save file doesn't know about coarsening
+	vector<Particle> refined;
+	for (auto const* particles : { &m_particles, &m_ballisticParticles })
+	{
+		for (auto const& p : *particles)
+		{
+			if (p.IsMacro())
+				RefineMacroParticle(p, refined);
+			else
+				refined.push_back(p);
+		}
+	}
+
 	ostringstream ss;
-	ss << m_particles.size() << endl;
+	ss << refined.size() << endl;
 	file.write(ss.str().c_str(), ss.str().size());
-	for (auto const& p : m_particles)
+	for (auto const& p : refined)
 	{
 		ss.str("");
 		ss.clear();
-		ss << p.m_pos.x << " " << p.m_pos.y << " " << p.m_mass << " " << p.m_vel.x << " " << p.m_vel.y << " " << p.m_col.r << " " << p.m_col.g << " " << p.m_col.b << endl;
+		ss << p.m_pos.x << " " << p.m_pos.y << " " << p.m_mass << " " << p.m_vel.x << " " << p.m_vel.y << " " << p.GetColour().r << " " << p.GetColour().g << " " << p.GetColour().b << endl;
 		file.write(ss.str().c_str(), ss.str().size());
 	}
 }
@@ -1484,7 +3242,11 @@ void Universe::Load()
 		return;
 
 	m_particles.clear();
-	m_trails.clear();
+	m_ballisticParticles.clear();
+	m_particleSlots.clear();
+	m_macroParticles.clear();
+	m_coarseningStats = {};
+	ClearTrails();
 	ifstream file(saveLoadFilename);
 	//file.exceptions(std::ifstream::failbit | std::ifstream::badbit | std::ifstream::eofbit);
 	int numParticles = -1;
@@ -1500,14 +3262,16 @@ void Universe::Load()
 			ALLEGRO_COLOR col;
 			decltype(Particle::m_mass) mass;
 			iss >> pos.x >> pos.y >> mass >> vel.x >> vel.y >> col.r >> col.g >> col.b;
-			m_particles.emplace_back(pos, vel, mass, col);
+			AddParticle(pos, vel, mass, col);
 		}
 	}
+	ParticlesReordered();
 }
 
 void Universe::AdvanceMenu()
 {
 	// We now have two menus, old and new!
+	// The config menu's changes are made between simulation updates, see CreateConfigMenu
 	if (m_showConfigMenu)
 		m_configMenu->update(al_get_display_height(g_display));
 
@@ -1521,11 +3285,11 @@ void Universe::AdvanceMenu()
 			}
 			else if (Keyboard::keyCurrentlyDown(ALLEGRO_KEY_J))
 			{
-				Save();
+				RunWithSimulationPaused([&] { Save(); });
 			}
 			else if (Keyboard::keyCurrentlyDown(ALLEGRO_KEY_L))
 			{
-				Load();
+				RunWithSimulationPaused([&] { Load(); });
 			}
 			break;
 		}
@@ -1539,7 +3303,7 @@ void Universe::AdvanceMenu()
 			{
 				if (Keyboard::keyCurrentlyDown(ALLEGRO_KEY_0 + key))
 				{
-					CreateUniverse(key);
+					RunWithSimulationPaused([&] { CreateUniverse(key); });
 					m_currentMenuPage = MenuPage::Default;
 				}
 			}
@@ -1601,21 +3365,10 @@ VectorType Universe::ScreenToWorld(const VectorType& _screen)
 	return VectorType((_screen.x + (leftEdge * rx)) / rx, (_screen.y + (topEdge * ry)) / ry);
 }
 
-decltype(Universe::m_particles)::iterator Universe::FindNearest(VectorType const& _pos)
+ParticleId Universe::PickParticle(VectorType const& _screenPos)
 {
-	float nearestDistSq = FLT_MAX;
-	auto bestP = m_particles.end();
-	auto i = m_particles.begin();
-	for (; i != m_particles.end(); ++i)
-	{
-		float distSq = (_pos - i->GetPos()).MagSq();
-		if (distSq < nearestDistSq)
-		{
-			nearestDistSq = distSq;
-			bestP = i;
-		}
-	}
-	return bestP;
+	const uint32_t nearest = m_particleTree.FindNearest(ScreenToWorld(_screenPos), rightClickDeleteMaxPixelDistance * m_viewportWidth / m_scW);
+	return nearest != KdTree::npos ? m_particleTreeIds[nearest] : 0;
 }
 
 std::unique_ptr<PSectorMenu> Universe::CreateConfigMenu()
@@ -1627,6 +3380,10 @@ std::unique_ptr<PSectorMenu> Universe::CreateConfigMenu()
 		35,		// yInc
 		32		// buttonHeight
 	};
+	// Options are read by the simulation thread, so they're only changed while it's paused. That holds the frame up
+	// until the current update finishes, but only on the frame something changes. They're changed here rather than
+	// queued as commands because the menu reads them on this thread to show them.
+	menuLayoutOptions.applyChange = [this](std::function<void()> const& _change) { RunWithSimulationPaused(_change); };
 	auto menu = make_unique<PSectorMenu>(menuLayoutOptions);
 	int headingX = 100;
 	int textX = 120;
@@ -1640,20 +3397,49 @@ std::unique_ptr<PSectorMenu> Universe::CreateConfigMenu()
 	//menu->addAction(textX, "Load all options to config file (NOT YET IMPLEMENTED)", [&] {  });
 	menu->addAction(textX, "Reset all to defaults", [&] { for (auto& option : m_allOptions) option->resetToDefault(); });
 	
+	menu->addHeading(headingX, "Simulation");
+	menu->add(textX, m_timeStep, 0.05f, 20.f, 0.05f);
+	menu->add(textX, m_updatesPerSecond, 0, 1000, 5);
+	menu->add(textX, m_fastForwardBudgetMs, 1.f, 1000.f, 1.f);
+
+	menu->add(textX, m_neighbourListSkin, 0.f, 10000.f, 5.f);
+
 	menu->addHeading(headingX, "Grid");
 	menu->add(textX, m_gridRowsCols, 1, 100);
 	menu->add(textX, m_highAccuracyGridDistance, 0, 100);
 
+	menu->addHeading(headingX, "Particle mesh");
+	menu->addPowerOf2(textX, m_meshRowsCols, 8, 1024);
+	menu->add(textX, m_meshSplitCells, 0.25f, 8.f, 0.25f);
+
+	menu->addHeading(headingX, "Ballistic tier");
+	menu->add(textX, m_ballisticRadius, 1000.f, 1000000.f, 1000.f);
+
+	menu->addHeading(headingX, "Coarsening");
+	menu->add(textX, m_coarsenMassFraction, 0.f, 1.f, 0.0005f);
+	menu->add(textX, m_coarsenCellSize, 10.f, 100000.f, 10.f);
+	menu->add(textX, m_coarsenDistance, 100.f, 1000000.f, 100.f);
+
+	menu->addHeading(headingX, "View fidelity");
+	menu->add(textX, m_fidelityMargin, 0.f, 100.f, 0.1f);
+	menu->add(textX, m_fidelityBand, 0.f, 100.f, 0.1f);
+	menu->add(textX, m_fidelityMaxInterval, 1, 64, 1);
+
 	menu->addHeading(headingX, "Spiral");
 	menu->add(textX, m_numSpiralParticles, 0, 100000, 250);
 
 	menu->addHeading(headingX, "Particles");
 	menu->add(textX, m_sizeLogBase, 1.05f, 10.f, 0.05f);
+	menu->add(textX, m_densityThreshold, 1.f, 1000.f, 0.5f);
 
 	menu->addHeading(headingX, "Trails");
 	menu->add(textX, m_createTrailInterval, 1, 1000);
-	menu->add(textX, m_maxTrails, 0, 500000, 1000);
-	menu->addAction(textX, "Clear trails", [&] { m_trails.clear(); });
+	menu->add(textX, m_maxTrails, 0, 10000000, 10000);
+	menu->add(textX, m_trailTolerance, 0.1f, 10.f, 0.1f);
+	menu->add(textX, m_maxTrailLines, 0, 10000000, 10000);
+	menu->add(textX, m_maxTrailVertices, 2, 100000, 100);
+	menu->add(textX, m_trailFadeTime, 0.1f, 60.f, 0.1f);
+	menu->addAction(textX, "Clear trails", [&] { ClearTrails(); });
 
 	return menu;
 }
@@ -1,90 +1,192 @@
 #pragma once
 
-#include <deque>
+#include <algorithm>
+#include <atomic>
+#include <cfloat>
+#include <condition_variable>
+#include <functional>
 #include <vector>
 #include <limits>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 
 #include "ARGCore/ARGUtils.h"
 #include "ARGCore/Vector2.h"
 #include "ARGCore/Config.h"
 #include "ARGCore/PSectorMenu.h"
+#include "ARGCore/TripleBuffer.h"
+#include "ARGCore/ThreadPool.h"
+#include "ARGCore/TaskGraph.h"
+#include "ARGCore/Arena.h"
+#include "ARGCore/Numa.h"
+#include "ARGCore/SlotMap.h"
+#include "ARGCore/KdTree.h"
+
+#include "CompactParticles.h"
+#include "DensityMap.h"
+#include "FrameWriter.h"
+#include "Particle.h"
+#include "ParticleList.h"
+#include "ParticleMesh.h"
+#include "ParticleRenderer.h"
+#include "TrailBitmap.h"
+#include "TrailPolylines.h"
+#include "TrailStore.h"
 
 #include <allegro5/allegro.h>
+#include <allegro5/allegro_primitives.h>
 
-using VectorType = Vector2Base<double>;
-
-struct Particle
+class Universe
 {
-	VectorType m_pos;
-	VectorType m_vel;
-
-	float m_mass;
-
-	ALLEGRO_COLOR m_col;
-
-	Particle():
-		m_mass(1),
-		m_pos({ 0,0 }),
-		m_col(al_map_rgb(255,255,255))
+private:
+	// Split between NUMA nodes, see ParallelForParticles
+	NumaVector<Particle> m_particles;
+	TrailStore m_trails;		// main thread only, see Advance
+	TrailPolylines m_trailPolylines;	// used instead of m_trails in TrailMode::Polylines
+	std::vector<ALLEGRO_VERTEX> m_trailVertices;	// every polyline's segments, drawn as one line list
+	TrailBitmap m_trailBitmap;			// and this in TrailMode::Bitmap
+	double m_trailBitmapTime = 0.;		// when it was last faded
+
+	// Turns particles and trail points into vertices to draw. It has a few workers of its own rather than using
+	// m_threadPool, as the main thread helps out while it waits and could end up running a whole step stage mid frame.
+	ParticleRenderer m_particleRenderer;
+	ThreadPool m_renderThreadPool;
+	DiscAtlas m_discAtlas;				// created on first use, as it needs the display
+	bool m_useDiscSprites = true;		// draw circles from m_discAtlas rather than as rings
+	bool m_lockPixels = false;			// write single pixels straight into the locked screen, see ParticleRenderer
+
+	// This frame's particles as drawn, then the ballistic ones after them, for picking and culling. The IDs are kept
+	// so picking in Advance still works once the particles themselves have been replaced by the next snapshot.
+	KdTree m_particleTree;
+	std::vector<ParticleId> m_particleTreeIds;
+	float m_particleTreeMaxMass = 0.f;			// for culling
+	bool m_particleTreeStale = true;			// there's been a new snapshot since it was built
+	bool m_particleTreeInterpolated = false;	// built from interpolated positions, which will have moved on
+	std::vector<uint32_t> m_visibleParticles;	// indices into m_particleTree's points, scratch for Render
+
+	DensityMap m_densityMap;
+	enum class DensityMode
 	{
-	}
-
-	Particle(VectorType _pos, VectorType _vel, float _mass, ALLEGRO_COLOR _col):
-			m_pos(_pos),
-			m_vel(_vel),
-			m_mass(_mass),
-			m_col(_col)
+		Off,
+		Auto,		// when there are more than m_densityThreshold particles on each pixel with any
+		On,
+		Count
+	} m_densityMode = DensityMode::Off;	// the histograms are screen sized, so nothing's allocated until it's switched on
+	bool m_densityAutoOn = false;
+	int m_densityCheckCounter = 0;
+
+	// Frames drawn with SoftwareRenderer and written as PNGs while the simulation carries on, see CaptureFrame. The
+	// writer is created on first use, as it has a thread pool of its own.
+	std::unique_ptr<FrameWriter> m_frameWriter;
+	bool m_writeFrames = false;
+	std::string m_frameDirectory;
+	int m_frameNumber = 0;
+	size_t m_framesDropped = 0;		// while all the frames were still being written, in windowed mode
+
+	// Particles which have escaped the system. These are kept out of m_particles so they don't cost a full
+	// interaction each step or stretch the grid extents, see UpdateBallisticTier
+	NumaVector<Particle> m_ballisticParticles;
+
+	// Where each particle is, looked up by its m_id: an index into m_particles, or into m_ballisticParticles with
+	// ballisticLocation added, or SlotMap::none for constituents of macro particles. Steps move particles around
+	// freely and this is brought up to date by UpdateParticleSlots when a snapshot is published, so it's only right
+	// between updates, which is when commands run.
+	SlotMap m_particleSlots;
+	static constexpr uint32_t ballisticLocation = 1u << 31;
+
+	// Constituents of coarsened macro particles, see UpdateCoarsening
+	struct MacroParticle
 	{
-	}
-
-	Particle(const Particle& other) = default;
-
-	Particle(Particle&&) noexcept = default;
-	Particle& operator=(Particle&&) noexcept = default;
-
-	__forceinline VectorType GetPos() const { return m_pos; }
-	__forceinline VectorType GetVel() const { return m_vel; }
-	__forceinline void SetPos(VectorType _pos) { m_pos = _pos; }
-	__forceinline void SetVel(VectorType _vel) { m_vel = _vel; }
-	__forceinline void AddToVel(VectorType _vel) { m_vel += _vel; }
-
-	__forceinline float GetMass() const { return m_mass; }
-	__forceinline void SetMass(float _mass) { m_mass = _mass; }
-
-	//__forceinline float GetSize(float logBase) const { return log(m_mass) * 2.5f; }
-	__forceinline float GetSize(float logBase) const { return (log(m_mass) / log(logBase)) * 2.5f; }
-
-	void operator = (Particle const& _param)
+		std::vector<Particle> constituents;	// pos and vel relative to the macro particle, so their weighted sums are zero
+		double rmsOffset = 0.;				// mass weighted
+		double rmsVelOffset = 0.;
+		unsigned long long createdStep = 0;
+		ParticleId followed = 0;			// the constituent the camera was following when it was coarsened, if any
+	};
+	std::unordered_map<ParticleId, MacroParticle> m_macroParticles;	// by the macro particle's ID
+
+	struct CoarseningStats
 	{
-		m_pos = _param.GetPos();
-		m_vel = _param.GetVel();
-		m_mass = _param.GetMass();
-		m_col = _param.m_col;
-	}
-
-	void Merge(Particle const& _other)
+		size_t macroCount = 0;
+		size_t constituentCount = 0;
+		double rmsOffset = 0.;		// mass weighted over all constituents
+		double maxDrift = 0.;		// estimate of the worst position error from freezing constituents in place
+	} m_coarseningStats;
+	unsigned m_coarseningChanges = 0;	// times UpdateCoarsening has coarsened or refined anything, see StepShape
+
+	std::vector<float> m_sizes;			// cached GetSize for each of m_particles, updated at the start of each step
+	std::vector<float> m_kickScales;	// gravity velocity change multiplier for each of m_particles this step, 0 = skip
+	size_t m_subCycledCount = 0;		// particles with a kick interval above 1, for the HUD
+	size_t m_skippedKickCount = 0;		// particles with no kick this step
+	std::vector<size_t> m_sweepOrder;	// collision broadphase order, kept between steps as it changes very little
+	NumaVector<Particle> m_compactedParticles;	// survivors of merges are moved here, then it's swapped with m_particles
+
+	// Workers for the step's stages and anything else the simulation wants done in parallel. The step graph is built
+	// once and run for each step, see BuildStepGraph.
+	ThreadPool m_threadPool;
+	ThreadPool m_recordingThreadPool;	// a single worker, so the recording never runs on a thread a step is waiting on
+	TaskGraph m_stepGraph;
+	std::vector<double> m_stageMs;		// smoothed time for each task in m_stepGraph
+	std::vector<double> m_nodeBandwidth;	// GB/s for each NUMA node, empty until measured with N
+
+	// Verlet style neighbour lists, shared by the grid based gravity update (near field) and the collision
+	// broadphase (merge candidates). They're built with a skin distance and reused until some particle has moved
+	// more than half the skin from where it was when they were built, see UpdateNeighbourLists.
+	struct NeighbourLists
 	{
-		float ratio = m_mass / (m_mass + _other.m_mass);
-		float otherRatio = 1.f - ratio;
-		m_pos = m_pos * ratio + _other.m_pos * otherRatio;
-		m_vel = m_vel * ratio + _other.m_vel * otherRatio;
-		m_mass += _other.m_mass;
-	}
-};
-
-class Universe
-{
-private:
-	std::vector<Particle> m_particles;
-	std::deque<Particle> m_trails;
+		bool valid = false;
+		size_t particleCount = 0;
+		double skin = 0.;
+		std::vector<VectorType> builtPositions;
+
+		// Grid based mode. Square membership is frozen until the next rebuild, so a particle is still treated as
+		// being in its square if it has drifted slightly out of it. Near field pairs are kept implicitly as square
+		// membership plus a list of near squares, explicit pairs would need hundreds of MB at 100k particles.
+		bool hasGrid = false;
+		int gridRowsCols = 0;
+		int highAccuracyGridDistance = 0;
+		std::vector<std::vector<size_t>> squareParticles;	// indexed by square (row * gridRowsCols + col)
+		std::vector<int> nonEmptySquares;
+		std::vector<std::vector<int>> nearSquares;			// only squares with a higher index, so each pair is done once
+		std::vector<std::vector<int>> farSquares;
+		size_t nearPairCount = 0;
+
+		// Pairs close enough that they might collide before the next rebuild
+		std::vector<std::pair<size_t, size_t>> mergeCandidates;
+
+		// Stats for the HUD
+		unsigned rebuilds = 0;
+		unsigned stepsSinceRebuild = 0;
+		float averageStepsBetweenRebuilds = 0.f;
+	} m_neighbourLists;
 
 	// Config options
 	ConfigOptionWrapper<int> m_maxTrails;
+	ConfigOptionWrapper<float> m_trailTolerance;		// polyline trails, in pixels at the zoom when the points were added
+	ConfigOptionWrapper<int> m_maxTrailLines;			// polyline trails, one for each particle up to this many
+	ConfigOptionWrapper<int> m_maxTrailVertices;		// for each polyline trail
+	ConfigOptionWrapper<float> m_trailFadeTime;			// bitmap trails, seconds
 	ConfigOptionWrapper<int> m_createTrailInterval;	// 1 = add to trails every frame, etc
 	ConfigOptionWrapper<float> m_sizeLogBase;
+	ConfigOptionWrapper<float> m_densityThreshold;		// particles per occupied pixel for DensityMode::Auto
 	ConfigOptionWrapper<int> m_gridRowsCols;
 	ConfigOptionWrapper<int> m_highAccuracyGridDistance;
+	ConfigOptionWrapper<int> m_meshRowsCols;
+	ConfigOptionWrapper<float> m_meshSplitCells;			// long/short range split scale, in mesh cells
 	ConfigOptionWrapper<int> m_numSpiralParticles;
+	ConfigOptionWrapper<float> m_ballisticRadius;		// distance from centre of mass beyond which unbound particles go ballistic
+	ConfigOptionWrapper<float> m_timeStep;
+	ConfigOptionWrapper<float> m_neighbourListSkin;
+	ConfigOptionWrapper<float> m_coarsenMassFraction;	// particles lighter than this fraction of the heaviest can be coarsened
+	ConfigOptionWrapper<float> m_coarsenCellSize;
+	ConfigOptionWrapper<float> m_coarsenDistance;		// minimum distance from massive bodies
+	ConfigOptionWrapper<float> m_fidelityMargin;		// full fidelity this far outside the view, in viewport widths
+	ConfigOptionWrapper<float> m_fidelityBand;			// transition band width, in viewport widths
+	ConfigOptionWrapper<int> m_fidelityMaxInterval;		// kick interval beyond the band, rounded down to a power of 2
+	ConfigOptionWrapper<int> m_updatesPerSecond;		// simulation thread rate, 0 = as fast as possible
+	ConfigOptionWrapper<float> m_fastForwardBudgetMs;	// time spent stepping per update while fast forwarding
+	ConfigOptionWrapper<bool> m_arenaLargePages;		// only read at startup
 
 	std::unique_ptr<PSectorMenu> m_configMenu;
 
@@ -94,6 +196,13 @@ private:
 
 	int m_createTrailIntervalCounter;
 	bool m_showTrails;
+	enum class TrailMode
+	{
+		Points,
+		Polylines,
+		Bitmap,
+		Count
+	} m_trailMode;
 
 	double m_gravitationalConstant;
 
@@ -105,13 +214,37 @@ private:
 	float m_worldAspectRatio;
 
 	VectorType m_cameraPos;
-	//decltype(m_particles)::iterator m_cameraFollow;	// disabled as becomes invalidated when vector size changes
+	std::atomic<ParticleId> m_cameraFollow;	// 0 for none, set by the main thread, by merges and by coarsening
 
-	bool m_useGridBasedMode;
+	enum class GravityMode
+	{
+		Normal,
+		GridBased,
+		ParticleMesh,
+		Count
+	};
+
+	// Toggled by the main thread and read by the simulation
+	std::atomic<GravityMode> m_gravityMode;
+	std::atomic<bool> m_useBallisticTier;
+	std::atomic<bool> m_useCoarsening;
+	std::atomic<bool> m_useViewFidelity;
+	std::atomic<bool> m_deterministic;		// same result for any number of threads, see RunTileRounds
+	std::atomic<bool> m_compactSnapshots;	// see CompactParticles
+
+	ParticleMesh m_particleMesh;
+
+	unsigned long long m_stepCount;
+	double m_simulationTime;
+
+	// Monopole of the interacting particles, updated each step by UpdateBallisticTier
+	VectorType m_systemCentre;
+	VectorType m_systemVel;
+	double m_systemMass;
 
 	//bool m_debug;
 	bool m_debugParticleInfo;
-	bool m_freeze;
+	std::atomic<bool> m_freeze;
 
 	double m_userGeneratedParticleMass;
 
@@ -130,21 +263,180 @@ private:
 
 	/**************/
 
+	/*********************/
+	/* Simulation thread */
+
+	// The simulation runs on its own thread (or inline in Advance if m_useSimulationThread is off) and everything
+	// above which is part of the simulation state belongs to it. The main thread only reads the simulation through
+	// snapshots, and changes it either by queueing a command, which runs before the next update, or for things like
+	// loading a save which replace everything, by pausing the simulation with RunWithSimulationPaused.
+	struct Snapshot
+	{
+		// Either the particles as they are, or in compact mode packed into CompactParticles, which the main thread
+		// reads where they are (see GetParticles)
+		bool compact = false;
+		std::vector<Particle> particles;
+		std::vector<Particle> ballisticParticles;
+		CompactParticles compactParticles;
+		CompactParticles compactBallisticParticles;
+
+		// For the HUD
+		unsigned long long stepCount = 0;
+		double msPerStep = 0.;
+		double stepsPerSecond = 0.;
+
+		double publishTime = 0.;		// TimingManager::GetTime() when it was published
+		double simulationTime = 0.;		// total of all the time steps so far
+		float averageStepsBetweenRebuilds = 0.f;
+		unsigned neighbourListRebuilds = 0;
+		size_t nearPairCount = 0;
+		size_t mergeCandidateCount = 0;
+		CoarseningStats coarseningStats;
+		size_t subCycledCount = 0;
+		size_t skippedKickCount = 0;
+		unsigned long long stateHash = 0;	// of the particles, only in deterministic mode
+		std::vector<std::pair<const char*, double>> stageMs;
+
+		// Where m_cameraFollow was in the particles when this was published, so the main thread doesn't have to look
+		ParticleId cameraFollow = 0;
+		uint32_t cameraFollowLocation = SlotMap::none;
+	};
+	TripleBuffer<Snapshot> m_snapshots;
+	CompactParticles::Scratch m_compactScratch;		// for PublishSnapshot
+
+	// Main thread copy of the snapshot before the latest one, for interpolating between them in Render. Kept compact
+	// if it was compact.
+	struct PreviousSnapshot
+	{
+		bool compact = false;
+		std::vector<Particle> particles;
+		std::vector<Particle> ballisticParticles;
+		CompactParticles compactParticles;
+		CompactParticles compactBallisticParticles;
+		double publishTime = 0.;
+		double simulationTime = 0.;
+		bool matched = false;		// m_previousLocations is up to date, see MatchPreviousSnapshot
+	} m_previousSnapshot;
+
+	// The latest snapshot's particles' positions interpolated for this frame, the particles then the ballistic ones,
+	// which Render draws in place of the snapshot's own positions
+	std::vector<VectorType> m_renderPositions;
+	std::vector<uint32_t> m_previousLocations;	// where each of those was in m_previousSnapshot, or SlotMap::none
+	std::vector<uint32_t> m_previousBySlot;		// scratch for MatchPreviousSnapshot, kept all SlotMap::none
+	bool m_interpolateSnapshots;
+
+	struct View
+	{
+		VectorType cameraPos;
+		double viewportWidth = 0.;
+	};
+	View m_pendingView;		// copied from the main thread each frame, under m_commandMutex
+	View m_simulationView;	// what the simulation uses, for view fidelity and coarsening
+
+	std::mutex m_commandMutex;
+	std::vector<std::function<void()>> m_commands;
+
+	std::thread m_simulationThread;
+	std::mutex m_simulationMutex;	// held by the simulation thread for each update
+	std::condition_variable m_simulationCondition;
+	std::atomic<int> m_pauseRequests;
+	std::atomic<bool> m_quitSimulationThread;
+	std::atomic<bool> m_fastForward;
+	bool m_useSimulationThread;
+
+	// Recording is written from the last snapshot on the thread pool while the next update runs
+	std::atomic<bool> m_recordingInProgress;
+	Snapshot const* m_recordingSnapshot = nullptr;
+	std::vector<char> m_recordingBuffer;
+
+	double m_msPerStep;
+	double m_stepsPerSecond;
+	double m_stepRateStartTime;
+	unsigned long long m_stepRateStartCount;
+
+	void StartSimulationThread();
+	void StopSimulationThread();
+	void SimulationThreadMain();
+	void RunSimulationUpdate();
+	void PublishSnapshot();
+	void WriteRecording(Snapshot const& _snapshot);
+	void WaitForRecording();
+	void QueueCommand(std::function<void()> _command);
+	void RunWithSimulationPaused(std::function<void()> const& _function);
+
+	/*********************/
+
 
 public:
 	Universe();
+	~Universe();
 	void Advance(float _deltaTime);
 	void Render();
 	void OnClose();
 
+	// Runs _numUpdates simulation updates on the calling thread without a display, writing a frame after each
+	void RunHeadless(int _numUpdates, std::string const& _directory);
+
 private:
 	void AddParticle(VectorType _pos, VectorType _vel, float _mass, ALLEGRO_COLOR _col);
-	void AddTrailParticle(VectorType _pos, float _mass);
+	void ClearTrails();
+	void RemoveParticle(ParticleId _id);
+	void UpdateParticleSlots();
+	void ParticlesReordered();		// call after anything moves particles to different indices
+
+	void Step();
+	void BuildStepGraph();
+
+	// ParallelFor over the indices of m_particles, split between the NUMA nodes the same way the array's memory is
+	template<typename Fn>
+	void ParallelForParticles(Fn&& _fn, size_t _grain = 0)
+	{
+		m_threadPool.ParallelFor(m_particles.size(), std::forward<Fn>(_fn), _grain, m_particles.capacity());
+	}
+
+#ifdef _DEBUG
+	// For checking steady state steps don't allocate, see Step
+	struct StepShape
+	{
+		size_t particleCount = 0;
+		size_t ballisticCount = 0;
+		unsigned neighbourListRebuilds = 0;
+		unsigned coarseningChanges = 0;
+		GravityMode gravityMode = GravityMode::Normal;
+		bool deterministic = false;
+		int meshRowsCols = 0;
+		int gridRowsCols = 0;
+
+		bool operator==(StepShape const& _other) const
+		{
+			return particleCount == _other.particleCount && ballisticCount == _other.ballisticCount
+				&& neighbourListRebuilds == _other.neighbourListRebuilds && coarseningChanges == _other.coarseningChanges && gravityMode == _other.gravityMode
+				&& deterministic == _other.deterministic && meshRowsCols == _other.meshRowsCols && gridRowsCols == _other.gridRowsCols;
+		}
+	};
+	StepShape GetStepShape() const;
+	StepShape m_lastStepShape;
+#endif
 
 	void AdvanceGravityNormalMode();
+	void AdvanceGravityNormalModeDeterministic();
 	void AdvanceGravityGridBasedMode();
-
-	void RenderParticle(Particle const & _particle, float _sizeLogBase, bool _isTrail = false);
+	void AdvanceGravityGridBasedModeDeterministic();
+	void AdvanceGravityParticleMeshMode();
+	void AdvanceBallisticParticles();
+	void UpdateBallisticTier();
+	void DetectCollisions();
+	void UpdateNeighbourLists();
+	void UpdateCoarsening();
+	void UpdateKickIntervals();
+	template<typename Vector>
+	void RefineMacroParticle(Particle const& _macro, Vector& _dest);	// appends the constituents to _dest
+
+	void RenderParticleInfo(Particle const & _particle);
+
+	// Copies what Render would draw into a frame for m_frameWriter. If all its frames are busy, _wait waits for one,
+	// otherwise this frame is dropped.
+	void CaptureFrame(ParticleList const& _particles, ParticleList const& _ballisticParticles, bool _wait);
 
 	void CreateUniverse(int _id);
 
@@ -156,21 +448,77 @@ private:
 	VectorType WorldToScreen(const VectorType& _world);
 	VectorType ScreenToWorld(const VectorType& _screen);
 
-	decltype(m_particles)::iterator FindNearest(VectorType const& _pos);
+	void MatchPreviousSnapshot(Snapshot const& _latest);
+	void InterpolateRenderParticles(Snapshot const& _latest, double _alpha, double _time);
+	void GetPrevious(uint32_t _location, VectorType& _pos, VectorType& _vel) const;
+
+	// The snapshot's particles, wherever they are
+	static ParticleList GetParticles(Snapshot const& _snapshot) { return _snapshot.compact ? ParticleList(_snapshot.compactParticles) : ParticleList(_snapshot.particles); }
+	static ParticleList GetBallisticParticles(Snapshot const& _snapshot) { return _snapshot.compact ? ParticleList(_snapshot.compactBallisticParticles) : ParticleList(_snapshot.ballisticParticles); }
+
+	// Nearest particle drawn last frame within rightClickDeleteMaxPixelDistance, 0 if there isn't one
+	ParticleId PickParticle(VectorType const& _screenPos);
 
-	template<typename T>
-	void GetGridExtents(T const& particles, double& minX, double& maxX, double& minY, double& maxY, double& gridW, double& gridH, double& stepX, double& stepY)
+	struct AABB
+	{
+		double minX, maxX, minY, maxY;
+	};
+
+	// Sort and sweep along x, calls _callback(i, j) for each pair of overlapping boxes. m_sweepOrder is kept between
+	// calls since the order changes very little from one step to the next, which makes the insertion sort close to
+	// O(N). It's cleared by ParticlesReordered, and started again if particles have been added or removed.
+	template<typename Callback>
+	void SweepAndPrune(ArenaVector<AABB> const& _boxes, Callback&& _callback)
+	{
+		const size_t count = _boxes.size();
+		auto byMinX = [&](size_t a, size_t b) { return _boxes[a].minX < _boxes[b].minX; };
+		if (m_sweepOrder.size() != count)
+		{
+			m_sweepOrder.resize(count);
+			for (size_t i = 0; i < count; ++i)
+				m_sweepOrder[i] = i;
+			std::sort(m_sweepOrder.begin(), m_sweepOrder.end(), byMinX);
+		}
+		else
+		{
+			for (size_t a = 1; a < count; ++a)
+			{
+				size_t i = m_sweepOrder[a];
+				size_t b = a;
+				for (; b > 0 && byMinX(i, m_sweepOrder[b - 1]); --b)
+					m_sweepOrder[b] = m_sweepOrder[b - 1];
+				m_sweepOrder[b] = i;
+			}
+		}
+
+		for (size_t a = 0; a < count; ++a)
+		{
+			const size_t i = m_sweepOrder[a];
+			for (size_t b = a + 1; b < count; ++b)
+			{
+				const size_t j = m_sweepOrder[b];
+				if (_boxes[j].minX > _boxes[i].maxX)
+					break;
+				if (_boxes[j].minY > _boxes[i].maxY || _boxes[j].maxY < _boxes[i].minY)
+					continue;
+				_callback(i, j);
+			}
+		}
+	}
+
+	void GetGridExtents(ParticleList const& particles, double& minX, double& maxX, double& minY, double& maxY, double& gridW, double& gridH, double& stepX, double& stepY)
 	{
 		const double minGridSize = 5000.f;
 
 		minX = minY = std::numeric_limits<double>::infinity();
 		maxX = maxY = -std::numeric_limits<double>::infinity();
-		for (auto const& p : particles)
+		for (size_t i = 0; i < particles.size(); ++i)
 		{
-			minX = std::min(minX, p.GetPos().x);
-			minY = std::min(minY, p.GetPos().y);
-			maxX = std::max(maxX, p.GetPos().x);
-			maxY = std::max(maxY, p.GetPos().y);
+			const VectorType pos = particles.GetPos(i);
+			minX = std::min(minX, pos.x);
+			minY = std::min(minY, pos.y);
+			maxX = std::max(maxX, pos.x);
+			maxY = std::max(maxY, pos.y);
 		}
 		gridW = maxX - minX;
 		gridH = maxY - minY;
@@ -192,5 +540,19 @@ private:
 		stepY = gridH / rowsCols;
 	}
 
+	// _fn(from, to) in screen space for each grid line, for the grid based gravity mode's grid around _particles
+	template<typename Fn>
+	void ForEachGridLine(ParticleList const& _particles, Fn&& _fn)
+	{
+		double minX, maxX, minY, maxY, gridW, gridH, stepX, stepY;
+		GetGridExtents(_particles, minX, maxX, minY, maxY, gridW, gridH, stepX, stepY);
+		const int gridRowsCols = m_gridRowsCols;
+		int gx = 0, gy = 0;
+		for (double x = minX; gx <= gridRowsCols; ++gx, x += stepX)
+			_fn(WorldToScreen({ x, minY }), WorldToScreen({ x, maxY }));
+		for (double y = minY; gy <= gridRowsCols; ++gy, y += stepY)
+			_fn(WorldToScreen({ minX, y }), WorldToScreen({ maxX, y }));
+	}
+
 	std::unique_ptr<PSectorMenu> CreateConfigMenu();
 };